@@ -0,0 +1,347 @@
+#define _GNU_SOURCE
+#include "array.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/stat.h>
+
+#define MAX_PIECES 32            // Pieces submitted together as one batch
+
+typedef struct Batch
+{
+    int Pending;                 // Queued pieces not yet finished
+    bool Failed;                 // Whether a queued piece came up short
+} Batch;
+
+typedef struct Request
+{
+    struct Member *Member;
+    bool Write;
+    char *Data;
+    size_t Length;
+    off_t Offset;                // Offset within the member image
+    Batch *Batch;
+    struct Request *Next;        // Member queue
+} Request;
+
+typedef struct Member
+{
+    int FileDescriptor;
+    size_t Inflight;             // Transfers under way, for balancing mirror reads
+    Request *Head, *Tail;        // Queued requests
+    pthread_cond_t Queued;       // Signalled when a request is queued
+    pthread_t Worker;
+    struct DiskArray *Array;
+} Member;
+
+struct DiskArray
+{
+    Member Members[ARRAY_MAX_MEMBERS];
+    size_t Count;
+    size_t Stripe;               // Stripe unit in bytes, 0 when mirroring
+    size_t Turn;                 // Rotates ties between mirrors
+
+    pthread_mutex_t Lock;        // Guards the queues and batches
+    pthread_cond_t Done;         // Signalled when a queued request completes
+    bool Stop;
+};
+
+// Member I/O ------------------------------------------------------------------
+
+// Transfer a range of one member image, continuing after short transfers
+static bool member_io(Member *m, bool write, char *data, size_t length, off_t offset) {
+    size_t done = 0;
+
+    __atomic_fetch_add(&m->Inflight, 1, __ATOMIC_RELAXED);
+    while (done < length) {
+        ssize_t n = write ? pwrite(m->FileDescriptor, data + done, length - done, offset + done)
+                          : pread(m->FileDescriptor, data + done, length - done, offset + done);
+        if (n <= 0) {
+            break;
+        }
+        done += n;
+    }
+    __atomic_fetch_sub(&m->Inflight, 1, __ATOMIC_RELAXED);
+    return done == length;
+}
+
+static void *member_worker(void *arg) {
+    Member *m = arg;
+    DiskArray *a = m->Array;
+
+    pthread_mutex_lock(&a->Lock);
+    for (;;) {
+        while (!a->Stop && m->Head == NULL) {
+            pthread_cond_wait(&m->Queued, &a->Lock);
+        }
+        if (m->Head == NULL) {
+            break;
+        }
+        Request *r = m->Head;
+        m->Head = r->Next;
+        if (m->Head == NULL) {
+            m->Tail = NULL;
+        }
+
+        pthread_mutex_unlock(&a->Lock);
+        bool ok = member_io(m, r->Write, r->Data, r->Length, r->Offset);
+        pthread_mutex_lock(&a->Lock);
+
+        if (!ok) {
+            r->Batch->Failed = true;
+        }
+        r->Batch->Pending--;
+        pthread_cond_broadcast(&a->Done);
+    }
+    pthread_mutex_unlock(&a->Lock);
+    return NULL;
+}
+
+// Hand all but the first piece to the member threads, serve the first in
+// the caller, and wait for the rest
+static bool run_batch(DiskArray *a, Request *pieces, int n) {
+    Batch batch = {n - 1, false};
+
+    if (n > 1) {
+        pthread_mutex_lock(&a->Lock);
+        for (int i = 1; i < n; i++) {
+            Member *m = pieces[i].Member;
+            pieces[i].Batch = &batch;
+            pieces[i].Next = NULL;
+            if (m->Tail) {
+                m->Tail->Next = &pieces[i];
+            }
+            else {
+                m->Head = &pieces[i];
+            }
+            m->Tail = &pieces[i];
+            pthread_cond_signal(&m->Queued);
+        }
+        pthread_mutex_unlock(&a->Lock);
+    }
+
+    bool ok = member_io(pieces[0].Member, pieces[0].Write, pieces[0].Data, pieces[0].Length, pieces[0].Offset);
+
+    if (n > 1) {
+        pthread_mutex_lock(&a->Lock);
+        while (batch.Pending) {
+            pthread_cond_wait(&a->Done, &a->Lock);
+        }
+        pthread_mutex_unlock(&a->Lock);
+    }
+    return ok && !batch.Failed;
+}
+
+// Layout ----------------------------------------------------------------------
+
+// Mirror to read from: the one with the fewest transfers under way
+static Member *pick_mirror(DiskArray *a) {
+    size_t turn = __atomic_fetch_add(&a->Turn, 1, __ATOMIC_RELAXED);
+    Member *best = NULL;
+
+    for (size_t i = 0; i < a->Count; i++) {
+        Member *m = &a->Members[(turn + i) % a->Count];
+        if (best == NULL || __atomic_load_n(&m->Inflight, __ATOMIC_RELAXED) < best->Inflight) {
+            best = m;
+        }
+    }
+    return best;
+}
+
+// Member piece of logical offset: stripe units go round the members, so
+// unit u lives in row u / Count of member u % Count
+static void map_piece(DiskArray *a, off_t offset, size_t length, Request *piece) {
+    off_t unit = offset / a->Stripe;
+    size_t within = offset % a->Stripe;
+
+    piece->Member = &a->Members[unit % a->Count];
+    piece->Offset = (unit / a->Count) * a->Stripe + within;
+    piece->Length = a->Stripe - within < length ? a->Stripe - within : length;
+}
+
+// Split a logical range into at most MAX_PIECES member pieces and run them;
+// returns bytes covered, 0 on error
+static size_t transfer(DiskArray *a, bool write, char *data, size_t length, off_t offset) {
+    Request pieces[MAX_PIECES];
+    size_t done = 0;
+    int n = 0;
+
+    if (!a->Stripe) {
+        // Every mirror takes a write; a read needs only one of them
+        for (size_t i = 0; i < (write ? a->Count : 1); i++) {
+            pieces[n].Member = write ? &a->Members[i] : pick_mirror(a);
+            pieces[n].Offset = offset;
+            pieces[n].Length = length;
+            pieces[n].Data = data;
+            pieces[n++].Write = write;
+        }
+        done = length;
+    }
+    else {
+        while (done < length && n < MAX_PIECES) {
+            map_piece(a, offset + done, length - done, &pieces[n]);
+            pieces[n].Data = data + done;
+            pieces[n].Write = write;
+            done += pieces[n++].Length;
+        }
+    }
+
+    return run_batch(a, pieces, n) ? done : 0;
+}
+
+// Bytes each member must hold for the array to hold length bytes
+static off_t member_length(DiskArray *a, off_t length) {
+    if (!a->Stripe) {
+        return length;
+    }
+    off_t row = (off_t)a->Stripe * a->Count;
+    return (length + row - 1) / row * a->Stripe;
+}
+
+// Array interface -------------------------------------------------------------
+
+DiskArray *new_array(const char **paths, size_t count, size_t stripe, bool mirror) {
+    if (count == 0 || count > ARRAY_MAX_MEMBERS || (!mirror && stripe == 0)) {
+        errno = EINVAL;
+        return NULL;
+    }
+
+    DiskArray *a = calloc(1, sizeof(DiskArray));
+    a->Count = count;
+    a->Stripe = mirror ? 0 : stripe;
+
+    for (size_t i = 0; i < count; i++) {
+        a->Members[i].FileDescriptor = open(paths[i], O_RDWR | O_CREAT, 0600);
+        if (a->Members[i].FileDescriptor < 0) {
+            int error = errno;
+            while (i-- > 0) {
+                close(a->Members[i].FileDescriptor);
+            }
+            free(a);
+            errno = error;
+            return NULL;
+        }
+    }
+
+    pthread_mutex_init(&a->Lock, NULL);
+    pthread_cond_init(&a->Done, NULL);
+    for (size_t i = 0; i < count; i++) {
+        Member *m = &a->Members[i];
+        m->Array = a;
+        pthread_cond_init(&m->Queued, NULL);
+        pthread_create(&m->Worker, NULL, member_worker, m);
+    }
+    return a;
+}
+
+void free_array(DiskArray *a) {
+    pthread_mutex_lock(&a->Lock);
+    a->Stop = true;
+    for (size_t i = 0; i < a->Count; i++) {
+        pthread_cond_signal(&a->Members[i].Queued);
+    }
+    pthread_mutex_unlock(&a->Lock);
+
+    for (size_t i = 0; i < a->Count; i++) {
+        pthread_join(a->Members[i].Worker, NULL);
+        pthread_cond_destroy(&a->Members[i].Queued);
+        close(a->Members[i].FileDescriptor);
+    }
+    pthread_mutex_destroy(&a->Lock);
+    pthread_cond_destroy(&a->Done);
+    free(a);
+}
+
+size_t array_members(DiskArray *a) {
+    return a->Count;
+}
+
+off_t array_size(DiskArray *a) {
+    off_t smallest = -1;
+    for (size_t i = 0; i < a->Count; i++) {
+        struct stat st;
+        if (fstat(a->Members[i].FileDescriptor, &st) < 0) {
+            return 0;
+        }
+        if (smallest < 0 || st.st_size < smallest) {
+            smallest = st.st_size;
+        }
+    }
+
+    // Only complete rows of stripe units are usable
+    if (a->Stripe) {
+        return smallest / a->Stripe * a->Stripe * a->Count;
+    }
+    return smallest;
+}
+
+bool array_resize(DiskArray *a, off_t length) {
+    off_t need = member_length(a, length);
+    for (size_t i = 0; i < a->Count; i++) {
+        struct stat st;
+        if (fstat(a->Members[i].FileDescriptor, &st) < 0) {
+            return false;
+        }
+        if (st.st_size < need && ftruncate(a->Members[i].FileDescriptor, need) < 0) {
+            return false;
+        }
+    }
+    return true;
+}
+
+bool array_read(DiskArray *a, char *data, size_t length, off_t offset) {
+    for (size_t done = 0, n; done < length; done += n) {
+        n = transfer(a, false, data + done, length - done, offset + done);
+        if (n == 0) {
+            return false;
+        }
+    }
+    return true;
+}
+
+bool array_read_copy(DiskArray *a, size_t copy, char *data, size_t length, off_t offset) {
+    if (a->Stripe || copy >= a->Count) {
+        return false;
+    }
+    return member_io(&a->Members[copy], false, data, length, offset);
+}
+
+bool array_write(DiskArray *a, char *data, size_t length, off_t offset) {
+    for (size_t done = 0, n; done < length; done += n) {
+        n = transfer(a, true, data + done, length - done, offset + done);
+        if (n == 0) {
+            return false;
+        }
+    }
+    return true;
+}
+
+bool array_discard(DiskArray *a, size_t length, off_t offset) {
+#ifdef FALLOC_FL_PUNCH_HOLE
+    int mode = FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE;
+
+    if (!a->Stripe) {
+        for (size_t i = 0; i < a->Count; i++) {
+            if (fallocate(a->Members[i].FileDescriptor, mode, offset, length) < 0) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    for (size_t done = 0; done < length; ) {
+        Request piece;
+        map_piece(a, offset + done, length - done, &piece);
+        if (fallocate(piece.Member->FileDescriptor, mode, piece.Offset, piece.Length) < 0) {
+            return false;
+        }
+        done += piece.Length;
+    }
+    return true;
+#else
+    return false;
+#endif
+}
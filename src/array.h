@@ -0,0 +1,72 @@
+// array.h: Striped (RAID-0) and mirrored (RAID-1) sets of disk images
+
+#pragma once
+
+#include <stdlib.h>
+#include <stdbool.h>
+#include <sys/types.h>
+
+#define ARRAY_MAX_MEMBERS 16
+
+typedef struct DiskArray DiskArray;
+
+// Constructor: open (creating if needed) every member image and start a
+// submission thread per member
+// @param	paths	    Member image paths
+// @param	count	    Number of members, at most ARRAY_MAX_MEMBERS
+// @param	stripe	    Stripe unit in bytes, ignored when mirroring
+// @param	mirror	    Whether every member holds a full copy
+// @return	array, NULL if a member could not be opened
+DiskArray *new_array(const char **paths, size_t count, size_t stripe, bool mirror);
+
+// Destructor: stops the submission threads and closes the members
+// @param	array pointer
+void free_array(DiskArray *array);
+
+// Return number of members
+// @param	array pointer
+size_t array_members(DiskArray *array);
+
+// Return logical size of the array (in terms of bytes)
+// @param	array pointer
+off_t array_size(DiskArray *array);
+
+// Grow every member so the array holds at least length bytes
+// @param	array pointer
+// @param	length	    Logical size in bytes
+// @return	whether every member was grown
+bool array_resize(DiskArray *array, off_t length);
+
+// Read a logical byte range; pieces on different members are read in parallel
+// @param	array pointer
+// @param	data	    Buffer to read into
+// @param	length	    Bytes to read
+// @param	offset	    Logical offset
+// @return	whether every piece was read in full
+bool array_read(DiskArray *array, char *data, size_t length, off_t offset);
+
+// Read a logical byte range from one given copy of a mirrored array, as
+// when the copy a read was served from turns out to be bad
+// @param	array pointer
+// @param	copy	    Member to read, below array_members
+// @param	data	    Buffer to read into
+// @param	length	    Bytes to read
+// @param	offset	    Logical offset
+// @return	whether it was read in full; always false for a striped array
+bool array_read_copy(DiskArray *array, size_t copy, char *data, size_t length, off_t offset);
+
+// Write a logical byte range; pieces on different members, and every copy
+// of a mirrored range, are written in parallel
+// @param	array pointer
+// @param	data	    Buffer to write from
+// @param	length	    Bytes to write
+// @param	offset	    Logical offset
+// @return	whether every piece was written in full
+bool array_write(DiskArray *array, char *data, size_t length, off_t offset);
+
+// Punch a hole in every member holding part of a logical byte range
+// @param	array pointer
+// @param	length	    Bytes to discard
+// @param	offset	    Logical offset
+// @return	whether the host released the whole range
+bool array_discard(DiskArray *array, size_t length, off_t offset);
@@ -0,0 +1,425 @@
+#include "cache.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <pthread.h>
+
+#define PREFETCH_QUEUE 256
+
+// Replacement is 2Q: a block seen once waits in a FIFO (LIST_IN) and
+// moves to the LRU list (LIST_MAIN) only if it is asked for again, either
+// while still there but past the correlated-reference period, or soon
+// after leaving it, which LIST_OUT remembers by block number alone. A
+// scan passes through LIST_IN and never displaces LIST_MAIN.
+#define IN_SHARE 4          // LIST_IN may hold a quarter of the cache before it must give way
+#define OUT_SHARE 2         // LIST_OUT remembers half as many blocks as the cache holds
+#define METADATA_SHARE 4    // Metadata keeps at least a quarter of the cache against data
+#define CORRELATED 64       // Uses of the cache within which another use of a block is the same one
+
+enum { SLOT_FREE, SLOT_LOADING, SLOT_VALID, SLOT_GHOST };
+
+// LIST_SPARE holds unused ghost records; frames are never on it
+enum { LIST_FREE, LIST_IN, LIST_MAIN, LIST_OUT, LIST_SPARE, LISTS };
+
+typedef struct
+{
+    uint32_t Blocknum;
+    int State;           // SLOT_*
+    int List;            // LIST_* holding the slot
+    bool Metadata;       // Counted against the metadata share
+    bool Once;           // Prefetched for a BLOCK_STREAM read, freed when read
+    uint64_t Admitted;   // Clock at the block's first use, 0 while only prefetched
+    int Next;            // Hash chain
+    int Prev, After;     // List links, most recent at head
+} Slot;
+
+typedef struct
+{
+    int Head, Tail;
+    size_t Count;
+} List;
+
+struct BlockCache
+{
+    Disk *disk;
+    size_t Capacity;
+    size_t BlockSize;    // Bytes per cached block, fixed at construction
+    char *Data;          // Capacity blocks of storage
+    Slot *Slots;         // Capacity frames, one per block of Data, then the ghosts
+    size_t Ghosts;       // Ghost records, which hold a block number and no data
+    int *Buckets;        // Hash heads, -1 terminated chains
+    size_t NBuckets;
+    List Lists[LISTS];
+    size_t MetadataCount;    // Frames holding metadata
+    uint64_t Clock;          // Uses of the cache so far
+
+    pthread_mutex_t Lock;
+    pthread_cond_t Loaded;    // Signalled when a prefetch completes
+    pthread_cond_t Queued;    // Signalled when work is queued
+    uint32_t Queue[PREFETCH_QUEUE];
+    size_t QHead, QTail;
+    bool Stop;
+    pthread_t Worker;
+};
+
+// Lists -----------------------------------------------------------------------
+
+static void list_unlink(BlockCache *c, int i) {
+    Slot *s = &c->Slots[i];
+    List *l = &c->Lists[s->List];
+    if (s->Prev >= 0) c->Slots[s->Prev].After = s->After; else l->Head = s->After;
+    if (s->After >= 0) c->Slots[s->After].Prev = s->Prev; else l->Tail = s->Prev;
+    s->Prev = s->After = -1;
+    l->Count--;
+}
+
+static void list_push(BlockCache *c, int i, int list) {
+    Slot *s = &c->Slots[i];
+    List *l = &c->Lists[list];
+    s->List = list;
+    s->Prev = -1;
+    s->After = l->Head;
+    if (l->Head >= 0) c->Slots[l->Head].Prev = i; else l->Tail = i;
+    l->Head = i;
+    l->Count++;
+}
+
+// Hash table ------------------------------------------------------------------
+
+static size_t bucket_of(BlockCache *c, uint32_t blocknum) {
+    return (blocknum * 2654435761u) % c->NBuckets;
+}
+
+// A block has at most one slot: a frame while cached, a ghost after
+static int lookup(BlockCache *c, uint32_t blocknum) {
+    for (int i = c->Buckets[bucket_of(c, blocknum)]; i >= 0; i = c->Slots[i].Next) {
+        if (c->Slots[i].Blocknum == blocknum) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+static void hash(BlockCache *c, int i, uint32_t blocknum) {
+    c->Slots[i].Blocknum = blocknum;
+    c->Slots[i].Next = c->Buckets[bucket_of(c, blocknum)];
+    c->Buckets[bucket_of(c, blocknum)] = i;
+}
+
+static void unhash(BlockCache *c, int i) {
+    int *link = &c->Buckets[bucket_of(c, c->Slots[i].Blocknum)];
+    while (*link != i) {
+        link = &c->Slots[*link].Next;
+    }
+    *link = c->Slots[i].Next;
+    c->Slots[i].State = SLOT_FREE;
+}
+
+// Replacement -----------------------------------------------------------------
+
+static void set_metadata(BlockCache *c, int i, bool metadata) {
+    if (c->Slots[i].Metadata != metadata) {
+        c->Slots[i].Metadata = metadata;
+        c->MetadataCount += metadata ? 1 : -1;
+    }
+}
+
+// Drop a frame or ghost, leaving it for reuse
+static void forget(BlockCache *c, int i) {
+    unhash(c, i);
+    list_unlink(c, i);
+    if ((size_t)i < c->Capacity) {
+        set_metadata(c, i, false);
+        c->Slots[i].Once = false;
+        list_push(c, i, LIST_FREE);
+    }
+    else {
+        list_push(c, i, LIST_SPARE);
+    }
+}
+
+// Note that blocknum left LIST_IN, recycling the oldest ghost if need be
+static void remember(BlockCache *c, uint32_t blocknum) {
+    int i = c->Lists[LIST_SPARE].Head;
+    if (i < 0) {
+        i = c->Lists[LIST_OUT].Tail;
+        if (i < 0) {
+            return;
+        }
+        unhash(c, i);
+    }
+    list_unlink(c, i);
+    hash(c, i, blocknum);
+    c->Slots[i].State = SLOT_GHOST;
+    list_push(c, i, LIST_OUT);
+}
+
+// Oldest frame of list that may go: not mid-prefetch, and not metadata
+// while metadata is down to its share, unless metadata is what comes in.
+// A prefetched block not yet read goes only if nothing else can.
+static int victim(BlockCache *c, int list, bool metadata) {
+    bool protect = !metadata && c->MetadataCount <= c->Capacity / METADATA_SHARE;
+    int unread = -1;
+    for (int i = c->Lists[list].Tail; i >= 0; i = c->Slots[i].Prev) {
+        if (c->Slots[i].State == SLOT_LOADING || (protect && c->Slots[i].Metadata)) {
+            continue;
+        }
+        if (c->Slots[i].Admitted) {
+            return i;
+        }
+        if (unread < 0) {
+            unread = i;
+        }
+    }
+    return unread;
+}
+
+// Free a frame for a block of the given kind. LIST_IN gives way first once
+// it is over its share; a stream block may only take a frame in LIST_IN
+// that has been read, since it would rather go uncached than evict what
+// another stream is about to read.
+static int reclaim(BlockCache *c, BlockKind kind) {
+    int i = c->Lists[LIST_FREE].Head;
+    if (i >= 0) {
+        list_unlink(c, i);
+        return i;
+    }
+
+    bool metadata = kind == BLOCK_METADATA;
+    if (kind == BLOCK_STREAM) {
+        if ((i = victim(c, LIST_IN, false)) >= 0 && !c->Slots[i].Admitted) {
+            i = -1;
+        }
+    }
+    else if (c->Lists[LIST_IN].Count > c->Capacity / IN_SHARE) {
+        if ((i = victim(c, LIST_IN, metadata)) < 0) {
+            i = victim(c, LIST_MAIN, metadata);
+        }
+    }
+    else if ((i = victim(c, LIST_MAIN, metadata)) < 0) {
+        i = victim(c, LIST_IN, metadata);
+    }
+    if (i < 0) {
+        return -1;
+    }
+
+    // A block never read, such as a stream's, leaves no ghost
+    uint32_t blocknum = c->Slots[i].Blocknum;
+    bool ghost = c->Slots[i].List == LIST_IN && c->Slots[i].Admitted;
+    forget(c, i);
+    list_unlink(c, i);
+    if (ghost) {
+        remember(c, blocknum);
+    }
+    return i;
+}
+
+// Give blocknum, which has no frame, one: in LIST_MAIN if a ghost shows it
+// was seen recently, otherwise in LIST_IN
+static int admit(BlockCache *c, uint32_t blocknum, BlockKind kind, int state) {
+    int i = reclaim(c, kind);
+    if (i < 0) {
+        return -1;
+    }
+
+    int g = lookup(c, blocknum);
+    bool seen = g >= 0 && kind != BLOCK_STREAM;
+    if (seen) {
+        forget(c, g);
+    }
+
+    hash(c, i, blocknum);
+    c->Slots[i].State = state;
+    c->Slots[i].Once = kind == BLOCK_STREAM;
+    c->Slots[i].Admitted = state == SLOT_LOADING ? 0 : ++c->Clock;
+    set_metadata(c, i, kind == BLOCK_METADATA);
+    list_push(c, i, seen ? LIST_MAIN : LIST_IN);
+    return i;
+}
+
+// Count a use of frame i. A frame in LIST_IN stays put while the use may
+// be part of the burst that brought it in, such as the pieces of one
+// partly read block; a stream read takes its prefetched frame out of the
+// cache and promotes nothing.
+static void touch(BlockCache *c, int i, BlockKind kind) {
+    Slot *s = &c->Slots[i];
+    if (kind == BLOCK_STREAM) {
+        if (s->Once) {
+            forget(c, i);
+        }
+        return;
+    }
+
+    c->Clock++;
+    s->Once = false;
+    set_metadata(c, i, kind == BLOCK_METADATA);
+    if (!s->Admitted) {
+        s->Admitted = c->Clock;
+    }
+    else if (s->List == LIST_MAIN || c->Clock - s->Admitted > CORRELATED) {
+        list_unlink(c, i);
+        list_push(c, i, LIST_MAIN);
+    }
+}
+
+// Prefetch worker -------------------------------------------------------------
+
+static void *prefetch_worker(void *arg) {
+    BlockCache *c = arg;
+    char data[MAX_BLOCK_SIZE];
+
+    pthread_mutex_lock(&c->Lock);
+    for (;;) {
+        while (!c->Stop && c->QHead == c->QTail) {
+            pthread_cond_wait(&c->Queued, &c->Lock);
+        }
+        if (c->Stop) {
+            break;
+        }
+        uint32_t blocknum = c->Queue[c->QTail++ % PREFETCH_QUEUE];
+
+        // Read without the lock so foreground hits are not held up
+        pthread_mutex_unlock(&c->Lock);
+        bool ok = disk_read_device(c->disk, blocknum, data);
+        pthread_mutex_lock(&c->Lock);
+
+        // A write or drop while loading already settled the slot. A block
+        // that failed verification is left for the reader to fail on.
+        int i = lookup(c, blocknum);
+        if (i >= 0 && c->Slots[i].State == SLOT_LOADING) {
+            if (ok) {
+                memcpy(c->Data + (size_t)i * c->BlockSize, data, c->BlockSize);
+                c->Slots[i].State = SLOT_VALID;
+            }
+            else {
+                forget(c, i);
+            }
+        }
+        pthread_cond_broadcast(&c->Loaded);
+    }
+    pthread_mutex_unlock(&c->Lock);
+    return NULL;
+}
+
+// Cache interface -------------------------------------------------------------
+
+BlockCache *new_cache(Disk *disk, size_t nblocks) {
+    BlockCache *c = calloc(1, sizeof(BlockCache));
+    c->disk = disk;
+    c->Capacity = nblocks;
+    c->Ghosts = nblocks / OUT_SHARE;
+    c->BlockSize = disk->BlockSize;
+    c->Data = malloc(nblocks * c->BlockSize);
+    c->Slots = calloc(nblocks + c->Ghosts, sizeof(Slot));
+    c->NBuckets = (nblocks + c->Ghosts) * 2 + 1;
+    c->Buckets = malloc(c->NBuckets * sizeof(int));
+    memset(c->Buckets, -1, c->NBuckets * sizeof(int));
+
+    // Every frame starts free, and every ghost spare
+    for (int l = 0; l < LISTS; l++) {
+        c->Lists[l].Head = c->Lists[l].Tail = -1;
+    }
+    for (size_t i = 0; i < nblocks + c->Ghosts; i++) {
+        c->Slots[i].State = SLOT_FREE;
+        c->Slots[i].Prev = c->Slots[i].After = -1;
+        list_push(c, i, i < nblocks ? LIST_FREE : LIST_SPARE);
+    }
+
+    pthread_mutex_init(&c->Lock, NULL);
+    pthread_cond_init(&c->Loaded, NULL);
+    pthread_cond_init(&c->Queued, NULL);
+    pthread_create(&c->Worker, NULL, prefetch_worker, c);
+    return c;
+}
+
+void free_cache(BlockCache *c) {
+    pthread_mutex_lock(&c->Lock);
+    c->Stop = true;
+    pthread_cond_signal(&c->Queued);
+    pthread_mutex_unlock(&c->Lock);
+    pthread_join(c->Worker, NULL);
+
+    pthread_mutex_destroy(&c->Lock);
+    pthread_cond_destroy(&c->Loaded);
+    pthread_cond_destroy(&c->Queued);
+    free(c->Buckets);
+    free(c->Slots);
+    free(c->Data);
+    free(c);
+}
+
+size_t cache_capacity(BlockCache *c) {
+    return c->Capacity;
+}
+
+size_t cache_metadata(BlockCache *c) {
+    pthread_mutex_lock(&c->Lock);
+    size_t count = c->MetadataCount;
+    pthread_mutex_unlock(&c->Lock);
+    return count;
+}
+
+bool cache_get(BlockCache *c, uint32_t blocknum, char *data, BlockKind kind) {
+    pthread_mutex_lock(&c->Lock);
+    int i = lookup(c, blocknum);
+    while (i >= 0 && c->Slots[i].State == SLOT_LOADING) {
+        pthread_cond_wait(&c->Loaded, &c->Lock);
+        i = lookup(c, blocknum);
+    }
+    bool found = i >= 0 && c->Slots[i].State == SLOT_VALID;
+    if (found) {
+        memcpy(data, c->Data + (size_t)i * c->BlockSize, c->BlockSize);
+        touch(c, i, kind);
+    }
+    pthread_mutex_unlock(&c->Lock);
+    return found;
+}
+
+void cache_put(BlockCache *c, uint32_t blocknum, const char *data, BlockKind kind) {
+    pthread_mutex_lock(&c->Lock);
+    int i = lookup(c, blocknum);
+    if (i >= 0 && c->Slots[i].State != SLOT_GHOST) {
+        c->Slots[i].State = SLOT_VALID;
+        memcpy(c->Data + (size_t)i * c->BlockSize, data, c->BlockSize);
+        touch(c, i, kind);
+    }
+    else if (kind != BLOCK_STREAM && (i = admit(c, blocknum, kind, SLOT_VALID)) >= 0) {
+        memcpy(c->Data + (size_t)i * c->BlockSize, data, c->BlockSize);
+    }
+    pthread_cond_broadcast(&c->Loaded);
+    pthread_mutex_unlock(&c->Lock);
+}
+
+void cache_drop(BlockCache *c, uint32_t start, uint32_t count) {
+    pthread_mutex_lock(&c->Lock);
+    if (count < c->Capacity) {
+        for (uint32_t b = start; b < start + count; b++) {
+            int i = lookup(c, b);
+            if (i >= 0) {
+                forget(c, i);
+            }
+        }
+    }
+    else {
+        for (size_t i = 0; i < c->Capacity + c->Ghosts; i++) {
+            Slot *s = &c->Slots[i];
+            if (s->State != SLOT_FREE && s->Blocknum >= start && s->Blocknum - start < count) {
+                forget(c, i);
+            }
+        }
+    }
+    pthread_cond_broadcast(&c->Loaded);
+    pthread_mutex_unlock(&c->Lock);
+}
+
+void cache_prefetch(BlockCache *c, uint32_t blocknum, BlockKind kind) {
+    pthread_mutex_lock(&c->Lock);
+    int i = lookup(c, blocknum);
+    if ((i < 0 || c->Slots[i].State == SLOT_GHOST) && c->QHead - c->QTail < PREFETCH_QUEUE) {
+        if (admit(c, blocknum, kind, SLOT_LOADING) >= 0) {
+            c->Queue[c->QHead++ % PREFETCH_QUEUE] = blocknum;
+            pthread_cond_signal(&c->Queued);
+        }
+    }
+    pthread_mutex_unlock(&c->Lock);
+}
@@ -0,0 +1,54 @@
+// cache.h: Scan-resistant (2Q) block cache with asynchronous prefetch
+
+#pragma once
+
+#include "disk.h"
+
+#include <stdint.h>
+#include <stdbool.h>
+
+typedef struct BlockCache BlockCache;
+
+// Constructor: cache nblocks blocks of disk, starting the prefetch thread
+// @param	disk pointer
+// @param	nblocks	    Capacity in blocks
+BlockCache *new_cache(Disk *disk, size_t nblocks);
+
+// Destructor: stops the prefetch thread
+// @param	cache pointer
+void free_cache(BlockCache *cache);
+
+// Return capacity of cache (in terms of blocks)
+// @param	cache pointer
+size_t cache_capacity(BlockCache *cache);
+
+// Return number of cached blocks holding metadata
+// @param	cache pointer
+size_t cache_metadata(BlockCache *cache);
+
+// Copy a cached block into data, waiting for an in-flight prefetch of it
+// @param	cache pointer
+// @param	blocknum    Block to look up
+// @param	data	    Buffer to copy into
+// @param	kind	    What the block holds
+// @return	whether the block was cached
+bool cache_get(BlockCache *cache, uint32_t blocknum, char *data, BlockKind kind);
+
+// Insert or overwrite a block; BLOCK_STREAM only overwrites
+// @param	cache pointer
+// @param	blocknum    Block to store
+// @param	data	    Block contents
+// @param	kind	    What the block holds
+void cache_put(BlockCache *cache, uint32_t blocknum, const char *data, BlockKind kind);
+
+// Forget a run of blocks
+// @param	cache pointer
+// @param	start	    First block to drop
+// @param	count	    Number of blocks to drop
+void cache_drop(BlockCache *cache, uint32_t start, uint32_t count);
+
+// Queue a background read of a block not already cached
+// @param	cache pointer
+// @param	blocknum    Block to prefetch
+// @param	kind	    What the block holds
+void cache_prefetch(BlockCache *cache, uint32_t blocknum, BlockKind kind);
@@ -0,0 +1,137 @@
+#include "crc32c.h"
+
+#include <string.h>
+#include <stdbool.h>
+#include <pthread.h>
+
+#if defined(__x86_64__)
+#include <nmmintrin.h>
+#define HAVE_SSE42_PATH 1
+#endif
+
+#define CRC32C_POLY 0x82f63b78u     // Reflected Castagnoli polynomial
+#define LANE 1360                   // Bytes per interleaved stream, 3 fit a block
+
+static uint32_t Table[8][256];      // Slicing-by-8 tables
+static uint32_t ShiftLane[32];      // Operator: append LANE zero bytes
+static uint32_t ShiftTwoLanes[32];  // Operator: append 2 * LANE zero bytes
+static bool Hardware;
+static pthread_once_t Once = PTHREAD_ONCE_INIT;
+
+// Tables ----------------------------------------------------------------------
+
+// Advance a raw CRC register over n zero bytes
+static uint32_t zeros(uint32_t crc, size_t n) {
+    while (n--) {
+        crc = Table[0][crc & 0xff] ^ (crc >> 8);
+    }
+    return crc;
+}
+
+// Appending zeros is linear in the register, so it is a 32x32 bit matrix;
+// column i is the image of bit i
+static void shift_operator(uint32_t *columns, size_t n) {
+    for (int i = 0; i < 32; i++) {
+        columns[i] = zeros(1u << i, n);
+    }
+}
+
+static uint32_t shift(const uint32_t *columns, uint32_t crc) {
+    uint32_t result = 0;
+    for (int i = 0; crc; i++, crc >>= 1) {
+        if (crc & 1) {
+            result ^= columns[i];
+        }
+    }
+    return result;
+}
+
+static void init(void) {
+    for (uint32_t i = 0; i < 256; i++) {
+        uint32_t crc = i;
+        for (int k = 0; k < 8; k++) {
+            crc = (crc >> 1) ^ (CRC32C_POLY & -(crc & 1));
+        }
+        Table[0][i] = crc;
+    }
+    for (uint32_t i = 0; i < 256; i++) {
+        for (int t = 1; t < 8; t++) {
+            Table[t][i] = Table[0][Table[t-1][i] & 0xff] ^ (Table[t-1][i] >> 8);
+        }
+    }
+
+    shift_operator(ShiftLane, LANE);
+    shift_operator(ShiftTwoLanes, 2 * LANE);
+
+#ifdef HAVE_SSE42_PATH
+    Hardware = __builtin_cpu_supports("sse4.2");
+#endif
+}
+
+// Portable path ---------------------------------------------------------------
+
+static uint32_t crc32c_sw(uint32_t crc, const char *data, size_t length) {
+    const unsigned char *p = (const unsigned char *)data;
+
+    for (; length >= 8; p += 8, length -= 8) {
+        uint32_t lo, hi;
+        memcpy(&lo, p, 4);
+        memcpy(&hi, p + 4, 4);
+        lo ^= crc;
+        crc = Table[7][lo & 0xff] ^ Table[6][(lo >> 8) & 0xff] ^
+              Table[5][(lo >> 16) & 0xff] ^ Table[4][lo >> 24] ^
+              Table[3][hi & 0xff] ^ Table[2][(hi >> 8) & 0xff] ^
+              Table[1][(hi >> 16) & 0xff] ^ Table[0][hi >> 24];
+    }
+    while (length--) {
+        crc = Table[0][(crc ^ *p++) & 0xff] ^ (crc >> 8);
+    }
+    return crc;
+}
+
+// SSE4.2 path -----------------------------------------------------------------
+
+#ifdef HAVE_SSE42_PATH
+// The crc32 instruction has a 3 cycle latency but issues every cycle, so
+// three independent streams run at full throughput; their registers are
+// then stitched together with the shift operators
+__attribute__((target("sse4.2")))
+static uint32_t crc32c_hw(uint32_t crc, const char *data, size_t length) {
+    for (; length >= 3 * LANE; data += 3 * LANE, length -= 3 * LANE) {
+        uint64_t a = crc, b = 0, c = 0;
+        for (size_t i = 0; i < LANE; i += 8) {
+            uint64_t x, y, z;
+            memcpy(&x, data + i, 8);
+            memcpy(&y, data + LANE + i, 8);
+            memcpy(&z, data + 2 * LANE + i, 8);
+            a = _mm_crc32_u64(a, x);
+            b = _mm_crc32_u64(b, y);
+            c = _mm_crc32_u64(c, z);
+        }
+        crc = shift(ShiftTwoLanes, a) ^ shift(ShiftLane, b) ^ (uint32_t)c;
+    }
+
+    uint64_t wide = crc;
+    for (; length >= 8; data += 8, length -= 8) {
+        uint64_t x;
+        memcpy(&x, data, 8);
+        wide = _mm_crc32_u64(wide, x);
+    }
+    crc = wide;
+    while (length--) {
+        crc = _mm_crc32_u8(crc, *data++);
+    }
+    return crc;
+}
+#endif
+
+uint32_t crc32c(const char *data, size_t length) {
+    pthread_once(&Once, init);
+
+#ifdef HAVE_SSE42_PATH
+    if (Hardware) {
+        return ~crc32c_hw(~0u, data, length);
+    }
+#endif
+    return ~crc32c_sw(~0u, data, length);
+}
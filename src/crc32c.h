@@ -0,0 +1,12 @@
+// crc32c.h: CRC32C (Castagnoli) checksums
+
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Checksum a buffer, using the SSE4.2 crc32 instruction when the CPU has it
+// @param	data	    Bytes to checksum
+// @param	length	    Number of bytes
+// @return	CRC32C of data
+uint32_t crc32c(const char *data, size_t length);
@@ -0,0 +1,140 @@
+#include "dedup.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#define FP_LANES 8
+#define FP_PRIME1 0x9e3779b1u
+#define FP_PRIME2 0x85ebca77u
+#define FP_MIX 0x100000001b3ull
+
+struct DedupIndex
+{
+    uint32_t Blocks;         // Blocks the per-block arrays cover
+    uint32_t Mask;           // Buckets - 1
+    uint32_t *Buckets;       // Chain heads, 0 terminated
+    uint32_t *Next;          // Per block: next block in its chain
+    uint64_t *Fingerprints;  // Per block
+    bool *Indexed;           // Per block: whether it is on a chain
+};
+
+// Fingerprint -----------------------------------------------------------------
+
+// Always inlined so each constant size below gets its own fixed-trip loop
+static inline __attribute__((always_inline)) uint64_t fingerprint(const char *data, size_t size) {
+    uint32_t lane[FP_LANES];
+    for (int i = 0; i < FP_LANES; i++) {
+        lane[i] = FP_PRIME1 * (i + 1);
+    }
+
+    // One xxHash32-style round per 32-bit word, FP_LANES words at a time
+    for (size_t off = 0; off < size; off += sizeof(lane)) {
+        uint32_t word[FP_LANES];
+        memcpy(word, data + off, sizeof(word));
+        for (int i = 0; i < FP_LANES; i++) {
+            lane[i] += word[i] * FP_PRIME2;
+            lane[i] = (lane[i] << 13) | (lane[i] >> 19);
+            lane[i] *= FP_PRIME1;
+        }
+    }
+
+    uint64_t hash = 0;
+    for (int i = 0; i < FP_LANES; i++) {
+        hash = (hash ^ lane[i]) * FP_MIX;
+        hash ^= hash >> 29;
+    }
+    return hash;
+}
+
+uint64_t block_fingerprint(const char *data, size_t size) {
+    switch (size) {
+    case 4096:  return fingerprint(data, 4096);
+    case 16384: return fingerprint(data, 16384);
+    case 65536: return fingerprint(data, 65536);
+    default:    return fingerprint(data, size);
+    }
+}
+
+// Index -----------------------------------------------------------------------
+
+DedupIndex *new_dedup(uint32_t blocks) {
+    DedupIndex *index = malloc(sizeof(DedupIndex));
+    uint32_t buckets = 1;
+    while (buckets < blocks) {
+        buckets <<= 1;
+    }
+
+    index->Blocks = blocks;
+    index->Mask = buckets - 1;
+    index->Buckets = calloc(buckets, sizeof(uint32_t));
+    index->Next = calloc(blocks, sizeof(uint32_t));
+    index->Fingerprints = calloc(blocks, sizeof(uint64_t));
+    index->Indexed = calloc(blocks, sizeof(bool));
+    return index;
+}
+
+void free_dedup(DedupIndex *index) {
+    free(index->Buckets);
+    free(index->Next);
+    free(index->Fingerprints);
+    free(index->Indexed);
+    free(index);
+}
+
+void dedup_grow(DedupIndex *index, uint32_t blocks) {
+    if (blocks <= index->Blocks) {
+        return;
+    }
+
+    // Chains keep working with the old bucket count; they just get longer
+    uint32_t added = blocks - index->Blocks;
+    index->Next = realloc(index->Next, blocks * sizeof(uint32_t));
+    index->Fingerprints = realloc(index->Fingerprints, blocks * sizeof(uint64_t));
+    index->Indexed = realloc(index->Indexed, blocks * sizeof(bool));
+    memset(index->Next + index->Blocks, 0, added * sizeof(uint32_t));
+    memset(index->Fingerprints + index->Blocks, 0, added * sizeof(uint64_t));
+    memset(index->Indexed + index->Blocks, 0, added * sizeof(bool));
+    index->Blocks = blocks;
+}
+
+bool dedup_contains(DedupIndex *index, uint32_t blocknum) {
+    return index->Indexed[blocknum];
+}
+
+void dedup_insert(DedupIndex *index, uint32_t blocknum, uint64_t fingerprint) {
+    dedup_remove(index, blocknum);
+
+    uint32_t bucket = fingerprint & index->Mask;
+    index->Fingerprints[blocknum] = fingerprint;
+    index->Next[blocknum] = index->Buckets[bucket];
+    index->Buckets[bucket] = blocknum;
+    index->Indexed[blocknum] = true;
+}
+
+void dedup_remove(DedupIndex *index, uint32_t blocknum) {
+    if (!index->Indexed[blocknum]) {
+        return;
+    }
+
+    uint32_t *link = &index->Buckets[index->Fingerprints[blocknum] & index->Mask];
+    while (*link != blocknum) {
+        link = &index->Next[*link];
+    }
+    *link = index->Next[blocknum];
+    index->Indexed[blocknum] = false;
+}
+
+uint32_t dedup_find(DedupIndex *index, Disk *disk, const char *data, uint64_t fingerprint) {
+    for (uint32_t b = index->Buckets[fingerprint & index->Mask]; b; b = index->Next[b]) {
+        if (index->Fingerprints[b] != fingerprint) {
+            continue;
+        }
+
+        // A candidate that fails verification is not shared
+        char candidate[MAX_BLOCK_SIZE];
+        if (disk_read_kind(disk, b, candidate, BLOCK_DATA) && memcmp(candidate, data, disk->BlockSize) == 0) {
+            return b;
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,54 @@
+// dedup.h: Content-addressed index of data blocks
+
+#pragma once
+
+#include "disk.h"
+
+#include <stdint.h>
+#include <stdbool.h>
+
+typedef struct DedupIndex DedupIndex;
+
+// Fingerprint a block's contents; lanes are independent so the loop vectorizes
+// @param	data	    size bytes
+// @param	size	    Block size, a multiple of 32
+// @return	64-bit fingerprint
+uint64_t block_fingerprint(const char *data, size_t size);
+
+// Constructor: index for a disk of the given size
+// @param	blocks	    Number of blocks on the disk
+DedupIndex *new_dedup(uint32_t blocks);
+
+// Destructor
+// @param	index pointer
+void free_dedup(DedupIndex *index);
+
+// Make room for blocks added to the disk
+// @param	index pointer
+// @param	blocks	    New number of blocks on the disk
+void dedup_grow(DedupIndex *index, uint32_t blocks);
+
+// Whether a block is already in the index
+// @param	index pointer
+// @param	blocknum    Block to check
+bool dedup_contains(DedupIndex *index, uint32_t blocknum);
+
+// Record the contents of a block, replacing any earlier entry for it
+// @param	index pointer
+// @param	blocknum    Block holding the data
+// @param	fingerprint block_fingerprint of its contents
+void dedup_insert(DedupIndex *index, uint32_t blocknum, uint64_t fingerprint);
+
+// Forget a block whose contents are changing or that was freed
+// @param	index pointer
+// @param	blocknum    Block to drop
+void dedup_remove(DedupIndex *index, uint32_t blocknum);
+
+// Find a block holding exactly data; fingerprint matches are confirmed
+// byte for byte against the disk
+// @param	index pointer
+// @param	disk pointer
+// @param	data	    One block (disk->BlockSize bytes)
+// @param	fingerprint block_fingerprint of data
+// @return	matching block, 0 if none
+uint32_t dedup_find(DedupIndex *index, Disk *disk, const char *data, uint64_t fingerprint);
@@ -0,0 +1,401 @@
+#include "dir.h"
+
+#include <stdio.h>
+#include <string.h>
+
+// Hashing ---------------------------------------------------------------------
+
+// FNV-1a over the entry name
+static uint32_t name_hash(const char *name, size_t length) {
+    uint32_t hash = 2166136261u;
+    for (size_t i = 0; i < length; i++) {
+        hash = (hash ^ (unsigned char)name[i]) * 16777619u;
+    }
+    return hash;
+}
+
+// Dentry cache ----------------------------------------------------------------
+
+static Dentry *dcache_slot(FileSystem *fs, uint32_t parent, uint32_t hash) {
+    if (fs->dcache == NULL) {
+        fs->dcache = calloc(DCACHE_SIZE, sizeof(Dentry));
+    }
+    return &fs->dcache[(hash ^ parent * 2654435761u) & (DCACHE_SIZE - 1)];
+}
+
+static ssize_t dcache_get(FileSystem *fs, uint32_t parent, const char *name, uint32_t hash) {
+    Dentry *d = dcache_slot(fs, parent, hash);
+    if (d->Valid && d->Parent == parent && d->Hash == hash && strcmp(d->Name, name) == 0) {
+        return d->Inumber;
+    }
+    return -1;
+}
+
+static void dcache_put(FileSystem *fs, uint32_t parent, const char *name, uint32_t hash, uint32_t inumber) {
+    Dentry *d = dcache_slot(fs, parent, hash);
+    d->Valid = true;
+    d->Parent = parent;
+    d->Inumber = inumber;
+    d->Hash = hash;
+    strcpy(d->Name, name);
+}
+
+void dcache_forget(FileSystem *fs, size_t inumber) {
+    if (fs->dcache == NULL) {
+        return;
+    }
+    for (int i = 0; i < DCACHE_SIZE; i++) {
+        Dentry *d = &fs->dcache[i];
+        if (d->Valid && (d->Inumber == inumber || d->Parent == inumber)) {
+            d->Valid = false;
+        }
+    }
+}
+
+static int compare_inumbers(const void *a, const void *b) {
+    size_t x = *(const size_t *)a, y = *(const size_t *)b;
+    return (x > y) - (x < y);
+}
+
+void dcache_forget_many(FileSystem *fs, const size_t *inumbers, size_t count) {
+    if (fs->dcache == NULL || count == 0) {
+        return;
+    }
+    for (int i = 0; i < DCACHE_SIZE; i++) {
+        Dentry *d = &fs->dcache[i];
+        size_t inumber = d->Inumber, parent = d->Parent;
+        if (d->Valid && (bsearch(&inumber, inumbers, count, sizeof(size_t), compare_inumbers) ||
+                         bsearch(&parent, inumbers, count, sizeof(size_t), compare_inumbers))) {
+            d->Valid = false;
+        }
+    }
+}
+
+// Directory buckets -----------------------------------------------------------
+
+static uint32_t dir_buckets(FileSystem *fs, uint32_t dir) {
+    ssize_t size = fs_stat(fs, dir);
+    return size > 0 ? size / DIR_BUCKET_SIZE : 0;
+}
+
+static bool read_bucket(FileSystem *fs, uint32_t dir, uint32_t bucket, Bucket *block) {
+    return fs_read(fs, dir, block->Data, DIR_BUCKET_SIZE, (size_t)bucket * DIR_BUCKET_SIZE) == DIR_BUCKET_SIZE;
+}
+
+static bool write_bucket(FileSystem *fs, uint32_t dir, uint32_t bucket, Bucket *block) {
+    return fs_write(fs, dir, block->Data, DIR_BUCKET_SIZE, (size_t)bucket * DIR_BUCKET_SIZE) == DIR_BUCKET_SIZE;
+}
+
+// Whether an entry belongs in the bucket it was found in. A copy left
+// behind by a grow that could not clear it does not, and its slot is free.
+static inline bool live_entry(DirEntry *entry, uint32_t bucket, uint32_t buckets) {
+    return entry->Name[0] && (entry->Hash & (buckets - 1)) == bucket;
+}
+
+// Find name in directory dir, reading only its bucket
+static ssize_t dir_find(FileSystem *fs, uint32_t dir, const char *name, uint32_t hash) {
+    ssize_t inumber = dcache_get(fs, dir, name, hash);
+    if (inumber >= 0) {
+        return inumber;
+    }
+
+    uint32_t buckets = dir_buckets(fs, dir);
+    Bucket block;
+    if (!buckets || !read_bucket(fs, dir, hash & (buckets - 1), &block)) {
+        return -1;
+    }
+
+    DirEntry *entries = (DirEntry *)block.Data;
+    for (int i = 0; i < DIR_ENTRIES_PER_BUCKET; i++) {
+        if (entries[i].Name[0] && entries[i].Hash == hash && strcmp(entries[i].Name, name) == 0) {
+            dcache_put(fs, dir, name, hash, entries[i].Inumber);
+            return entries[i].Inumber;
+        }
+    }
+    return -1;
+}
+
+// Double the bucket count and redistribute every entry. The new half goes
+// out first, in one write, so the old table is untouched if it fails; once
+// it is written every lookup finds its entry, and rewriting the old half
+// only clears the copies that moved.
+static bool dir_grow(FileSystem *fs, uint32_t dir) {
+    uint32_t buckets = dir_buckets(fs, dir);
+    if (buckets >= DIR_MAX_BUCKETS) {
+        return false;
+    }
+
+    Bucket *table = calloc(2 * buckets, sizeof(Bucket));
+    uint32_t *used = calloc(2 * buckets, sizeof(uint32_t));
+    bool ok = true;
+
+    for (uint32_t b = 0; ok && b < buckets; b++) {
+        Bucket block;
+        ok = read_bucket(fs, dir, b, &block);
+        DirEntry *entries = (DirEntry *)block.Data;
+        for (int i = 0; ok && i < DIR_ENTRIES_PER_BUCKET; i++) {
+            if (live_entry(&entries[i], b, buckets)) {
+                // Entries from bucket b split between b and b + buckets
+                uint32_t target = entries[i].Hash & (2 * buckets - 1);
+                ((DirEntry *)table[target].Data)[used[target]++] = entries[i];
+            }
+        }
+    }
+
+    size_t half = (size_t)buckets * DIR_BUCKET_SIZE;
+    if (ok && fs_write(fs, dir, table[buckets].Data, half, half) != (ssize_t)half) {
+        fs_truncate(fs, dir, half);
+        ok = false;
+    }
+    for (uint32_t b = 0; ok && b < buckets; b++) {
+        write_bucket(fs, dir, b, &table[b]);
+    }
+
+    free(used);
+    free(table);
+    return ok;
+}
+
+// Add an entry, growing the directory when its bucket is full
+static bool dir_add(FileSystem *fs, uint32_t dir, const char *name, uint32_t hash, uint32_t inumber) {
+    for (;;) {
+        uint32_t buckets = dir_buckets(fs, dir);
+        uint32_t bucket = hash & (buckets - 1);
+        Bucket block;
+        if (!buckets || !read_bucket(fs, dir, bucket, &block)) {
+            return false;
+        }
+
+        DirEntry *entries = (DirEntry *)block.Data;
+        for (int i = 0; i < DIR_ENTRIES_PER_BUCKET; i++) {
+            if (!live_entry(&entries[i], bucket, buckets)) {
+                entries[i].Inumber = inumber;
+                entries[i].Hash = hash;
+                strcpy(entries[i].Name, name);
+                if (!write_bucket(fs, dir, bucket, &block)) {
+                    return false;
+                }
+                dcache_put(fs, dir, name, hash, inumber);
+                return true;
+            }
+        }
+
+        if (!dir_grow(fs, dir)) {
+            return false;
+        }
+    }
+}
+
+static bool dir_del(FileSystem *fs, uint32_t dir, const char *name, uint32_t hash) {
+    uint32_t buckets = dir_buckets(fs, dir);
+    uint32_t bucket = hash & (buckets - 1);
+    Bucket block;
+    if (!buckets || !read_bucket(fs, dir, bucket, &block)) {
+        return false;
+    }
+
+    DirEntry *entries = (DirEntry *)block.Data;
+    for (int i = 0; i < DIR_ENTRIES_PER_BUCKET; i++) {
+        if (entries[i].Name[0] && entries[i].Hash == hash && strcmp(entries[i].Name, name) == 0) {
+            memset(&entries[i], 0, sizeof(DirEntry));
+            return write_bucket(fs, dir, bucket, &block);
+        }
+    }
+    return false;
+}
+
+// Turn a fresh inode into an empty directory with one bucket
+static bool init_dir(FileSystem *fs, uint32_t inumber) {
+    Inode inode;
+    if (!find_inode(fs, inumber, &inode)) {
+        return false;
+    }
+    inode.Valid |= INODE_DIR;
+    store_inode(fs, inumber, &inode);
+
+    // An empty bucket is all zeros, so it stays a hole
+    Bucket block;
+    memset(block.Data, 0, DIR_BUCKET_SIZE);
+    return write_bucket(fs, inumber, 0, &block);
+}
+
+// Root directory inumber, creating the root on first use if asked to
+static ssize_t root_dir(FileSystem *fs, bool create) {
+    if (fs->metadata.Root) {
+        return fs->metadata.Root - 1;
+    }
+    if (!create) {
+        return -1;
+    }
+
+    ssize_t root = fs_create(fs);
+    if (root < 0) {
+        return -1;
+    }
+    if (!init_dir(fs, root)) {
+        remove_inode(fs, root);
+        return -1;
+    }
+
+    fs->metadata.Root = root + 1;
+    store_super(fs);
+    return root;
+}
+
+// Path resolution -------------------------------------------------------------
+
+// Resolve all but the last component of path. Returns the parent directory
+// and leaves the last component in name.
+static ssize_t resolve_parent(FileSystem *fs, const char *path, char *name, bool create) {
+    ssize_t dir = root_dir(fs, create);
+    const char *p = path;
+
+    name[0] = 0;
+    while (dir >= 0) {
+        while (*p == '/') {
+            p++;
+        }
+        size_t length = strcspn(p, "/");
+        if (length == 0) {
+            return name[0] ? dir : -1;
+        }
+        if (length > DIR_NAME_MAX) {
+            return -1;
+        }
+
+        // Descend into the previous component before taking the next one
+        if (name[0]) {
+            dir = dir_find(fs, dir, name, name_hash(name, strlen(name)));
+            if (dir < 0 || !fs_is_dir(fs, dir)) {
+                return -1;
+            }
+        }
+        memcpy(name, p, length);
+        name[length] = 0;
+        p += length;
+    }
+    return -1;
+}
+
+bool fs_is_dir(FileSystem *fs, size_t inumber) {
+    Inode inode;
+    return find_inode(fs, inumber, &inode) && (inode.Valid & INODE_DIR);
+}
+
+ssize_t fs_lookup(FileSystem *fs, const char *path) {
+    char name[DIR_NAME_MAX + 1];
+
+    if (!disk_mounted(fs->disk)) {
+        return -1;
+    }
+
+    // "/" names the root itself
+    if (path[strspn(path, "/")] == 0) {
+        return root_dir(fs, false);
+    }
+
+    ssize_t dir = resolve_parent(fs, path, name, false);
+    if (dir < 0) {
+        return -1;
+    }
+    return dir_find(fs, dir, name, name_hash(name, strlen(name)));
+}
+
+// Create an inode and link it at path
+static ssize_t create_at(FileSystem *fs, const char *path, bool isDir) {
+    char name[DIR_NAME_MAX + 1];
+
+    if (!disk_mounted(fs->disk)) {
+        return -1;
+    }
+
+    ssize_t dir = resolve_parent(fs, path, name, true);
+    if (dir < 0) {
+        return -1;
+    }
+
+    uint32_t hash = name_hash(name, strlen(name));
+    if (dir_find(fs, dir, name, hash) >= 0) {
+        return -1;
+    }
+
+    ssize_t inumber = fs_create(fs);
+    if (inumber < 0) {
+        return -1;
+    }
+    if ((isDir && !init_dir(fs, inumber)) || !dir_add(fs, dir, name, hash, inumber)) {
+        remove_inode(fs, inumber);
+        return -1;
+    }
+    return inumber;
+}
+
+ssize_t fs_mkdir(FileSystem *fs, const char *path) {
+    return create_at(fs, path, true);
+}
+
+ssize_t fs_create_path(FileSystem *fs, const char *path) {
+    return create_at(fs, path, false);
+}
+
+static void count_entry(const char *name, uint32_t inumber, void *arg) {
+    (*(int *)arg)++;
+}
+
+bool fs_unlink(FileSystem *fs, const char *path) {
+    char name[DIR_NAME_MAX + 1];
+
+    if (!disk_mounted(fs->disk)) {
+        return false;
+    }
+
+    ssize_t dir = resolve_parent(fs, path, name, false);
+    if (dir < 0) {
+        return false;
+    }
+
+    uint32_t hash = name_hash(name, strlen(name));
+    ssize_t inumber = dir_find(fs, dir, name, hash);
+    if (inumber < 0) {
+        return false;
+    }
+
+    // Only empty directories can go
+    if (fs_is_dir(fs, inumber)) {
+        int entries = 0;
+        fs_readdir(fs, inumber, count_entry, &entries);
+        if (entries) {
+            return false;
+        }
+    }
+
+    if (!dir_del(fs, dir, name, hash)) {
+        return false;
+    }
+    dcache_forget(fs, inumber);
+
+    // A name left behind by fs_remove has no inode to free
+    Inode inode;
+    return !find_inode(fs, inumber, &inode) || remove_inode(fs, inumber);
+}
+
+bool fs_readdir(FileSystem *fs, size_t inumber, DirCallback callback, void *arg) {
+    if (!disk_mounted(fs->disk) || !fs_is_dir(fs, inumber)) {
+        return false;
+    }
+
+    uint32_t buckets = dir_buckets(fs, inumber);
+    for (uint32_t b = 0; b < buckets; b++) {
+        Bucket block;
+        if (!read_bucket(fs, inumber, b, &block)) {
+            return false;
+        }
+        DirEntry *entries = (DirEntry *)block.Data;
+        for (int i = 0; i < DIR_ENTRIES_PER_BUCKET; i++) {
+            if (live_entry(&entries[i], b, buckets)) {
+                callback(entries[i].Name, entries[i].Inumber, arg);
+            }
+        }
+    }
+    return true;
+}
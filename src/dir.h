@@ -0,0 +1,52 @@
+// dir.h: Directories and path resolution
+
+#pragma once
+
+#include "fs.h"
+
+#define DIR_NAME_MAX 55          // Longest name in a directory entry
+#define DIR_MAX_BUCKETS 1024     // Bucket blocks in a fully grown directory
+#define DCACHE_SIZE 1024         // Slots in the dentry cache
+
+typedef struct
+{
+    uint32_t Inumber;              // Inode the entry names
+    uint32_t Hash;                 // Hash of Name, picks the bucket
+    char Name[DIR_NAME_MAX + 1];   // NUL-terminated, empty if slot is free
+} DirEntry;
+
+#define DIR_BUCKET_SIZE 4096     // Bytes per bucket, whatever the block size
+#define DIR_ENTRIES_PER_BUCKET (DIR_BUCKET_SIZE / sizeof(DirEntry))
+
+typedef union
+{
+    DirEntry Entries[DIR_ENTRIES_PER_BUCKET];
+    char Data[DIR_BUCKET_SIZE];
+} Bucket;
+
+// A directory is a file of 2^k buckets; an entry lives in bucket
+// Hash & (buckets - 1), so a lookup reads one block however big it grows.
+
+typedef struct Dentry
+{
+    bool Valid;
+    uint32_t Parent;               // Directory inumber
+    uint32_t Inumber;              // Entry inumber
+    uint32_t Hash;
+    char Name[DIR_NAME_MAX + 1];
+} Dentry;
+
+typedef void (*DirCallback)(const char *name, uint32_t inumber, void *arg);
+
+ssize_t fs_lookup(FileSystem *fs, const char *path);
+ssize_t fs_mkdir(FileSystem *fs, const char *path);
+ssize_t fs_create_path(FileSystem *fs, const char *path);
+bool fs_unlink(FileSystem *fs, const char *path);
+bool fs_readdir(FileSystem *fs, size_t inumber, DirCallback callback, void *arg);
+bool fs_is_dir(FileSystem *fs, size_t inumber);
+
+// Drop cached dentries pointing at inumber
+void dcache_forget(FileSystem *fs, size_t inumber);
+
+// The same for a sorted batch of inodes, in one sweep of the cache
+void dcache_forget_many(FileSystem *fs, const size_t *inumbers, size_t count);
@@ -1,10 +1,24 @@
+#define _GNU_SOURCE
 #include "disk.h"
+#include "cache.h"
+#include "array.h"
+#include "crc32c.h"
 
 #include <stdio.h>
 #include <errno.h>
 #include <fcntl.h>
 #include <string.h>
 #include <unistd.h>
+#include <sys/stat.h>
+
+// Contents of a discarded block of any size
+static char Zeros[MAX_BLOCK_SIZE];
+
+// Checksum of a block of zeros at the current block size
+static uint32_t zero_checksum(Disk *disk)
+{
+    return crc32c(Zeros, disk->BlockSize);
+}
 
 // Default constructor
 Disk *new_disk()
@@ -12,8 +26,18 @@ Disk *new_disk()
     Disk *disk = malloc(sizeof(Disk));
     disk->FileDescriptor = 0;
     disk->Blocks = 0;
+    disk->BlockSize = BLOCK_SIZE;
     disk->Reads = 0;
     disk->Writes = 0;
+    disk->Discards = 0;
+    disk->CacheHits = 0;
+    disk->MetadataHits = 0;
+    disk->Cache = NULL;
+    disk->Array = NULL;
+    disk->Checksums = NULL;
+    disk->Covered = NULL;
+    disk->ChecksumStart = 0;
+    disk->ChecksumFailures = 0;
     disk->Mounts = 0;
     return disk;
 }
@@ -21,19 +45,41 @@ Disk *new_disk()
 // Destructor
 void free_disk(Disk *disk)
 {
-    if (disk->FileDescriptor > 0)
+    // Stop the prefetch thread before the image is closed under it
+    if (disk->Cache) {
+        free_cache(disk->Cache);
+    }
+
+    if (disk->FileDescriptor > 0 || disk->Array)
     {
         printf("%lu disk block reads\n", disk->Reads);
         printf("%lu disk block writes\n", disk->Writes);
-        close(disk->FileDescriptor);
+        if (disk->Discards) {
+            printf("%lu disk block discards\n", disk->Discards);
+        }
+        if (disk->CacheHits) {
+            printf("%lu block cache hits (%lu metadata)\n", disk->CacheHits, disk->MetadataHits);
+        }
+        if (disk->Checksums) {
+            printf("%lu checksum failures\n", disk->ChecksumFailures);
+        }
+        if (disk->Array) {
+            free_array(disk->Array);
+            disk->Array = NULL;
+        }
+        else {
+            close(disk->FileDescriptor);
+        }
         disk->FileDescriptor = 0;
     }
+    free(disk->Checksums);
+    free(disk->Covered);
     free(disk);
 }
 
 // Open disk image
 // @param	path	    Path to disk image
-// @param	nblocks	    Number of blocks in disk image
+// @param	nblocks	    Number of BLOCK_SIZE blocks in disk image
 void disk_open(Disk *disk, const char *path, size_t nblocks)
 {
     disk->FileDescriptor = open(path, O_RDWR | O_CREAT, 0600);
@@ -45,7 +91,12 @@ void disk_open(Disk *disk, const char *path, size_t nblocks)
         exit(1);
     }
 
-    if (ftruncate(disk->FileDescriptor, nblocks * BLOCK_SIZE) < 0)
+    // Never shrink an existing image: blocks past nblocks may be in use
+    // by a file system that was resized
+    struct stat st;
+    bool large = fstat(disk->FileDescriptor, &st) == 0 && st.st_size >= (off_t)(nblocks * BLOCK_SIZE);
+
+    if (!large && ftruncate(disk->FileDescriptor, nblocks * BLOCK_SIZE) < 0)
     {
         char what[BUFSIZ];
         snprintf(what, BUFSIZ, "Unable to open %s: %s", path, strerror(errno));
@@ -54,8 +105,44 @@ void disk_open(Disk *disk, const char *path, size_t nblocks)
     }
 
     disk->Blocks = nblocks;
+    disk->BlockSize = BLOCK_SIZE;
+    disk->Reads = 0;
+    disk->Writes = 0;
+    disk->Discards = 0;
+}
+
+// Open a striped or mirrored set of images
+// @param	paths	    Paths to the member images
+// @param	count	    Number of members
+// @param	nblocks	    Number of BLOCK_SIZE blocks in the whole disk
+// @param	stripe	    Stripe unit in bytes, ignored when mirroring
+// @param	mirror	    Whether every member holds a full copy
+void disk_open_array(Disk *disk, const char **paths, size_t count, size_t nblocks, size_t stripe, bool mirror)
+{
+    disk->Array = new_array(paths, count, stripe, mirror);
+    if (disk->Array == NULL)
+    {
+        char what[BUFSIZ];
+        snprintf(what, BUFSIZ, "Unable to open disk array: %s", strerror(errno));
+        // throw std::runtime_error(what);
+        exit(1);
+    }
+
+    // As with one image, members are grown but never shrunk
+    if (array_size(disk->Array) < (off_t)(nblocks * BLOCK_SIZE) &&
+        !array_resize(disk->Array, nblocks * BLOCK_SIZE))
+    {
+        char what[BUFSIZ];
+        snprintf(what, BUFSIZ, "Unable to open disk array: %s", strerror(errno));
+        // throw std::runtime_error(what);
+        exit(1);
+    }
+
+    disk->Blocks = nblocks;
+    disk->BlockSize = BLOCK_SIZE;
     disk->Reads = 0;
     disk->Writes = 0;
+    disk->Discards = 0;
 }
 
 // Return size of disk (in terms of blocks)
@@ -112,48 +199,415 @@ void disk_sanity_check(Disk *disk, int blocknum, char *data)
 // Read block from disk
 // @param	blocknum    Block to read from
 // @param	data	    Buffer to read into
-void disk_read(Disk *disk, int blocknum, char *data)
+// @return	whether the block passed verification
+bool disk_read(Disk *disk, int blocknum, char *data)
+{
+    return disk_read_kind(disk, blocknum, data, BLOCK_METADATA);
+}
+
+// Read block from disk, telling the cache what it holds
+// @param	blocknum    Block to read from
+// @param	data	    Buffer to read into
+// @param	kind	    What the block holds
+// @return	whether the block passed verification
+bool disk_read_kind(Disk *disk, int blocknum, char *data, BlockKind kind)
 {
     disk_sanity_check(disk, blocknum, data);
 
-    if (lseek(disk->FileDescriptor, blocknum*BLOCK_SIZE, SEEK_SET) < 0) {
-    	char what[BUFSIZ];
-    	snprintf(what, BUFSIZ, "Unable to lseek %d: %s", blocknum, strerror(errno));
-    	// throw std::runtime_error(what);
-        exit(1);
+    if (disk->Cache) {
+        if (cache_get(disk->Cache, blocknum, data, kind)) {
+            __atomic_fetch_add(&disk->CacheHits, 1, __ATOMIC_RELAXED);
+            if (kind == BLOCK_METADATA) {
+                __atomic_fetch_add(&disk->MetadataHits, 1, __ATOMIC_RELAXED);
+            }
+            return true;
+        }
+        // A block that failed verification is not kept
+        if (!disk_read_device(disk, blocknum, data)) {
+            return false;
+        }
+        cache_put(disk->Cache, blocknum, data, kind);
+        return true;
     }
 
-    if (read(disk->FileDescriptor, data, BLOCK_SIZE) != BLOCK_SIZE) {
+    return disk_read_device(disk, blocknum, data);
+}
+
+// Whether a block just read matches its checksum, if it has one
+static bool verify(Disk *disk, int blocknum, char *data)
+{
+    return !disk->Checksums || !disk->Covered[blocknum] ||
+           crc32c(data, disk->BlockSize) == disk->Checksums[blocknum];
+}
+
+// Read block straight from the image
+// @param	blocknum    Block to read from
+// @param	data	    Buffer to read into
+// @return	whether the block passed verification, from some mirror if need be
+bool disk_read_device(Disk *disk, int blocknum, char *data)
+{
+
+    // Positional I/O so concurrent callers don't race on the file offset
+    if (disk->Array ? !array_read(disk->Array, data, disk->BlockSize, (off_t)blocknum*disk->BlockSize) :
+        pread(disk->FileDescriptor, data, disk->BlockSize, (off_t)blocknum*disk->BlockSize) != (ssize_t)disk->BlockSize) {
     	char what[BUFSIZ];
     	snprintf(what, BUFSIZ, "Unable to read %d: %s", blocknum, strerror(errno));
     	// throw std::runtime_error(what);
         exit(1);
     }
 
-    disk->Reads++;
+    // The prefetch thread reads concurrently with the caller
+    __atomic_fetch_add(&disk->Reads, 1, __ATOMIC_RELAXED);
+
+    if (verify(disk, blocknum, data)) {
+        return true;
+    }
+    __atomic_fetch_add(&disk->ChecksumFailures, 1, __ATOMIC_RELAXED);
+
+    // A mirror has other copies to fall back on
+    for (size_t copy = 0; disk->Array && copy < array_members(disk->Array); copy++) {
+        if (array_read_copy(disk->Array, copy, data, disk->BlockSize, (off_t)blocknum*disk->BlockSize) &&
+            verify(disk, blocknum, data)) {
+            fprintf(stderr, "checksum mismatch on block %d, read from mirror %zu\n", blocknum, copy);
+            return true;
+        }
+    }
+    fprintf(stderr, "checksum mismatch on block %d\n", blocknum);
+    return false;
+}
+
+// Write the table block holding blocknum's checksum
+static void store_checksum(Disk *disk, int blocknum)
+{
+    int entry = blocknum / CHECKSUMS_PER_BLOCK(disk);
+    disk_write(disk, disk->ChecksumStart + entry, (char *)(disk->Checksums + entry * CHECKSUMS_PER_BLOCK(disk)));
 }
 
 // Write block to disk
 // @param	blocknum    Block to write to
 // @param	data	    Buffer to write from
 void disk_write(Disk *disk, int blocknum, char *data)
+{
+    disk_write_kind(disk, blocknum, data, BLOCK_METADATA);
+}
+
+// Write block to disk, telling the cache what it holds
+// @param	blocknum    Block to write to
+// @param	data	    Buffer to write from
+// @param	kind	    What the block holds
+void disk_write_kind(Disk *disk, int blocknum, char *data, BlockKind kind)
 {
     disk_sanity_check(disk, blocknum, data);
 
-    if (lseek(disk->FileDescriptor, blocknum*BLOCK_SIZE, SEEK_SET) < 0) {
+    // Positional I/O so concurrent callers don't race on the file offset
+    if (disk->Array ? !array_write(disk->Array, data, disk->BlockSize, (off_t)blocknum*disk->BlockSize) :
+        pwrite(disk->FileDescriptor, data, disk->BlockSize, (off_t)blocknum*disk->BlockSize) != (ssize_t)disk->BlockSize) {
     	char what[BUFSIZ];
-    	snprintf(what, BUFSIZ, "Unable to lseek %d: %s", blocknum, strerror(errno));
+    	snprintf(what, BUFSIZ, "Unable to write %d: %s", blocknum, strerror(errno));
     	// throw std::runtime_error(what);
         exit(1);
     }
 
-    if (write(disk->FileDescriptor, data, BLOCK_SIZE) != BLOCK_SIZE) {
+    if (disk->Cache) {
+        cache_put(disk->Cache, blocknum, data, kind);
+    }
+
+    disk->Writes++;
+
+    if (disk->Checksums && disk->Covered[blocknum]) {
+        uint32_t crc = crc32c(data, disk->BlockSize);
+        if (crc != disk->Checksums[blocknum]) {
+            disk->Checksums[blocknum] = crc;
+            store_checksum(disk, blocknum);
+        }
+    }
+}
+
+
+// Read a run of consecutive blocks with a single transfer
+// @param	start	    First block to read
+// @param	count	    Number of blocks to read
+// @param	data	    Buffer of count blocks to read into
+// @return	whether every block passed verification
+bool disk_read_run(Disk *disk, int start, int count, char *data)
+{
+    disk_sanity_check(disk, start, data);
+    disk_sanity_check(disk, start + count - 1, data);
+
+    // Blocks go through the cache write-through, so the image is current
+    size_t length = (size_t)count*disk->BlockSize;
+    if (disk->Array ? !array_read(disk->Array, data, length, (off_t)start*disk->BlockSize) :
+        pread(disk->FileDescriptor, data, length, (off_t)start*disk->BlockSize) != (ssize_t)length) {
     	char what[BUFSIZ];
-    	snprintf(what, BUFSIZ, "Unable to write %d: %s", blocknum, strerror(errno));
+    	snprintf(what, BUFSIZ, "Unable to read %d+%d: %s", start, count, strerror(errno));
     	// throw std::runtime_error(what);
         exit(1);
     }
 
-    disk->Writes++;
+    __atomic_fetch_add(&disk->Reads, count, __ATOMIC_RELAXED);
+
+    // A block that fails is read again alone, which tries every mirror
+    bool ok = true;
+    for (int i = 0; disk->Checksums && i < count; i++) {
+        char *block = data + (size_t)i*disk->BlockSize;
+        if (!verify(disk, start + i, block) && !disk_read_device(disk, start + i, block)) {
+            ok = false;
+        }
+    }
+    return ok;
 }
 
+// Write a run of consecutive data blocks with a single transfer
+// @param	start	    First block to write
+// @param	count	    Number of blocks to write
+// @param	data	    Buffer of count blocks to write from
+void disk_write_run(Disk *disk, int start, int count, char *data)
+{
+    disk_sanity_check(disk, start, data);
+    disk_sanity_check(disk, start + count - 1, data);
+
+    size_t length = (size_t)count*disk->BlockSize;
+    if (disk->Array ? !array_write(disk->Array, data, length, (off_t)start*disk->BlockSize) :
+        pwrite(disk->FileDescriptor, data, length, (off_t)start*disk->BlockSize) != (ssize_t)length) {
+    	char what[BUFSIZ];
+    	snprintf(what, BUFSIZ, "Unable to write %d+%d: %s", start, count, strerror(errno));
+    	// throw std::runtime_error(what);
+        exit(1);
+    }
+
+    for (int i = 0; disk->Cache && i < count; i++) {
+        cache_put(disk->Cache, start + i, data + (size_t)i*disk->BlockSize, BLOCK_DATA);
+    }
+
+    disk->Writes += count;
+
+    // Each checksum table block touched is written once
+    if (disk->Checksums) {
+        int dirty = -1;
+        for (int i = start; i < start + count; i++) {
+            if (!disk->Covered[i]) {
+                continue;
+            }
+            uint32_t crc = crc32c(data + (size_t)(i - start)*disk->BlockSize, disk->BlockSize);
+            if (disk->Checksums[i] != crc) {
+                disk->Checksums[i] = crc;
+                if (dirty >= 0 && dirty / CHECKSUMS_PER_BLOCK(disk) != i / CHECKSUMS_PER_BLOCK(disk)) {
+                    store_checksum(disk, dirty);
+                }
+                dirty = i;
+            }
+        }
+        if (dirty >= 0) {
+            store_checksum(disk, dirty);
+        }
+    }
+}
+
+
+// Discard a run of blocks
+// @param	start	    First block to discard
+// @param	count	    Number of blocks to discard
+void disk_discard(Disk *disk, int start, int count)
+{
+    if (count <= 0) {
+        return;
+    }
+
+    if (start < 0 || start + count > (int)disk->Blocks) {
+        char what[BUFSIZ];
+        snprintf(what, BUFSIZ, "discard range %d+%d is out of bounds!", start, count);
+        // throw std::invalid_argument(what);
+        exit(1);
+    }
+
+    if (disk->Cache) {
+        cache_drop(disk->Cache, start, count);
+    }
+
+    // Discarded blocks read back as zeros, so that is what they now sum to
+    if (disk->Checksums) {
+        uint32_t crc = zero_checksum(disk);
+        int dirty = -1;
+        for (int i = start; i < start + count; i++) {
+            if (disk->Covered[i] && disk->Checksums[i] != crc) {
+                disk->Checksums[i] = crc;
+                if (dirty >= 0 && dirty / CHECKSUMS_PER_BLOCK(disk) != i / CHECKSUMS_PER_BLOCK(disk)) {
+                    store_checksum(disk, dirty);
+                }
+                dirty = i;
+            }
+        }
+        if (dirty >= 0) {
+            store_checksum(disk, dirty);
+        }
+    }
+
+    // Every member holding part of the run punches its own hole
+    if (disk->Array && array_discard(disk->Array, (size_t)count*disk->BlockSize, (off_t)start*disk->BlockSize)) {
+        disk->Discards += count;
+        return;
+    }
+
+#ifdef FALLOC_FL_PUNCH_HOLE
+    // Punch a hole so the host filesystem releases the storage
+    if (!disk->Array && fallocate(disk->FileDescriptor, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+                  (off_t)start*disk->BlockSize, (off_t)count*disk->BlockSize) == 0) {
+        disk->Discards += count;
+        return;
+    }
+#endif
+
+    // No hole punching on this host: fall back to writing zeros
+    for (int i = start; i < start + count; i++) {
+        disk_write(disk, i, Zeros);
+    }
+}
+
+// Put a write-through block cache in front of the image
+// @param	nblocks	    Cache capacity in blocks
+void disk_enable_cache(Disk *disk, size_t nblocks)
+{
+    if (disk->Cache == NULL && nblocks > 0) {
+        disk->Cache = new_cache(disk, nblocks);
+    }
+}
+
+// Grow the disk image
+// @param	nblocks	    New number of blocks
+void disk_resize(Disk *disk, size_t nblocks)
+{
+    if (nblocks <= disk->Blocks) {
+        return;
+    }
+
+    if (disk->Array ? !array_resize(disk->Array, nblocks * disk->BlockSize) :
+        ftruncate(disk->FileDescriptor, nblocks * disk->BlockSize) < 0) {
+        char what[BUFSIZ];
+        snprintf(what, BUFSIZ, "Unable to resize to %lu blocks: %s", nblocks, strerror(errno));
+        // throw std::runtime_error(what);
+        exit(1);
+    }
+
+    // New blocks are holes, which sum to the checksum of zeros
+    if (disk->Checksums) {
+        size_t entries = disk_checksum_blocks(disk, disk->Blocks) * CHECKSUMS_PER_BLOCK(disk);
+        size_t grown = disk_checksum_blocks(disk, nblocks) * CHECKSUMS_PER_BLOCK(disk);
+        uint32_t crc = zero_checksum(disk);
+
+        disk->Checksums = realloc(disk->Checksums, grown * sizeof(uint32_t));
+        for (size_t i = entries; i < grown; i++) {
+            disk->Checksums[i] = crc;
+        }
+        disk->Covered = realloc(disk->Covered, nblocks * sizeof(bool));
+        memset(disk->Covered + disk->Blocks, 0, (nblocks - disk->Blocks) * sizeof(bool));
+    }
+
+    disk->Blocks = nblocks;
+}
+
+// Switch to a different block size
+// @param	size	    New block size
+void disk_set_block_size(Disk *disk, size_t size)
+{
+    if (size == disk->BlockSize) {
+        return;
+    }
+
+    if (size < MIN_BLOCK_SIZE || size > MAX_BLOCK_SIZE || (size & (size - 1))) {
+        char what[BUFSIZ];
+        snprintf(what, BUFSIZ, "block size (%lu) is invalid!", size);
+        // throw std::invalid_argument(what);
+        exit(1);
+    }
+
+    // Cached blocks are the wrong size now; keep the cache's byte budget
+    size_t cached = 0;
+    if (disk->Cache) {
+        cached = cache_capacity(disk->Cache) * disk->BlockSize;
+        free_cache(disk->Cache);
+        disk->Cache = NULL;
+    }
+
+    free(disk->Checksums);
+    free(disk->Covered);
+    disk->Checksums = NULL;
+    disk->Covered = NULL;
+
+    disk->Blocks = disk->Blocks * disk->BlockSize / size;
+    disk->BlockSize = size;
+
+    if (cached) {
+        disk_enable_cache(disk, cached / size > 0 ? cached / size : 1);
+    }
+}
+
+// Number of blocks a checksum table for nblocks blocks takes
+// @param	nblocks	    Blocks on the disk
+size_t disk_checksum_blocks(Disk *disk, size_t nblocks)
+{
+    return (nblocks + CHECKSUMS_PER_BLOCK(disk) - 1) / CHECKSUMS_PER_BLOCK(disk);
+}
+
+// Load or initialize the checksum table
+// @param	start	    First block of the table
+// @param	reset	    Whether to write a fresh table instead of loading it
+void disk_enable_checksums(Disk *disk, int start, bool reset)
+{
+    size_t nblocks = disk_checksum_blocks(disk, disk->Blocks);
+
+    free(disk->Checksums);
+    free(disk->Covered);
+    disk->Checksums = malloc(nblocks * disk->BlockSize);
+    disk->Covered = calloc(disk->Blocks, sizeof(bool));
+    disk->ChecksumStart = start;
+
+    if (reset) {
+        uint32_t crc = zero_checksum(disk);
+        for (size_t i = 0; i < nblocks * CHECKSUMS_PER_BLOCK(disk); i++) {
+            disk->Checksums[i] = crc;
+        }
+        for (size_t i = 0; i < nblocks; i++) {
+            disk_write(disk, start + i, (char *)(disk->Checksums + i * CHECKSUMS_PER_BLOCK(disk)));
+        }
+        return;
+    }
+
+    for (size_t i = 0; i < nblocks; i++) {
+        disk_read(disk, start + i, (char *)(disk->Checksums + i * CHECKSUMS_PER_BLOCK(disk)));
+    }
+}
+
+// Write the checksum table to a new location
+// @param	start	    First block of the new table
+void disk_move_checksums(Disk *disk, int start)
+{
+    disk->ChecksumStart = start;
+    for (size_t i = 0; i < disk_checksum_blocks(disk, disk->Blocks); i++) {
+        disk_write(disk, start + i, (char *)(disk->Checksums + i * CHECKSUMS_PER_BLOCK(disk)));
+    }
+}
+
+// Choose which blocks are checksummed
+// @param	start	    First block of the run
+// @param	count	    Number of blocks in the run
+// @param	covered	    Whether the run is checksummed
+void disk_checksum_range(Disk *disk, int start, int count, bool covered)
+{
+    if (disk->Checksums == NULL || start < 0 || start + count > (int)disk->Blocks) {
+        return;
+    }
+
+    for (int i = start; i < start + count; i++) {
+        disk->Covered[i] = covered;
+    }
+}
+
+// Start reading a block into the cache in the background
+// @param	blocknum    Block to prefetch
+// @param	kind	    What the block holds
+void disk_prefetch(Disk *disk, int blocknum, BlockKind kind)
+{
+    if (disk->Cache && blocknum > 0 && blocknum < (int)disk->Blocks) {
+        cache_prefetch(disk->Cache, blocknum, kind);
+    }
+}
@@ -3,16 +3,41 @@
 #pragma once
 
 #include <stdlib.h>
+#include <stdint.h>
 #include <stdbool.h>
 
-#define BLOCK_SIZE 4096
+#define BLOCK_SIZE 4096         // Default block size, and the unit images are opened in
+#define MIN_BLOCK_SIZE 4096
+#define MAX_BLOCK_SIZE 65536
+#define CHECKSUMS_PER_BLOCK(disk) ((disk)->BlockSize / sizeof(uint32_t))
+
+struct BlockCache;
+struct DiskArray;
+
+// What a block holds, which decides how the block cache keeps it
+typedef enum
+{
+    BLOCK_METADATA,     // Superblock, inode, indirect and checksum blocks; kept ahead of data
+    BLOCK_DATA,         // File contents
+    BLOCK_STREAM,       // File contents read once, as by a bulk export; not cached
+} BlockKind;
 
 typedef struct
 {
     int FileDescriptor; // File descriptor of disk image
     size_t Blocks;      // Number of blocks in disk image
+    size_t BlockSize;   // Bytes per block, BLOCK_SIZE until the file system says otherwise
     size_t Reads;       // Number of reads performed
     size_t Writes;      // Number of writes performed
+    size_t Discards;    // Number of blocks discarded
+    size_t CacheHits;   // Number of reads served by the block cache
+    size_t MetadataHits;        // Of those, reads of metadata
+    struct BlockCache *Cache;   // Optional write-through block cache
+    struct DiskArray *Array;    // Striped or mirrored images, NULL for one image
+    uint32_t *Checksums;        // CRC32C of every block, NULL if not checksumming
+    bool *Covered;              // Blocks whose checksums are kept and verified
+    int ChecksumStart;          // First block of the on-disk checksum table
+    size_t ChecksumFailures;    // Reads that failed verification
     size_t Mounts;      // Number of mounts
 } Disk;
 
@@ -26,9 +51,18 @@ void free_disk(Disk *disk);
 // Open disk image
 // @param	disk pointer
 // @param	path	    Path to disk image
-// @param	nblocks	    Number of blocks in disk image
+// @param	nblocks	    Number of BLOCK_SIZE blocks in disk image
 void disk_open(Disk *disk, const char *path, size_t nblocks);
 
+// Open a striped or mirrored set of images as one disk
+// @param	disk pointer
+// @param	paths	    Paths to the member images
+// @param	count	    Number of members
+// @param	nblocks	    Number of BLOCK_SIZE blocks in the whole disk
+// @param	stripe	    Stripe unit in bytes, ignored when mirroring
+// @param	mirror	    Whether every member holds a full copy
+void disk_open_array(Disk *disk, const char **paths, size_t count, size_t nblocks, size_t stripe, bool mirror);
+
 // Return size of disk (in terms of blocks)
 // @param	disk pointer
 size_t disk_size(Disk *disk);
@@ -51,14 +85,103 @@ void disk_unmount(Disk *disk);
 // @param	data	    Buffer to operate on
 void disk_sanity_check(Disk *disk, int blocknum, char *data);
 
-// Read block from disk
+// Read block from disk, caching it as metadata
+// @param	disk pointer
+// @param	blocknum    Block to read from
+// @param	data	    Buffer to read into
+// @return	whether the block passed verification; one that failed is not cached
+bool disk_read(Disk *disk, int blocknum, char *data);
+
+// Read block from disk, telling the cache what it holds
+// @param	disk pointer
+// @param	blocknum    Block to read from
+// @param	data	    Buffer to read into
+// @param	kind	    What the block holds
+// @return	whether the block passed verification; one that failed is not cached
+bool disk_read_kind(Disk *disk, int blocknum, char *data, BlockKind kind);
+
+// Read block straight from the image, bypassing the cache
 // @param	disk pointer
 // @param	blocknum    Block to read from
 // @param	data	    Buffer to read into
-void disk_read(Disk *disk, int blocknum, char *data);
+// @return	whether the block passed verification, from another mirror if need be
+bool disk_read_device(Disk *disk, int blocknum, char *data);
 
-// Write block to disk
+// Write block to disk, caching it as metadata
 // @param	disk pointer
 // @param	blocknum    Block to write to
 // @param	data	    Buffer to write from
 void disk_write(Disk *disk, int blocknum, char *data);
+
+// Write block to disk, telling the cache what it holds
+// @param	disk pointer
+// @param	blocknum    Block to write to
+// @param	data	    Buffer to write from
+// @param	kind	    What the block holds
+void disk_write_kind(Disk *disk, int blocknum, char *data, BlockKind kind);
+
+// Read a run of consecutive blocks with a single transfer, bypassing the cache
+// @param	disk pointer
+// @param	start	    First block to read
+// @param	count	    Number of blocks to read
+// @param	data	    Buffer of count blocks to read into
+// @return	whether every block passed verification
+bool disk_read_run(Disk *disk, int start, int count, char *data);
+
+// Write a run of consecutive data blocks with a single transfer
+// @param	disk pointer
+// @param	start	    First block to write
+// @param	count	    Number of blocks to write
+// @param	data	    Buffer of count blocks to write from
+void disk_write_run(Disk *disk, int start, int count, char *data);
+
+// Discard a run of blocks; they read back as zeros afterwards
+// @param	disk pointer
+// @param	start	    First block to discard
+// @param	count	    Number of blocks to discard
+void disk_discard(Disk *disk, int start, int count);
+
+// Put a write-through block cache in front of the image
+// @param	disk pointer
+// @param	nblocks	    Cache capacity in blocks
+void disk_enable_cache(Disk *disk, size_t nblocks);
+
+// Grow the disk image; new blocks read as zeros
+// @param	disk pointer
+// @param	nblocks	    New number of blocks, at least the current size
+void disk_resize(Disk *disk, size_t nblocks);
+
+// Switch to a different block size; the image keeps its length in bytes
+// and any cache or checksum table is dropped
+// @param	disk pointer
+// @param	size	    New block size, a power of two in [MIN_BLOCK_SIZE, MAX_BLOCK_SIZE]
+void disk_set_block_size(Disk *disk, size_t size);
+
+// Number of blocks a checksum table for nblocks blocks takes
+// @param	disk pointer
+// @param	nblocks	    Blocks on the disk
+size_t disk_checksum_blocks(Disk *disk, size_t nblocks);
+
+// Load (or, with reset, initialize for an all-zero disk) the checksum table
+// @param	disk pointer
+// @param	start	    First block of the table
+// @param	reset	    Whether to write a fresh table instead of loading it
+void disk_enable_checksums(Disk *disk, int start, bool reset);
+
+// Write the whole checksum table to a new location and use it from now on
+// @param	disk pointer
+// @param	start	    First block of the new table
+void disk_move_checksums(Disk *disk, int start);
+
+// Choose which blocks have their checksums maintained and verified
+// @param	disk pointer
+// @param	start	    First block of the run
+// @param	count	    Number of blocks in the run
+// @param	covered	    Whether the run is checksummed
+void disk_checksum_range(Disk *disk, int start, int count, bool covered);
+
+// Start reading a block into the cache in the background
+// @param	disk pointer
+// @param	blocknum    Block to prefetch
+// @param	kind	    What the block holds
+void disk_prefetch(Disk *disk, int blocknum, BlockKind kind);
@@ -1,8 +1,12 @@
 #include "disk.h"
 #include "fs.h"
+#include "dir.h"
+#include "lz.h"
+#include "dedup.h"
 
 #include <stdio.h>
 #include <string.h>
+#include <stddef.h>
 #include <math.h>
 
 #define min(a,b) (((a) < (b)) ? (a) : (b))
@@ -14,21 +18,198 @@
 #define DEBUG_PRINT(fmt, args...)    /* Don't do anything in release builds */
 #endif
 
-// Debug file system -----------------------------------------------------------
+// Inode table geometry --------------------------------------------------------
 
-void fs_debug(Disk *disk) {
-    if (disk == 0)
-        return;
+// Bytes per block chosen at format time
+static inline uint32_t block_size(const SuperBlock *sb) {
+    return sb->BlockSize ? sb->BlockSize : BLOCK_SIZE;
+}
+
+// Size of one on-disk inode record
+static inline uint32_t inode_size(const SuperBlock *sb) {
+    return sb->InodeSize ? sb->InodeSize : sizeof(Inode);
+}
+
+// Number of inode records per inode block
+static inline uint32_t inodes_per_block(const SuperBlock *sb) {
+    return block_size(sb) / inode_size(sb);
+}
+
+// Disk block holding inumber
+static inline uint32_t inode_block(const SuperBlock *sb, size_t inumber) {
+    return inumber / inodes_per_block(sb) + 1;
+}
+
+// Record of inode slot within an inode block
+static inline Inode *inode_record(const SuperBlock *sb, Block *block, size_t slot) {
+    return (Inode *)(block->Data + slot * inode_size(sb));
+}
+
+// Inline data starts at the pointer fields and runs to the end of the record
+static inline char *inline_data(Inode *inode) {
+    return (char *)inode->Direct;
+}
+
+static inline uint32_t inline_capacity(const SuperBlock *sb) {
+    return inode_size(sb) - offsetof(Inode, Direct);
+}
+
+// Physical block of a pointer slot; compressed clusters tag their first slot
+static inline uint32_t pointer_block(const Inode *inode, uint32_t pointer) {
+    return (inode->Valid & INODE_COMPRESSED) ? pointer & POINTER_MASK : pointer;
+}
+
+// Blocks in the inode table's first extent, which follows the superblock
+static inline uint32_t table_base(const SuperBlock *sb) {
+    uint32_t base = sb->InodeBlocks;
+    for (int i = 0; i < MAX_EXTENTS; i++) {
+        base -= sb->Extents[i].Count;
+    }
+    return base;
+}
+
+// Disk block of the live inode table's logical block (1-based); extents
+// added by fs_resize continue the table in order
+static inline uint32_t extent_block(const SuperBlock *sb, uint32_t logical) {
+    uint32_t base = table_base(sb);
+    if (logical <= base) {
+        return logical;
+    }
+
+    logical -= base;
+    for (int i = 0; i < MAX_EXTENTS; i++) {
+        if (logical <= sb->Extents[i].Count) {
+            return sb->Extents[i].Start + logical - 1;
+        }
+        logical -= sb->Extents[i].Count;
+    }
+    return 0;
+}
+
+// Disk block of a logical block of the mounted inode table
+static inline uint32_t table_block(FileSystem *fs, uint32_t logical) {
+    return fs->inodeTable ? fs->inodeTable + logical - 1 : extent_block(&fs->metadata, logical);
+}
+
+// Bytes of file data in one compressed cluster
+static inline size_t cluster_size(FileSystem *fs) {
+    return (size_t)CLUSTER_BLOCKS << fs->blockShift;
+}
+
+// First block after the inode table's first extent; anything else placed
+// past it (checksum table, snapshots, extents) is reserved in the bitmap
+static inline uint32_t data_start(const SuperBlock *sb) {
+    return table_base(sb) + 1;
+}
+
+// Inode table blocks for a disk of the given size: one inode per InodeRatio
+// bytes of disk, or a tenth of the blocks without a ratio
+static uint32_t inode_blocks_for(const SuperBlock *sb, uint32_t blocks) {
+    if (!sb->InodeRatio) {
+        return (uint32_t)ceil(blocks / 10.0);
+    }
+    uint64_t inodes = ((uint64_t)blocks * block_size(sb) + sb->InodeRatio - 1) / sb->InodeRatio;
+    return (inodes + inodes_per_block(sb) - 1) / inodes_per_block(sb);
+}
+
+// Buffered writes of inumber, NULL if it has none
+static inline DirtyFile *dirty_file(FileSystem *fs, size_t inumber) {
+    if (fs->dirty == NULL) {
+        return NULL;
+    }
+    DirtyFile *d = &fs->dirty[inumber % DELALLOC_FILES];
+    return d->Inumber == inumber + 1 ? d : NULL;
+}
+
+// Forget a file's buffered writes and free its slot
+static void drop_dirty(FileSystem *fs, DirtyFile *d) {
+    for (uint32_t i = 0; i < POINTERS_PER_INODE + fs->pointersPerBlock; i++) {
+        if (d->Blocks[i]) {
+            free(d->Blocks[i]);
+            fs->dirtyBytes -= fs->blockSize;
+        }
+    }
+    free(d->Blocks);
+    d->Blocks = NULL;
+    d->Inumber = 0;
+    fs->reserved -= d->Reserved;
+    d->Reserved = 0;
+}
+
+// Allocation groups are fixed runs of GROUP_BLOCKS blocks. Only their free
+// counts are kept, so the allocator can pass over a full group unread.
+
+// Mark a block used or free, keeping its group's free count
+static inline void set_used(FileSystem *fs, uint32_t blocknum, bool used) {
+    if (fs->groupFree && fs->bitmap[blocknum] != used) {
+        fs->groupFree[blocknum / GROUP_BLOCKS] += used ? -1 : 1;
+    }
+    fs->bitmap[blocknum] = used;
+}
+
+// Recount every group's free blocks from the bitmap
+static void count_groups(FileSystem *fs) {
+    fs->groups = (fs->metadata.Blocks + GROUP_BLOCKS - 1) / GROUP_BLOCKS;
+    fs->groupFree = realloc(fs->groupFree, fs->groups * sizeof(uint32_t));
+    memset(fs->groupFree, 0, fs->groups * sizeof(uint32_t));
+    for (uint32_t i = 0; i < fs->metadata.Blocks; i++) {
+        if (!fs->bitmap[i]) {
+            fs->groupFree[i / GROUP_BLOCKS]++;
+        }
+    }
+}
+
+static uint32_t free_blocks(FileSystem *fs) {
+    uint32_t count = 0;
+    for (uint32_t g = 0; g < fs->groups; g++) {
+        count += fs->groupFree[g];
+    }
+    return count;
+}
+
+// Free blocks not held back for buffered writes
+static uint32_t available_blocks(FileSystem *fs) {
+    uint32_t count = free_blocks(fs);
+    return count > fs->reserved ? count - fs->reserved : 0;
+}
+
+// First usable block of the inode's home group. Inodes are dealt round the
+// groups, so files created one after another start in different groups
+// and each has room to grow in place.
+static inline uint32_t home_block(FileSystem *fs, size_t inumber) {
+    uint32_t group = inumber % fs->groups;
+    return max(group * GROUP_BLOCKS, data_start(&fs->metadata));
+}
+
+// Check the block size stored in (or requested for) a superblock
+static bool valid_block_size(uint32_t size) {
+    if (size == 0) {
+        return true;
+    }
+    return size >= MIN_BLOCK_SIZE && size <= MAX_BLOCK_SIZE && !(size & (size - 1));
+}
 
+// Check the inode record size stored in (or requested for) a superblock
+static bool valid_inode_size(uint32_t size) {
+    if (size == 0) {
+        return true;
+    }
+    return size >= sizeof(Inode) && size <= BLOCK_SIZE / 4 && !(size & (size - 1));
+}
+
+// Debug file system -----------------------------------------------------------
+
+static void debug_image(Disk *disk) {
     Block block;
 
     // Read Superblock
     disk_read(disk, 0, block.Data);
 
-    uint32_t magic_num = block.Super.MagicNumber;
-    uint32_t num_blocks = block.Super.Blocks;
-    uint32_t num_inodeBlocks = block.Super.InodeBlocks;
-    uint32_t num_inodes = block.Super.Inodes;
+    SuperBlock sb = block.Super;
+    uint32_t magic_num = sb.MagicNumber;
+    uint32_t num_blocks = sb.Blocks;
+    uint32_t num_inodeBlocks = sb.InodeBlocks;
+    uint32_t num_inodes = sb.Inodes;
 
     if (magic_num != MAGIC_NUMBER) {
         printf("Magic number is valid: %c\n", magic_num);
@@ -41,13 +222,69 @@ void fs_debug(Disk *disk) {
     printf("    %u inode blocks\n", num_inodeBlocks);
     printf("    %u inodes\n", num_inodes);
 
-    uint32_t expected_num_inodeBlocks = round((float)num_blocks / 10);
+    if (!valid_block_size(sb.BlockSize)) {
+        printf("SuperBlock declairs invalid block size %u!\n", sb.BlockSize);
+        return;
+    }
+    if (sb.BlockSize) {
+        printf("    %u byte blocks\n", sb.BlockSize);
+    }
+    if (sb.InodeRatio) {
+        printf("    one inode per %u bytes\n", sb.InodeRatio);
+    }
+
+    // The superblock fits in any block size; the rest is read at the real
+    // one, and fs_debug puts the disk back as it was afterwards
+    if (!disk_mounted(disk)) {
+        disk_set_block_size(disk, block_size(&sb));
+    }
+
+    if (!valid_inode_size(sb.InodeSize)) {
+        printf("SuperBlock declairs invalid inode size %u!\n", sb.InodeSize);
+        return;
+    }
+    if (sb.InodeSize) {
+        printf("    %u byte inodes\n", sb.InodeSize);
+    }
+    if (sb.Features & FEATURE_INLINE) {
+        printf("    inline data up to %u bytes\n", inline_capacity(&sb));
+    }
+    if (sb.Features & FEATURE_COMPRESS) {
+        printf("    compression enabled\n");
+    }
+    if (sb.Features & FEATURE_DEDUP) {
+        printf("    deduplication enabled\n");
+    }
+    if (sb.Features & FEATURE_CHECKSUM) {
+        printf("    checksums on %s, table in blocks %u-%u\n",
+               sb.Features & FEATURE_CHECKSUM_DATA ? "all blocks" : "metadata",
+               sb.Checksums, sb.Checksums + (uint32_t)disk_checksum_blocks(disk, sb.Blocks) - 1);
+    }
+    if (sb.Root) {
+        printf("    root directory is inode %u\n", sb.Root - 1);
+    }
+    for (int i = 0; i < MAX_SNAPSHOTS; i++) {
+        if (sb.Snapshots[i].Table) {
+            printf("    snapshot %d: inode table in blocks %u-%u\n", i,
+                   sb.Snapshots[i].Table, sb.Snapshots[i].Table + sb.Snapshots[i].InodeBlocks - 1);
+        }
+    }
+
+    uint32_t extent_inodeBlocks = 0;
+    for (int i = 0; i < MAX_EXTENTS; i++) {
+        if (sb.Extents[i].Count) {
+            printf("    inode table extent in blocks %u-%u\n",
+                   sb.Extents[i].Start, sb.Extents[i].Start + sb.Extents[i].Count - 1);
+            extent_inodeBlocks += sb.Extents[i].Count;
+        }
+    }
 
-    if (expected_num_inodeBlocks != num_inodeBlocks) {
-        printf("SuperBlock declairs %u InodeBlocks but expect %u InodeBlocks!\n", num_inodeBlocks, expected_num_inodeBlocks);
+    if (extent_inodeBlocks >= num_inodeBlocks) {
+        printf("SuperBlock declairs %u InodeBlocks but its extents hold %u!\n", num_inodeBlocks, extent_inodeBlocks);
+        return;
     }
 
-    uint32_t expect_num_inodes = num_inodeBlocks * INODES_PER_BLOCK;
+    uint32_t expect_num_inodes = num_inodeBlocks * inodes_per_block(&sb);
     if (expect_num_inodes != num_inodes) {
         printf("SuperBlock declairs %u Inodes but expect %u Inodes!\n", num_inodes, expect_num_inodes);
     }
@@ -56,37 +293,61 @@ void fs_debug(Disk *disk) {
     int idx = 0;
     
     for (int i = 1; i <= num_inodeBlocks; i++) {
-        disk_read(disk, i, block.Data);
+        disk_read(disk, extent_block(&sb, i), block.Data);
 
-        // Iterating over all the INODE_PER_BLOCK
-        for (int j = 0; j < INODES_PER_BLOCK; j++) {
-            if (block.Inodes[j].Valid) {
+        // Iterating over all the inodes in the block
+        for (int j = 0; j < inodes_per_block(&sb); j++) {
+            Inode *inode = inode_record(&sb, &block, j);
+            if (inode->Valid) {
                 printf("Inode %d:\n", idx);
-                printf("    size: %u bytes\n", block.Inodes[j].Size);
+                printf("    size: %u bytes\n", inode->Size);
+                if (inode->Valid & INODE_DIR) {
+                    printf("    directory\n");
+                }
+
+                // Inline inodes have no block pointers
+                if (inode->Valid & INODE_INLINE) {
+                    printf("    inline data\n");
+                    idx++;
+                    continue;
+                }
+
                 printf("    direct blocks:");
+                uint32_t allocated = 0;
 
                 // Iterating through direct nodes
                 for (int k = 0; k < POINTERS_PER_INODE; k++) {
-                    if (block.Inodes[j].Direct[k]) {
-                        printf(" %u", block.Inodes[j].Direct[k]);
+                    if (inode->Direct[k]) {
+                        printf(" %u", pointer_block(inode, inode->Direct[k]));
+                        allocated++;
                     }
                 }
                 printf("\n");
 
                 // Iterating through indirect nodes
-                if(block.Inodes[j].Indirect) {
-                    printf("    indirect block: %u\n",block.Inodes[j].Indirect);
+                if(inode->Indirect) {
+                    printf("    indirect block: %u\n", inode->Indirect);
                     printf("    indirect data blocks:");
 
                     Block inDirBlock;
-                    disk_read(disk, block.Inodes[j].Indirect, inDirBlock.Data);
+                    disk_read(disk, inode->Indirect, inDirBlock.Data);
 
-                    for(int k = 0; k < POINTERS_PER_BLOCK; k++) {
+                    for(int k = 0; k < block_size(&sb) / sizeof(uint32_t); k++) {
                         if(inDirBlock.Pointers[k]) {
-                            printf(" %u", inDirBlock.Pointers[k]);
+                            printf(" %u", pointer_block(inode, inDirBlock.Pointers[k]));
+                            allocated++;
                         }
                     }
                     printf("\n");
+                    allocated++;
+                }
+
+                // Holes make this smaller than the size implies
+                printf("    allocated blocks: %u\n", allocated);
+
+                if (inode->Valid & INODE_COMPRESSED) {
+                    printf("    compression ratio: %.2f\n",
+                           allocated ? (double)inode->Size / ((double)allocated * block_size(&sb)) : 0.0);
                 }
             }
             idx++;
@@ -94,51 +355,83 @@ void fs_debug(Disk *disk) {
     }
 }
 
+// Dump an image, mounted or not, without leaving the disk at another
+// block size
+void fs_debug(Disk *disk) {
+    if (disk == 0)
+        return;
+
+    // Shrinking to whole larger blocks drops a partial tail; put it back too
+    size_t previous = disk->BlockSize, blocks = disk_size(disk);
+    debug_image(disk);
+    disk_set_block_size(disk, previous);
+    disk_resize(disk, blocks);
+}
+
 // Format file system ----------------------------------------------------------
 
 bool fs_format(Disk *disk) {
+    FormatOptions opts = {0, 0, 0, 0};
+    return fs_format_with(disk, &opts);
+}
+
+bool fs_format_with(Disk *disk, const FormatOptions *opts) {
     // Checks if disk is already mounted
     if (disk_mounted(disk)) { 
         // Already mounted, so it fails
         return false;
     }
 
+    if (!valid_inode_size(opts->InodeSize) || !valid_block_size(opts->BlockSize) ||
+        (opts->InodeRatio && opts->InodeRatio < (opts->InodeSize ? opts->InodeSize : sizeof(Inode)))) {
+        return false;
+    }
+
+    // The image keeps its length; it is just cut into different blocks.
+    // If the layout does not fit, the disk goes back to the old size.
+    size_t previous = disk->BlockSize, blocks = disk_size(disk);
+    disk_set_block_size(disk, opts->BlockSize ? opts->BlockSize : BLOCK_SIZE);
+
     // Create new superblock
     Block block;
     memset(&block, 0, sizeof(Block));
 
     block.Super.MagicNumber = MAGIC_NUMBER;
     block.Super.Blocks = (uint32_t)disk_size(disk);
-    // Set 10% of blocks for inodes
-    block.Super.InodeBlocks = (uint32_t)ceil(block.Super.Blocks / 10.0);
-    block.Super.Inodes = block.Super.InodeBlocks * INODES_PER_BLOCK;
+    block.Super.BlockSize = opts->BlockSize == BLOCK_SIZE ? 0 : opts->BlockSize;
+    block.Super.InodeRatio = opts->InodeRatio;
+    block.Super.InodeSize = opts->InodeSize;
+    block.Super.Features = opts->Features;
+    // Set 10% of blocks for inodes, or one per InodeRatio bytes
+    block.Super.InodeBlocks = inode_blocks_for(&block.Super, block.Super.Blocks);
+    block.Super.Inodes = block.Super.InodeBlocks * inodes_per_block(&block.Super);
+
+    // Checksumming data implies checksumming metadata
+    if (block.Super.Features & FEATURE_CHECKSUM_DATA) {
+        block.Super.Features |= FEATURE_CHECKSUM;
+    }
+    if (block.Super.Features & FEATURE_CHECKSUM) {
+        block.Super.Checksums = block.Super.InodeBlocks + 1;
+    }
+
+    if (block.Super.InodeBlocks >= block.Super.Blocks ||
+        (block.Super.Checksums &&
+         block.Super.Checksums + disk_checksum_blocks(disk, block.Super.Blocks) >= block.Super.Blocks)) {
+        disk_set_block_size(disk, previous);
+        disk_resize(disk, blocks);
+        return false;
+    }
 
     // Writes to Superblock 
     disk_write(disk, 0, block.Data);
 
-    Block inodeBlock;
-    for(int j = 0; j < INODES_PER_BLOCK; j++){
-        inodeBlock.Inodes[j].Valid = false;
-        inodeBlock.Inodes[j].Size = 0;
-
-        // Clears Direct Pointers
-        for(int k = 0; k < POINTERS_PER_INODE; k++)   
-            inodeBlock.Inodes[j].Direct[k] = 0;
-
-        // Clears Indirect Pointer
-        inodeBlock.Inodes[j].Indirect = 0;
-    }
-
-    // Clears inode Table
-    for (int i = 1; i <= block.Super.InodeBlocks; i++) {
-        disk_write(disk, i, inodeBlock.Data);
-    }
+    // Clears inode table and frees all other blocks in one discard; a zeroed
+    // block is a table of free inodes of any record size
+    disk_discard(disk, 1, block.Super.Blocks - 1);
 
-    // Free all other blocks on disk
-    Block dataBlock;
-    memset(dataBlock.Data, 0, BLOCK_SIZE);
-    for(uint32_t i = (block.Super.InodeBlocks) + 1; i < block.Super.Blocks; i++){
-        disk_write(disk, i, dataBlock.Data);
+    // Every block now sums to the checksum of zeros
+    if (block.Super.Checksums) {
+        disk_enable_checksums(disk, block.Super.Checksums, true);
     }
 
     return true;
@@ -148,69 +441,126 @@ bool fs_format(Disk *disk) {
 FileSystem *new_fs() {
     FileSystem *fs = malloc(sizeof(FileSystem));
     fs->bitmap = NULL;
+    fs->refcount = NULL;
+    fs->groupFree = NULL;
+    fs->groups = 0;
     fs->inodeTracker = NULL;
     fs->disk = NULL;
+    fs->inodeTable = 0;
+    fs->readonly = false;
+    fs->dcache = NULL;
+    fs->dedup = NULL;
+    memset(fs->readahead, 0, sizeof(fs->readahead));
+    fs->blockSize = BLOCK_SIZE;
+    fs->blockShift = __builtin_ctz(BLOCK_SIZE);
+    fs->pointersPerBlock = BLOCK_SIZE / sizeof(uint32_t);
+    fs->cluster.Inumber = 0;
+    fs->cluster.Data = NULL;
+    fs->cluster.Packed = NULL;
+    fs->dirty = NULL;
+    fs->dirtyBytes = 0;
+    fs->dirtyLimit = 0;
+    fs->reserved = 0;
+    fs->allocGoal = 0;
+    fs->defragNext = 0;
+    fs->defragBlock = 0;
     return fs;
 }
 
 // FileSystem destructor 
 void free_fs(FileSystem *fs) {
+    // Buffered writes reach the disk before it goes away
+    if (fs->dirty != NULL) {
+        fs_sync(fs);
+        for (int i = 0; i < DELALLOC_FILES; i++) {
+            if (fs->dirty[i].Inumber) {
+                drop_dirty(fs, &fs->dirty[i]);
+            }
+        }
+        free(fs->dirty);
+    }
     if (fs->inodeTracker != NULL) {
         free(fs->inodeTracker);
     }
     if (fs->bitmap != NULL) {
         free(fs->bitmap);
     }
+    if (fs->dcache != NULL) {
+        free(fs->dcache);
+    }
+    if (fs->dedup != NULL) {
+        free_dedup(fs->dedup);
+    }
+    free(fs->refcount);
+    free(fs->groupFree);
+    free(fs->cluster.Data);
+    free(fs->cluster.Packed);
     free(fs);
 }
 
 // Mount file system -----------------------------------------------------------
 
-bool fs_mount(FileSystem *fs, Disk *disk) {
-    // Already mounted, so it fails
-    if (disk_mounted(disk)) { 
-        return false;
+// On metadata-only checksumming images, follow blocks as they start or
+// stop holding pointers or inodes
+static void cover_metadata(FileSystem *fs, uint32_t start, uint32_t count, bool covered) {
+    if ((fs->metadata.Features & (FEATURE_CHECKSUM | FEATURE_CHECKSUM_DATA)) == FEATURE_CHECKSUM) {
+        disk_checksum_range(fs->disk, start, count, covered);
     }
-    
-    // Read Superblock
-    Block block;
-    disk_read(disk, 0, block.Data);
-    uint32_t nInodeBlocks = block.Super.InodeBlocks;
+}
 
-    if (block.Super.MagicNumber != MAGIC_NUMBER || nInodeBlocks != ceil((block.Super.Blocks) / 10.0) || block.Super.Inodes != nInodeBlocks * INODES_PER_BLOCK) {
-        return false;
-    }
+// Count one more pointer to a data block, fingerprinting it the first time
+// it is seen on a deduplicating image
+static void reference_block(FileSystem *fs, uint32_t blocknum, bool indexable) {
+    fs->refcount[blocknum]++;
 
-    // Set device and mount
-    fs->disk = disk;
+    if (fs->dedup && indexable && !dedup_contains(fs->dedup, blocknum)) {
+        // A block that fails verification is never shared
+        Block block;
+        if (disk_read_kind(fs->disk, blocknum, block.Data, BLOCK_STREAM)) {
+            dedup_insert(fs->dedup, blocknum, block_fingerprint(block.Data, fs->blockSize));
+        }
+    }
+}
 
-    // Increment mounts
-    disk_mount(disk);
+// Account for every block referenced by the count-block inode table at
+// table (0: the live table and its extents). Only the mounted table fills
+// inodeTracker; a snapshot table just holds references. An indirect block
+// shared with a snapshot carries one reference for all of its pointers, so
+// they are counted once.
+static bool scan_inode_table(FileSystem *fs, uint32_t table, uint32_t count, bool mounted) {
+    SuperBlock *sb = &fs->metadata;
 
-    fs->metadata = block.Super;
+    for (int i = 1; i <= count; i++) {
+        Block inodeBlock;
+        uint32_t blocknum = table ? table + i - 1 : extent_block(sb, i);
+        disk_read(fs->disk, blocknum, inodeBlock.Data);
 
-    // Allocate inode tracker
-    fs->bitmap = calloc(fs->metadata.Blocks, sizeof(fs->metadata.Blocks));
-    fs->inodeTracker = calloc(fs->metadata.InodeBlocks, sizeof(fs->metadata.InodeBlocks));
+        // Inode tables are reserved whole, even where empty
+        fs->bitmap[blocknum] = true;
+        fs->refcount[blocknum] = 1;
 
-    fs->bitmap[0] = true;
+        // Set bit map for inode blocks
+        for (int j = 0; j < inodes_per_block(sb); j++) {
+            Inode *inode = inode_record(sb, &inodeBlock, j);
+            if (inode->Valid) {
+                if (mounted) {
+                    fs->inodeTracker[i-1]++;
+                }
 
-    // Reading inode blocks
-    for (int i = 1; i <= fs->metadata.InodeBlocks; i++) {
-        Block inodeBlock;
-        disk_read(disk, i, inodeBlock.Data);
+                // Inline data owns no blocks
+                if (inode->Valid & INODE_INLINE) {
+                    continue;
+                }
 
-        // Set bit map for inode blocks
-        for (int j = 0; j < INODES_PER_BLOCK; j++) {
-            if (inodeBlock.Inodes[j].Valid) {
-                fs->bitmap[i] = true;
-                fs->inodeTracker[i-1]++;
+                // Packed clusters are not whole blocks of file data
+                bool indexable = !(inode->Valid & INODE_COMPRESSED);
 
                 // Set bitmap for direct pointers
                 for (int k = 0; k < POINTERS_PER_INODE; k++) {
-                    uint32_t inodeDirVal = inodeBlock.Inodes[j].Direct[k];
+                    uint32_t inodeDirVal = pointer_block(inode, inode->Direct[k]);
                     if (inodeDirVal && inodeDirVal < fs->metadata.Blocks) {
                         fs->bitmap[inodeDirVal] = true;
+                        reference_block(fs, inodeDirVal, indexable);
                     }
                     else if (inodeDirVal) {
                         return false;
@@ -218,22 +568,30 @@ bool fs_mount(FileSystem *fs, Disk *disk) {
                 }
 
                 // Set bitmap for indirect pointers
-                uint32_t inodeIndirVal = inodeBlock.Inodes[j].Indirect;
+                uint32_t inodeIndirVal = inode->Indirect;
                 if (inodeIndirVal && inodeIndirVal < fs->metadata.Blocks) {
 
                     fs->bitmap[inodeIndirVal] = true;
+                    if (fs->refcount[inodeIndirVal]++) {
+                        continue;
+                    }
+                    cover_metadata(fs, inodeIndirVal, 1, true);
                     Block inDirBlock;
                     disk_read(fs->disk, inodeIndirVal, inDirBlock.Data);
-                    for (int k = 0; k < POINTERS_PER_BLOCK; k++) {
-                        if (inDirBlock.Pointers[k] < fs->metadata.Blocks) {
-                            fs->bitmap[inDirBlock.Pointers[k]] = true;
+                    for (int k = 0; k < fs->pointersPerBlock; k++) {
+                        uint32_t pointer = pointer_block(inode, inDirBlock.Pointers[k]);
+                        if (pointer < fs->metadata.Blocks) {
+                            fs->bitmap[pointer] = true;
+                            if (pointer) {
+                                reference_block(fs, pointer, indexable);
+                            }
                         }
                         else {
                             return false;
                         }
                     }
                 }
-                else if (inodeBlock.Inodes[j].Indirect) {
+                else if (inode->Indirect) {
                     return false;
                 }
             }
@@ -243,46 +601,200 @@ bool fs_mount(FileSystem *fs, Disk *disk) {
     return true;
 }
 
+// Mount the live inode table, or a snapshot's (id >= 0) read-only
+static bool mount(FileSystem *fs, Disk *disk, ssize_t id) {
+    // Already mounted, so it fails
+    if (disk_mounted(disk)) { 
+        return false;
+    }
+    
+    // Read Superblock
+    Block block;
+    disk_read(disk, 0, block.Data);
+    uint32_t nInodeBlocks = block.Super.InodeBlocks;
+
+    if (block.Super.MagicNumber != MAGIC_NUMBER || !valid_inode_size(block.Super.InodeSize) ||
+        !valid_block_size(block.Super.BlockSize)) {
+        return false;
+    }
+
+    // The superblock fits in any block size; the rest is read at the real one
+    disk_set_block_size(disk, block_size(&block.Super));
+
+    if (!nInodeBlocks || block.Super.Inodes != nInodeBlocks * inodes_per_block(&block.Super) ||
+        block.Super.Blocks > disk_size(disk)) {
+        return false;
+    }
+
+    // Extents past the first must fit on the disk and leave it at least a block
+    uint32_t extentBlocks = 0;
+    for (int i = 0; i < MAX_EXTENTS; i++) {
+        extentBlocks += block.Super.Extents[i].Count;
+    }
+    if (extentBlocks >= nInodeBlocks) {
+        return false;
+    }
+    for (int i = 0; i < MAX_EXTENTS; i++) {
+        Extent *extent = &block.Super.Extents[i];
+        if (extent->Count && (extent->Start < data_start(&block.Super) ||
+                              extent->Start + extent->Count > block.Super.Blocks)) {
+            return false;
+        }
+    }
+
+    if (block.Super.Root > block.Super.Inodes) {
+        return false;
+    }
+
+    if (!(block.Super.Features & FEATURE_CHECKSUM) != !block.Super.Checksums ||
+        (block.Super.Checksums && (block.Super.Checksums < data_start(&block.Super) ||
+                                   block.Super.Checksums + disk_checksum_blocks(disk, block.Super.Blocks) > block.Super.Blocks))) {
+        return false;
+    }
+
+    for (int i = 0; i < MAX_SNAPSHOTS; i++) {
+        Snapshot *snap = &block.Super.Snapshots[i];
+        if (snap->Table && (snap->Table < data_start(&block.Super) ||
+                            !snap->InodeBlocks || snap->InodeBlocks > nInodeBlocks ||
+                            snap->Table + snap->InodeBlocks > block.Super.Blocks ||
+                            snap->Root > snap->InodeBlocks * inodes_per_block(&block.Super))) {
+            return false;
+        }
+    }
+
+    if (id >= MAX_SNAPSHOTS || (id >= 0 && !block.Super.Snapshots[id].Table)) {
+        return false;
+    }
+
+    // Set device and mount
+    fs->disk = disk;
+
+    // Increment mounts
+    disk_mount(disk);
+
+    fs->metadata = block.Super;
+    SuperBlock *sb = &fs->metadata;
+
+    // Block geometry used by the read and write paths
+    fs->blockSize = block_size(sb);
+    fs->blockShift = __builtin_ctz(fs->blockSize);
+    fs->pointersPerBlock = fs->blockSize / sizeof(uint32_t);
+    fs->cluster.Data = malloc(cluster_size(fs));
+    fs->cluster.Packed = malloc(cluster_size(fs));
+
+    // Allocate inode tracker
+    fs->bitmap = calloc(fs->metadata.Blocks, sizeof(fs->metadata.Blocks));
+    fs->inodeTracker = calloc(fs->metadata.InodeBlocks, sizeof(fs->metadata.InodeBlocks));
+    fs->refcount = calloc(fs->metadata.Blocks, sizeof(uint32_t));
+    if ((sb->Features & FEATURE_DEDUP) && id < 0) {
+        fs->dedup = new_dedup(sb->Blocks);
+    }
+
+    fs->bitmap[0] = true;
+
+    // The checksum table must be loaded before any checksummed block is read
+    if (sb->Checksums) {
+        uint32_t tableBlocks = disk_checksum_blocks(disk, sb->Blocks);
+        disk_enable_checksums(disk, sb->Checksums, false);
+        disk_checksum_range(disk, 1, table_base(sb), true);
+        if (sb->Features & FEATURE_CHECKSUM_DATA) {
+            disk_checksum_range(disk, data_start(sb), sb->Blocks - data_start(sb), true);
+            disk_checksum_range(disk, sb->Checksums, tableBlocks, false);
+        }
+        for (uint32_t i = sb->Checksums; i < sb->Checksums + tableBlocks; i++) {
+            fs->bitmap[i] = true;
+        }
+        for (int i = 0; i < MAX_EXTENTS; i++) {
+            disk_checksum_range(disk, sb->Extents[i].Start, sb->Extents[i].Count, true);
+        }
+        for (int i = 0; i < MAX_SNAPSHOTS; i++) {
+            if (sb->Snapshots[i].Table) {
+                disk_checksum_range(disk, sb->Snapshots[i].Table, sb->Snapshots[i].InodeBlocks, true);
+            }
+        }
+    }
+
+    // A snapshot is seen as it was: its own table and root, no writes
+    if (id >= 0) {
+        fs->inodeTable = sb->Snapshots[id].Table;
+        fs->readonly = true;
+        sb->Root = sb->Snapshots[id].Root;
+        sb->InodeBlocks = sb->Snapshots[id].InodeBlocks;
+        sb->Inodes = sb->InodeBlocks * inodes_per_block(sb);
+        return scan_inode_table(fs, fs->inodeTable, sb->InodeBlocks, true);
+    }
+
+    if (!scan_inode_table(fs, 0, sb->InodeBlocks, true)) {
+        return false;
+    }
+    for (int i = 0; i < MAX_SNAPSHOTS; i++) {
+        Snapshot *snap = &sb->Snapshots[i];
+        if (snap->Table && !scan_inode_table(fs, snap->Table, snap->InodeBlocks, false)) {
+            return false;
+        }
+    }
+
+    count_groups(fs);
+    return true;
+}
+
+bool fs_mount(FileSystem *fs, Disk *disk) {
+    return mount(fs, disk, -1);
+}
+
+bool fs_mount_snapshot(FileSystem *fs, Disk *disk, size_t id) {
+    return mount(fs, disk, id);
+}
+
+// Write the in-memory superblock back to block 0
+void store_super(FileSystem *fs) {
+    if (fs->readonly) {
+        return;
+    }
+
+    Block block;
+    memset(block.Data, 0, fs->blockSize);
+    block.Super = fs->metadata;
+    disk_write(fs->disk, 0, block.Data);
+}
+
 // Create inode ----------------------------------------------------------------
 
 ssize_t fs_create(FileSystem *fs) {
 
-    if (!disk_mounted(fs->disk)) {
+    if (!disk_mounted(fs->disk) || fs->readonly) {
         return -1;
     }
 
     Block block;
+    SuperBlock *sb = &fs->metadata;
 
     // Locate free inode in inode table
     for (int i = 1; i <= fs->metadata.InodeBlocks; i++) {
         // Read from disk
-        if (fs->inodeTracker[i-1] != INODES_PER_BLOCK) {
-            disk_read(fs->disk, i, block.Data);
+        if (fs->inodeTracker[i-1] != inodes_per_block(sb)) {
+            disk_read(fs->disk, table_block(fs, i), block.Data);
         }
         else {
             continue;
         }
 
         // Find first empty inode
-        for (int j = 0; j < INODES_PER_BLOCK; j++) {
+        for (int j = 0; j < inodes_per_block(sb); j++) {
+            Inode *inode = inode_record(sb, &block, j);
 
             // Record inode if found
-            if (!block.Inodes[j].Valid) {
+            if (!inode->Valid) {
 
-                fs->bitmap[i] = true;
                 fs->inodeTracker[i-1]++;
 
-                block.Inodes[j].Valid = true;
-                block.Inodes[j].Size = 0;
-                block.Inodes[j].Indirect = 0;
-
-                for (int k = 0; k < POINTERS_PER_INODE; k++) {
-                    block.Inodes[j].Direct[k] = 0;
-                }
+                // Clears pointers and any inline data
+                memset(inode, 0, inode_size(sb));
+                inode->Valid = INODE_VALID;
                 
-                disk_write(fs->disk, i, block.Data);
+                disk_write(fs->disk, table_block(fs, i), block.Data);
 
-                return (i-1) * INODES_PER_BLOCK + j;
+                return (i-1) * inodes_per_block(sb) + j;
             }
         }
     }
@@ -290,16 +802,24 @@ ssize_t fs_create(FileSystem *fs) {
     return -1;
 }
 
-bool find_inode(FileSystem *fs, size_t inumber, Inode *inode) {
-    
-    if (inumber < 0 || inumber > fs->metadata.Inodes || !fs->inodeTracker[inumber / INODES_PER_BLOCK]) {
-        return false;
+// Read the inode block holding inumber and return its record, NULL if invalid
+Inode *load_inode(FileSystem *fs, size_t inumber, Block *block) {
+
+    if (inumber >= fs->metadata.Inodes || !fs->inodeTracker[inode_block(&fs->metadata, inumber) - 1]) {
+        return NULL;
     }
 
+    disk_read(fs->disk, table_block(fs, inode_block(&fs->metadata, inumber)), block->Data);
+    Inode *record = inode_record(&fs->metadata, block, inumber % inodes_per_block(&fs->metadata));
+    return record->Valid ? record : NULL;
+}
+
+bool find_inode(FileSystem *fs, size_t inumber, Inode *inode) {
+    
     Block block;
-    disk_read(fs->disk, inumber / INODES_PER_BLOCK + 1, block.Data);
-    if (block.Inodes[inumber % INODES_PER_BLOCK].Valid) {
-        *inode = block.Inodes[inumber % INODES_PER_BLOCK];
+    Inode *record = load_inode(fs, inumber, &block);
+    if (record) {
+        *inode = *record;
         return true;
     }
 
@@ -308,444 +828,2172 @@ bool find_inode(FileSystem *fs, size_t inumber, Inode *inode) {
 
 bool store_inode(FileSystem *fs, size_t inumber, Inode *inode) {
 
-    if (inumber < 0 || inumber > fs->metadata.Inodes) {
+    if (inumber >= fs->metadata.Inodes) {
         return false;
     }
 
     // store the node into the block
     Block block;
-    disk_read(fs->disk, (int)(inumber / INODES_PER_BLOCK) + 1, block.Data);
-    block.Inodes[inumber % INODES_PER_BLOCK] = *inode; 
-    disk_write(fs->disk, (int)(inumber / INODES_PER_BLOCK) + 1, block.Data);
+    uint32_t blocknum = table_block(fs, inode_block(&fs->metadata, inumber));
+    disk_read(fs->disk, blocknum, block.Data);
+    *inode_record(&fs->metadata, &block, inumber % inodes_per_block(&fs->metadata)) = *inode; 
+    disk_write(fs->disk, blocknum, block.Data);
     return true;
 }
 
 // Remove inode ----------------------------------------------------------------
 
-bool fs_remove(FileSystem *fs, size_t inumber) {
-    
-    // Load inode information
-    Inode inode;
+static int compare_blocks(const void *a, const void *b) {
+    uint32_t x = *(const uint32_t *)a, y = *(const uint32_t *)b;
+    return (x > y) - (x < y);
+}
 
-    if (!disk_mounted(fs->disk) || !find_inode(fs, inumber, &inode)) {
+// Drop one pointer to a block; returns whether that freed it
+static bool release_block(FileSystem *fs, uint32_t blocknum) {
+    if (fs->refcount[blocknum] > 1) {
+        fs->refcount[blocknum]--;
+        return false;
+    }
+
+    fs->refcount[blocknum] = 0;
+    set_used(fs, blocknum, false);
+    if (fs->dedup) {
+        dedup_remove(fs->dedup, blocknum);
+    }
+    return true;
+}
+
+// Discard freed blocks, one disk_discard per contiguous run
+static void discard_blocks(FileSystem *fs, uint32_t *blocks, size_t count) {
+    qsort(blocks, count, sizeof(uint32_t), compare_blocks);
+
+    size_t start = 0;
+    for (size_t i = 1; i <= count; i++) {
+        if (i == count || blocks[i] != blocks[i-1] + 1) {
+            disk_discard(fs->disk, blocks[start], i - start);
+            start = i;
+        }
+    }
+}
+
+// Drop the inode's references to its blocks from file block first on and
+// clear those pointers. Blocks that became free are stored in freed;
+// returns how many. When first lies past the direct pointers the indirect
+// block is kept and rewritten, so the caller must have unshared it.
+static size_t release_inode(FileSystem *fs, Inode *inode, uint32_t first, uint32_t *freed) {
+    size_t nfreed = 0;
+
+    // Inline data overlays the pointers
+    if (inode->Valid & INODE_INLINE) {
+        return 0;
+    }
+
+    // Free direct blocks
+    for (uint32_t i = first; i < POINTERS_PER_INODE; i++) {
+        uint32_t pointer = pointer_block(inode, inode->Direct[i]);
+        if (pointer && release_block(fs, pointer)) {
+            freed[nfreed++] = pointer;
+        }
+        inode->Direct[i] = 0;
+    }
+
+    if (inode->Indirect && first > POINTERS_PER_INODE) {
+        Block inDirBlock;
+        disk_read(fs->disk, inode->Indirect, inDirBlock.Data);
+        for (uint32_t i = first - POINTERS_PER_INODE; i < fs->pointersPerBlock; i++) {
+            uint32_t pointer = pointer_block(inode, inDirBlock.Pointers[i]);
+            if (pointer && release_block(fs, pointer)) {
+                freed[nfreed++] = pointer;
+            }
+            inDirBlock.Pointers[i] = 0;
+        }
+        disk_write(fs->disk, inode->Indirect, inDirBlock.Data);
+        return nfreed;
+    }
+
+    // Free indirect blocks; one still shared with a snapshot keeps its
+    // pointers' references
+    if (inode->Indirect && release_block(fs, inode->Indirect)) {
+        freed[nfreed++] = inode->Indirect;
+        cover_metadata(fs, inode->Indirect, 1, false);
+        Block inDirBlock;
+        disk_read(fs->disk, inode->Indirect, inDirBlock.Data);
+
+        for (int i = 0; i < fs->pointersPerBlock; i++) {
+            uint32_t inDirBlockPtr = pointer_block(inode, inDirBlock.Pointers[i]);
+            if (inDirBlockPtr && release_block(fs, inDirBlockPtr)) {
+                freed[nfreed++] = inDirBlockPtr;
+            }
+        }
+    }
+    inode->Indirect = 0;
+    return nfreed;
+}
+
+// Free any inode, directories included. Names for it, and a directory's
+// entries, are the caller's to take care of first.
+bool remove_inode(FileSystem *fs, size_t inumber) {
+    
+    // Load inode information
+    Inode inode;
+
+    if (!disk_mounted(fs->disk) || fs->readonly || !find_inode(fs, inumber, &inode)) {
+        return false;
+    }
+
+    inode.Size = 0;
+
+    // Buffered data removed before a flush never gets blocks at all
+    DirtyFile *dirty = dirty_file(fs, inumber);
+    if (dirty) {
+        drop_dirty(fs, dirty);
+    }
+
+    if (fs->cluster.Inumber == inumber + 1) {
+        fs->cluster.Inumber = 0;
+    }
+
+    // One less inode in use in its table block
+    uint32_t inodeBlock = inode_block(&fs->metadata, inumber);
+    fs->inodeTracker[inodeBlock - 1]--;
+
+    // Freed blocks are collected so they can be discarded in runs
+    uint32_t freed[POINTERS_PER_INODE + 1 + MAX_POINTERS_PER_BLOCK];
+    discard_blocks(fs, freed, release_inode(fs, &inode, 0, freed));
+    inode.Valid = false;
+
+    dcache_forget(fs, inumber);
+
+    // Clears the whole record so no inline data is left behind
+    Block block;
+    disk_read(fs->disk, table_block(fs, inodeBlock), block.Data);
+    Inode *record = inode_record(&fs->metadata, &block, inumber % inodes_per_block(&fs->metadata));
+    memset(record, 0, inode_size(&fs->metadata));
+    *record = inode;
+    disk_write(fs->disk, table_block(fs, inodeBlock), block.Data);
+
+    return true;
+}
+
+// Only files go by inumber: a directory, the root above all, goes through
+// fs_unlink, which checks it is empty and drops its name first
+bool fs_remove(FileSystem *fs, size_t inumber) {
+    Inode inode;
+
+    if (!disk_mounted(fs->disk) || !find_inode(fs, inumber, &inode) ||
+        (inode.Valid & INODE_DIR) || inumber + 1 == fs->metadata.Root) {
+        return false;
+    }
+    return remove_inode(fs, inumber);
+}
+
+// Batch metadata --------------------------------------------------------------
+
+// The batch calls visit inodes in table order, so a table block is read and
+// written once however many of its inodes a batch names.
+
+typedef struct
+{
+    size_t Inumber;
+    size_t Index;       // Position in the caller's array
+} BatchEntry;
+
+static int compare_entries(const void *a, const void *b) {
+    size_t x = ((const BatchEntry *)a)->Inumber, y = ((const BatchEntry *)b)->Inumber;
+    return (x > y) - (x < y);
+}
+
+static BatchEntry *sort_batch(const size_t *inumbers, size_t count) {
+    BatchEntry *entries = malloc(count * sizeof(BatchEntry) + 1);
+    for (size_t i = 0; i < count; i++) {
+        entries[i] = (BatchEntry){inumbers[i], i};
+    }
+    qsort(entries, count, sizeof(BatchEntry), compare_entries);
+    return entries;
+}
+
+ssize_t fs_create_many(FileSystem *fs, size_t *inumbers, size_t count) {
+    SuperBlock *sb = &fs->metadata;
+    size_t created = 0;
+
+    if (!disk_mounted(fs->disk) || fs->readonly) {
+        return -1;
+    }
+
+    for (uint32_t i = 1; i <= sb->InodeBlocks && created < count; i++) {
+        if (fs->inodeTracker[i-1] == inodes_per_block(sb)) {
+            continue;
+        }
+
+        Block block;
+        disk_read(fs->disk, table_block(fs, i), block.Data);
+        for (uint32_t j = 0; j < inodes_per_block(sb) && created < count; j++) {
+            Inode *inode = inode_record(sb, &block, j);
+            if (inode->Valid) {
+                continue;
+            }
+            memset(inode, 0, inode_size(sb));
+            inode->Valid = INODE_VALID;
+            fs->inodeTracker[i-1]++;
+            inumbers[created++] = (i-1) * inodes_per_block(sb) + j;
+        }
+        disk_write(fs->disk, table_block(fs, i), block.Data);
+    }
+
+    return created;
+}
+
+ssize_t fs_remove_many(FileSystem *fs, const size_t *inumbers, size_t count) {
+    SuperBlock *sb = &fs->metadata;
+
+    if (!disk_mounted(fs->disk) || fs->readonly) {
+        return -1;
+    }
+
+    BatchEntry *entries = sort_batch(inumbers, count);
+    size_t *removed = malloc(count * sizeof(size_t) + 1);
+    size_t nremoved = 0;
+
+    // Blocks freed by the whole batch are discarded together, so runs that
+    // span several files go out as one discard
+    size_t perInode = POINTERS_PER_INODE + 1 + fs->pointersPerBlock;
+    uint32_t *freed = NULL;
+    size_t nfreed = 0, capacity = 0;
+
+    for (size_t k = 0; k < count && entries[k].Inumber < sb->Inodes; ) {
+        uint32_t inodeBlock = inode_block(sb, entries[k].Inumber);
+        size_t end = k;
+        while (end < count && entries[end].Inumber < sb->Inodes &&
+               inode_block(sb, entries[end].Inumber) == inodeBlock) {
+            end++;
+        }
+        if (!fs->inodeTracker[inodeBlock - 1]) {
+            k = end;
+            continue;
+        }
+
+        Block block;
+        size_t before = nremoved;
+        disk_read(fs->disk, table_block(fs, inodeBlock), block.Data);
+        for (; k < end; k++) {
+            size_t inumber = entries[k].Inumber;
+            Inode *record = inode_record(sb, &block, inumber % inodes_per_block(sb));
+
+            // Also skips an inode named twice; directories are left to
+            // fs_unlink, as with fs_remove
+            if (!record->Valid || (record->Valid & INODE_DIR) || inumber + 1 == sb->Root) {
+                continue;
+            }
+
+            DirtyFile *dirty = dirty_file(fs, inumber);
+            if (dirty) {
+                drop_dirty(fs, dirty);
+            }
+            if (fs->cluster.Inumber == inumber + 1) {
+                fs->cluster.Inumber = 0;
+            }
+
+            if (capacity < nfreed + perInode) {
+                capacity = max(2 * capacity, nfreed + perInode);
+                freed = realloc(freed, capacity * sizeof(uint32_t));
+            }
+            nfreed += release_inode(fs, record, 0, freed + nfreed);
+
+            // Clears the whole record so no inline data is left behind
+            memset(record, 0, inode_size(sb));
+            fs->inodeTracker[inodeBlock - 1]--;
+            removed[nremoved++] = inumber;
+        }
+        if (nremoved > before) {
+            disk_write(fs->disk, table_block(fs, inodeBlock), block.Data);
+        }
+    }
+
+    discard_blocks(fs, freed, nfreed);
+    dcache_forget_many(fs, removed, nremoved);
+
+    free(freed);
+    free(removed);
+    free(entries);
+    return nremoved;
+}
+
+ssize_t fs_stat_many(FileSystem *fs, const size_t *inumbers, size_t count, ssize_t *sizes) {
+    SuperBlock *sb = &fs->metadata;
+
+    if (!disk_mounted(fs->disk)) {
+        return -1;
+    }
+
+    BatchEntry *entries = sort_batch(inumbers, count);
+    size_t found = 0;
+    uint32_t loaded = 0;
+    Block block;
+
+    for (size_t i = 0; i < count; i++) {
+        sizes[i] = -1;
+    }
+
+    for (size_t k = 0; k < count && entries[k].Inumber < sb->Inodes; k++) {
+        size_t inumber = entries[k].Inumber;
+        uint32_t inodeBlock = inode_block(sb, inumber);
+        if (!fs->inodeTracker[inodeBlock - 1]) {
+            continue;
+        }
+        if (inodeBlock != loaded) {
+            disk_read(fs->disk, table_block(fs, inodeBlock), block.Data);
+            loaded = inodeBlock;
+        }
+
+        Inode *record = inode_record(sb, &block, inumber % inodes_per_block(sb));
+        if (record->Valid) {
+            DirtyFile *dirty = dirty_file(fs, inumber);
+            sizes[entries[k].Index] = dirty ? dirty->Size : record->Size;
+            found++;
+        }
+    }
+
+    free(entries);
+    return found;
+}
+
+// Snapshots -------------------------------------------------------------------
+
+// First block of the first free run of count blocks at or after start,
+// wrapping round to the start of the disk; 0 if there is none
+static uint32_t find_run(FileSystem *fs, uint32_t count, uint32_t start) {
+    uint32_t first = data_start(&fs->metadata);
+    if (start < first || start >= fs->metadata.Blocks) {
+        start = first;
+    }
+
+    for (int pass = 0; pass < 2; pass++) {
+        uint32_t from = pass ? first : start;
+        uint32_t to = pass ? min(start + count - 1, fs->metadata.Blocks) : fs->metadata.Blocks;
+        uint32_t run = 0;
+        for (uint32_t i = from; i < to; i++) {
+            // A full group breaks any run and need not be looked at
+            if (!fs->groupFree[i / GROUP_BLOCKS]) {
+                run = 0;
+                i = (i / GROUP_BLOCKS + 1) * GROUP_BLOCKS - 1;
+                continue;
+            }
+            run = fs->bitmap[i] ? 0 : run + 1;
+            if (run == count) {
+                return i + 1 - count;
+            }
+        }
+    }
+    return 0;
+}
+
+// A snapshot is a copy of the inode table. Each block the table points at
+// gains a reference, so later writes copy instead of overwriting it.
+
+ssize_t fs_snapshot(FileSystem *fs) {
+    SuperBlock *sb = &fs->metadata;
+
+    if (!disk_mounted(fs->disk) || fs->readonly) {
+        return -1;
+    }
+
+    int id = 0;
+    while (id < MAX_SNAPSHOTS && sb->Snapshots[id].Table) {
+        id++;
+    }
+    if (id == MAX_SNAPSHOTS) {
+        return -1;
+    }
+
+    // The frozen table must include writes still buffered
+    if (!fs_sync(fs)) {
+        return -1;
+    }
+
+    // The frozen table lives in the first free run long enough to hold it
+    uint32_t table = find_run(fs, sb->InodeBlocks, 0);
+    if (!table) {
+        return -1;
+    }
+    cover_metadata(fs, table, sb->InodeBlocks, true);
+
+    for (uint32_t i = 1; i <= sb->InodeBlocks; i++) {
+        Block block;
+        set_used(fs, table + i - 1, true);
+        fs->refcount[table + i - 1] = 1;
+
+        if (!fs->inodeTracker[i-1]) {
+            memset(block.Data, 0, fs->blockSize);
+            disk_write(fs->disk, table + i - 1, block.Data);
+            continue;
+        }
+
+        disk_read(fs->disk, table_block(fs, i), block.Data);
+        for (uint32_t j = 0; j < inodes_per_block(sb); j++) {
+            Inode *inode = inode_record(sb, &block, j);
+            if (!inode->Valid || (inode->Valid & INODE_INLINE)) {
+                continue;
+            }
+            for (int k = 0; k < POINTERS_PER_INODE; k++) {
+                if (inode->Direct[k]) {
+                    fs->refcount[pointer_block(inode, inode->Direct[k])]++;
+                }
+            }
+            if (inode->Indirect) {
+                fs->refcount[inode->Indirect]++;
+            }
+        }
+        disk_write(fs->disk, table + i - 1, block.Data);
+    }
+
+    sb->Snapshots[id].Table = table;
+    sb->Snapshots[id].Root = sb->Root;
+    sb->Snapshots[id].InodeBlocks = sb->InodeBlocks;
+    store_super(fs);
+    return id;
+}
+
+bool fs_snapshot_delete(FileSystem *fs, size_t id) {
+    SuperBlock *sb = &fs->metadata;
+
+    if (!disk_mounted(fs->disk) || fs->readonly || id >= MAX_SNAPSHOTS || !sb->Snapshots[id].Table) {
+        return false;
+    }
+
+    uint32_t table = sb->Snapshots[id].Table;
+    uint32_t count = sb->Snapshots[id].InodeBlocks;
+    uint32_t freed[POINTERS_PER_INODE + 1 + MAX_POINTERS_PER_BLOCK];
+
+    for (uint32_t i = 0; i < count; i++) {
+        Block block;
+        disk_read(fs->disk, table + i, block.Data);
+        for (uint32_t j = 0; j < inodes_per_block(sb); j++) {
+            Inode *inode = inode_record(sb, &block, j);
+            if (inode->Valid) {
+                discard_blocks(fs, freed, release_inode(fs, inode, 0, freed));
+            }
+        }
+        release_block(fs, table + i);
+    }
+    cover_metadata(fs, table, count, false);
+    disk_discard(fs->disk, table, count);
+
+    sb->Snapshots[id].Table = 0;
+    sb->Snapshots[id].Root = 0;
+    sb->Snapshots[id].InodeBlocks = 0;
+    store_super(fs);
+    return true;
+}
+
+// Resize file system ---------------------------------------------------------
+
+// Grow the file system to blocks without moving anything on disk. The new
+// space also takes an inode-table extent that keeps the format-time share of
+// inodes and, if the checksum table outgrows its blocks, the table itself.
+bool fs_resize(FileSystem *fs, size_t blocks) {
+    SuperBlock *sb = &fs->metadata;
+    uint32_t old = sb->Blocks;
+
+    if (!disk_mounted(fs->disk) || fs->readonly || blocks <= old || blocks > POINTER_MASK) {
+        return false;
+    }
+
+    // Inode blocks to add, as long as an extent slot is left
+    int slot = 0;
+    while (slot < MAX_EXTENTS && sb->Extents[slot].Count) {
+        slot++;
+    }
+    uint32_t extra = 0;
+    if (slot < MAX_EXTENTS && inode_blocks_for(sb, blocks) > sb->InodeBlocks) {
+        extra = inode_blocks_for(sb, blocks) - sb->InodeBlocks;
+    }
+
+    uint32_t oldTable = sb->Checksums ? disk_checksum_blocks(fs->disk, old) : 0;
+    uint32_t newTable = sb->Checksums ? disk_checksum_blocks(fs->disk, blocks) : 0;
+    uint32_t moved = newTable > oldTable ? newTable : 0;
+    if (extra + moved >= blocks - old) {
+        return false;
+    }
+
+    disk_resize(fs->disk, blocks);
+    fs->bitmap = realloc(fs->bitmap, blocks * sizeof(bool));
+    memset(fs->bitmap + old, 0, (blocks - old) * sizeof(bool));
+    fs->refcount = realloc(fs->refcount, blocks * sizeof(uint32_t));
+    memset(fs->refcount + old, 0, (blocks - old) * sizeof(uint32_t));
+    if (fs->dedup) {
+        dedup_grow(fs->dedup, blocks);
+    }
+    sb->Blocks = blocks;
+
+    // New blocks are holes, so a new extent is already a table of free inodes
+    uint32_t next = old;
+    if (extra) {
+        fs->inodeTracker = realloc(fs->inodeTracker, (sb->InodeBlocks + extra) * sizeof(int));
+        memset(fs->inodeTracker + sb->InodeBlocks, 0, extra * sizeof(int));
+        for (uint32_t i = next; i < next + extra; i++) {
+            fs->bitmap[i] = true;
+            fs->refcount[i] = 1;
+        }
+        cover_metadata(fs, next, extra, true);
+
+        sb->Extents[slot].Start = next;
+        sb->Extents[slot].Count = extra;
+        sb->InodeBlocks += extra;
+        sb->Inodes = sb->InodeBlocks * inodes_per_block(sb);
+        next += extra;
+    }
+
+    if (moved) {
+        for (uint32_t i = next; i < next + moved; i++) {
+            fs->bitmap[i] = true;
+            fs->refcount[i] = 1;
+        }
+        disk_move_checksums(fs->disk, next);
+
+        for (uint32_t i = sb->Checksums; i < sb->Checksums + oldTable; i++) {
+            fs->bitmap[i] = false;
+            fs->refcount[i] = 0;
+        }
+        if (sb->Features & FEATURE_CHECKSUM_DATA) {
+            disk_checksum_range(fs->disk, sb->Checksums, oldTable, true);
+        }
+        disk_discard(fs->disk, sb->Checksums, oldTable);
+        sb->Checksums = next;
+    }
+
+    if (sb->Features & FEATURE_CHECKSUM_DATA) {
+        disk_checksum_range(fs->disk, old, blocks - old, true);
+        disk_checksum_range(fs->disk, sb->Checksums, newTable, false);
+    }
+
+    count_groups(fs);
+    store_super(fs);
+    return true;
+}
+
+// Block map -------------------------------------------------------------------
+
+// Whether a buffer is all zero bytes
+static inline bool is_zero(const char *data, size_t length) {
+    return data[0] == 0 && memcmp(data, data + 1, length - 1) == 0;
+}
+
+// Physical block holding file block index, 0 for a hole. The indirect block
+// is read on first use and kept in *indirect for later lookups.
+static uint32_t block_pointer(FileSystem *fs, Inode *inode, uint32_t index, Block *indirect, bool *haveIndirect) {
+    if (index < POINTERS_PER_INODE) {
+        return inode->Direct[index];
+    }
+    if (!inode->Indirect) {
+        return 0;
+    }
+    if (!*haveIndirect) {
+        disk_read(fs->disk, inode->Indirect, indirect->Data);
+        *haveIndirect = true;
+    }
+    return indirect->Pointers[index - POINTERS_PER_INODE];
+}
+
+// Aim the allocator at file block index: just past the file's nearest
+// earlier block (looking back over one cluster), or its home group when
+// the file has none there
+static void aim(FileSystem *fs, size_t inumber, Inode *inode, uint32_t index, Block *indirect, bool *haveIndirect) {
+    for (uint32_t i = index; i-- > 0 && index - i <= CLUSTER_BLOCKS; ) {
+        uint32_t pointer = pointer_block(inode, block_pointer(fs, inode, i, indirect, haveIndirect));
+        if (pointer) {
+            fs->allocGoal = pointer + 1;
+            return;
+        }
+    }
+    fs->allocGoal = home_block(fs, inumber);
+}
+
+// Inode stat ------------------------------------------------------------------
+
+ssize_t fs_stat(FileSystem *fs, size_t inumber) {
+
+    if (!disk_mounted(fs->disk)) {
+        return -1;
+    }
+
+    // Load inode information
+    Inode inode;
+    
+    if (find_inode(fs, inumber, &inode)) {
+        DirtyFile *dirty = dirty_file(fs, inumber);
+        return dirty ? dirty->Size : inode.Size;
+    }
+
+    return -1;
+}
+
+// Number of blocks (data and indirect) actually allocated to an inode
+ssize_t fs_blocks(FileSystem *fs, size_t inumber) {
+
+    if (!disk_mounted(fs->disk)) {
+        return -1;
+    }
+
+    Inode inode;
+    if (!find_inode(fs, inumber, &inode)) {
+        return -1;
+    }
+    if (inode.Valid & INODE_INLINE) {
+        return 0;
+    }
+
+    ssize_t blocks = 0;
+    for (int i = 0; i < POINTERS_PER_INODE; i++) {
+        blocks += inode.Direct[i] != 0;
+    }
+    if (inode.Indirect) {
+        Block indirect;
+        disk_read(fs->disk, inode.Indirect, indirect.Data);
+        blocks++;
+        for (int i = 0; i < fs->pointersPerBlock; i++) {
+            blocks += indirect.Pointers[i] != 0;
+        }
+    }
+    return blocks;
+}
+
+// Read-ahead ------------------------------------------------------------------
+
+// Track the stream reading file blocks [first, last] of inode and queue
+// prefetches, cached as kind, for the blocks after it. The window doubles
+// while reads stay sequential and collapses on a seek.
+static void read_ahead(FileSystem *fs, size_t inumber, Inode *inode, uint32_t first, uint32_t last, Block *indirect, bool *haveIndirect, BlockKind kind) {
+    if (!fs->disk->Cache) {
+        return;
+    }
+
+    ReadAhead *ra = &fs->readahead[inumber % READAHEAD_STREAMS];
+    if (ra->Inumber != inumber + 1) {
+        ra->Inumber = inumber + 1;
+        ra->Next = ra->Ahead = ra->Window = 0;
+    }
+
+    if (first == ra->Next) {
+        ra->Window = ra->Window ? min(ra->Window * 2, READAHEAD_MAX) : READAHEAD_MIN;
+    }
+    else {
+        ra->Window = 0;
+        ra->Ahead = 0;
+    }
+    ra->Next = last + 1;
+    ra->Ahead = max(ra->Ahead, last + 1);
+    if (!ra->Window) {
+        return;
+    }
+
+    uint32_t end = min(last + ra->Window, (inode->Size + fs->blockSize - 1) >> fs->blockShift);
+    for (; ra->Ahead < end; ra->Ahead++) {
+        if (ra->Ahead >= POINTERS_PER_INODE && !*haveIndirect) {
+            // Fetch the indirect block first; its data blocks go out next time
+            if (inode->Indirect) {
+                disk_prefetch(fs->disk, inode->Indirect, BLOCK_METADATA);
+            }
+            break;
+        }
+        uint32_t blocknum = block_pointer(fs, inode, ra->Ahead, indirect, haveIndirect);
+        if (blocknum) {
+            disk_prefetch(fs->disk, pointer_block(inode, blocknum), kind);
+        }
+    }
+}
+
+// Read from inode -------------------------------------------------------------
+
+static ssize_t read_compressed(FileSystem *fs, size_t inumber, Inode *inode, char *data, size_t length, size_t offset, BlockKind kind);
+
+// Read what is on disk, ignoring buffered writes. Data blocks are cached as
+// kind, except that directory buckets count as metadata.
+static ssize_t read_inode(FileSystem *fs, size_t inumber, char *data, int length, size_t offset, BlockKind kind) {
+
+    Block inodeBlock;
+    Inode *record = load_inode(fs, inumber, &inodeBlock);
+
+    // Loads the inode
+    if(!record) {
+        return -1;
+    }
+    Inode inode = *record;
+
+    // Get size of inode
+    int inodeSize = inode.Size;
+    
+    // No data can be read when offset too large
+    if((int)offset >= inodeSize) {
+        return 0;
+    }
+    // Adjust length accordingly when exceed inodeSize
+    else if(length + (int)offset > inodeSize) {
+        length = inodeSize - offset;
+    }
+
+    // Inline data is copied straight out of the inode record
+    if(inode.Valid & INODE_INLINE) {
+        memcpy(data, inline_data(record) + offset, length);
+        return length;
+    }
+
+    if(inode.Valid & INODE_DIR) {
+        kind = BLOCK_METADATA;
+    }
+
+    if(inode.Valid & INODE_COMPRESSED) {
+        return read_compressed(fs, inumber, &inode, data, length, offset, kind);
+    }
+
+    Block indirect;
+    bool haveIndirect = false;
+    int done = 0;
+
+    // Load the indirect block now if the request needs it, so read-ahead
+    // can map blocks past the direct pointers
+    uint32_t last = (offset + length - 1) >> fs->blockShift;
+    if (last >= POINTERS_PER_INODE) {
+        block_pointer(fs, &inode, last, &indirect, &haveIndirect);
+    }
+    read_ahead(fs, inumber, &inode, offset >> fs->blockShift, last, &indirect, &haveIndirect, kind);
+
+    while (done < length) {
+        uint32_t index = (offset + done) >> fs->blockShift;
+        uint32_t within = (offset + done) & (fs->blockSize - 1);
+        int chunk = min(fs->blockSize - within, length - done);
+        uint32_t blocknum = block_pointer(fs, &inode, index, &indirect, &haveIndirect);
+
+        // Holes read back as zeros without touching the disk. A block that
+        // fails verification fails the read rather than be handed back.
+        if (!blocknum) {
+            memset(data + done, 0, chunk);
+        }
+        // Whole blocks go straight into the caller's buffer
+        else if (chunk == fs->blockSize) {
+            if (!disk_read_kind(fs->disk, blocknum, data + done, kind)) {
+                return -1;
+            }
+        }
+        else {
+            Block block;
+            if (!disk_read_kind(fs->disk, blocknum, block.Data, kind)) {
+                return -1;
+            }
+            memcpy(data + done, block.Data + within, chunk);
+        }
+        done += chunk;
+    }
+
+    return length;
+}
+
+static ssize_t read_file(FileSystem *fs, size_t inumber, char *data, int length, size_t offset, BlockKind kind) {
+
+    if (!disk_mounted(fs->disk)) {
+        return -1;
+    }
+
+    DirtyFile *dirty = dirty_file(fs, inumber);
+    if (!dirty) {
+        return read_inode(fs, inumber, data, length, offset, kind);
+    }
+
+    // Read what the disk has, then lay the buffered blocks over it
+    if (offset >= dirty->Size) {
+        return 0;
+    }
+    length = min((size_t)length, dirty->Size - offset);
+
+    ssize_t read = read_inode(fs, inumber, data, length, offset, kind);
+    if (read < 0) {
+        return -1;
+    }
+    memset(data + read, 0, length - read);
+
+    for (int done = 0; done < length; ) {
+        uint32_t index = (offset + done) >> fs->blockShift;
+        uint32_t within = (offset + done) & (fs->blockSize - 1);
+        int chunk = min(fs->blockSize - within, length - done);
+        if (dirty->Blocks[index]) {
+            memcpy(data + done, dirty->Blocks[index] + within, chunk);
+        }
+        done += chunk;
+    }
+
+    return length;
+}
+
+ssize_t fs_read(FileSystem *fs, size_t inumber, char *data, int length, size_t offset) {
+    return read_file(fs, inumber, data, length, offset, BLOCK_DATA);
+}
+
+// Blocks already cached are used, but nothing read is kept: a bulk export
+// would otherwise push out blocks that are read again
+ssize_t fs_read_uncached(FileSystem *fs, size_t inumber, char *data, int length, size_t offset) {
+    return read_file(fs, inumber, data, length, offset, BLOCK_STREAM);
+}
+
+// Take the first free block at or after the goal within its group, else
+// the first free block of the next group with room, wrapping round the
+// disk. A goal moves past each block taken, so a file's blocks follow on.
+ssize_t fs_allocate_block(FileSystem *fs) {
+    uint32_t first = data_start(&fs->metadata);
+    uint32_t goal = fs->allocGoal;
+    if (goal < first || goal >= fs->metadata.Blocks) {
+        goal = first;
+    }
+    if (fs->reserved && !available_blocks(fs)) {
+        return 0;
+    }
+
+    uint32_t group = goal / GROUP_BLOCKS;
+    for (uint32_t n = 0; n <= fs->groups; n++, group = (group + 1) % fs->groups) {
+        if (!fs->groupFree[group]) {
+            continue;
+        }
+        uint32_t start = n ? max(group * GROUP_BLOCKS, first) : goal;
+        uint32_t end = min((group + 1) * GROUP_BLOCKS, fs->metadata.Blocks);
+        for (uint32_t i = start; i < end; i++) {
+            if (!fs->bitmap[i]) {
+                set_used(fs, i, true);
+                fs->refcount[i] = 1;
+                if (fs->allocGoal) {
+                    fs->allocGoal = i + 1;
+                }
+                return i;
+            }
+        }
+    }
+    return 0;
+}
+
+// Give inode an empty indirect block. Returns false when the disk is full.
+static bool allocate_indirect(FileSystem *fs, Inode *inode, Block *indirect, bool *haveIndirect, bool *indirectDirty) {
+    inode->Indirect = fs_allocate_block(fs);
+    if (!inode->Indirect) {
+        return false;
+    }
+    cover_metadata(fs, inode->Indirect, 1, true);
+    memset(indirect->Data, 0, fs->blockSize);
+    *haveIndirect = true;
+    *indirectDirty = true;
+    return true;
+}
+
+// Give the inode a private copy of an indirect block it shares with a
+// snapshot before any pointer in it changes. The copy adds a reference to
+// every block it points at. Returns false when the disk is full.
+static bool unshare_indirect(FileSystem *fs, Inode *inode, Block *indirect, bool *haveIndirect, bool *indirectDirty) {
+    if (!inode->Indirect || fs->refcount[inode->Indirect] <= 1) {
+        return true;
+    }
+
+    uint32_t copy = fs_allocate_block(fs);
+    if (!copy) {
+        return false;
+    }
+
+    disk_read(fs->disk, inode->Indirect, indirect->Data);
+    for (int i = 0; i < fs->pointersPerBlock; i++) {
+        uint32_t pointer = pointer_block(inode, indirect->Pointers[i]);
+        if (pointer) {
+            fs->refcount[pointer]++;
+        }
+    }
+    release_block(fs, inode->Indirect);
+    cover_metadata(fs, copy, 1, true);
+
+    inode->Indirect = copy;
+    *haveIndirect = true;
+    *indirectDirty = true;
+    return true;
+}
+
+// Allocate a data block for a hole at file block index, allocating the
+// indirect block too if needed. Returns 0 when the disk is full.
+static uint32_t allocate_pointer(FileSystem *fs, Inode *inode, uint32_t index, Block *indirect, bool *haveIndirect, bool *indirectDirty) {
+    if (index < POINTERS_PER_INODE) {
+        inode->Direct[index] = fs_allocate_block(fs);
+        return inode->Direct[index];
+    }
+
+    if (!inode->Indirect) {
+        if (!allocate_indirect(fs, inode, indirect, haveIndirect, indirectDirty)) {
+            return 0;
+        }
+    }
+    else if (!*haveIndirect) {
+        disk_read(fs->disk, inode->Indirect, indirect->Data);
+        *haveIndirect = true;
+    }
+
+    uint32_t blocknum = fs_allocate_block(fs);
+    if (blocknum) {
+        indirect->Pointers[index - POINTERS_PER_INODE] = blocknum;
+        *indirectDirty = true;
+    }
+    return blocknum;
+}
+
+// Compressed clusters ---------------------------------------------------------
+
+// Whether a write to this inode should go through compressed clusters; new
+// regular files on a compressing image start compressed
+static bool use_compression(FileSystem *fs, Inode *inode) {
+    if (inode->Valid & INODE_COMPRESSED) {
+        return true;
+    }
+    if (!(fs->metadata.Features & FEATURE_COMPRESS) || (inode->Valid & INODE_DIR) || inode->Size || inode->Indirect) {
+        return false;
+    }
+    for (int i = 0; i < POINTERS_PER_INODE; i++) {
+        if (inode->Direct[i]) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// Point file block index at blocknum (0 clears it), allocating the indirect
+// block if needed. Returns false when the disk is full.
+static bool set_pointer(FileSystem *fs, Inode *inode, uint32_t index, uint32_t blocknum, Block *indirect, bool *haveIndirect, bool *indirectDirty) {
+    if (index < POINTERS_PER_INODE) {
+        inode->Direct[index] = blocknum;
+        return true;
+    }
+
+    if (!inode->Indirect) {
+        if (!blocknum) {
+            return true;
+        }
+        if (!allocate_indirect(fs, inode, indirect, haveIndirect, indirectDirty)) {
+            return false;
+        }
+    }
+    else if (!*haveIndirect) {
+        disk_read(fs->disk, inode->Indirect, indirect->Data);
+        *haveIndirect = true;
+    }
+
+    indirect->Pointers[index - POINTERS_PER_INODE] = blocknum;
+    *indirectDirty = true;
+    return true;
+}
+
+// Read cluster c of a compressed inode into buffer (cluster_size bytes),
+// caching its blocks as kind
+static bool read_cluster(FileSystem *fs, size_t inumber, Inode *inode, uint32_t c, char *buffer, Block *indirect, bool *haveIndirect, BlockKind kind) {
+    // Sequential readers usually ask for the same cluster again
+    if (fs->cluster.Inumber == inumber + 1 && fs->cluster.Index == c) {
+        memcpy(buffer, fs->cluster.Data, cluster_size(fs));
+        return true;
+    }
+
+    uint32_t pointers[CLUSTER_BLOCKS];
+    for (int i = 0; i < CLUSTER_BLOCKS; i++) {
+        pointers[i] = block_pointer(fs, inode, c * CLUSTER_BLOCKS + i, indirect, haveIndirect);
+    }
+
+    if (pointers[0] & POINTER_COMPRESSED) {
+        // Packed clusters fill their leading slots: a length, then LZ data
+        char *packed = fs->cluster.Packed;
+        int n = 0;
+        for (; n < CLUSTER_BLOCKS && pointers[n]; n++) {
+            if (!disk_read_kind(fs->disk, pointers[n] & POINTER_MASK, packed + ((size_t)n << fs->blockShift), kind)) {
+                return false;
+            }
+        }
+
+        uint32_t length;
+        memcpy(&length, packed, sizeof(length));
+        if (length > ((size_t)n << fs->blockShift) - sizeof(length) ||
+            lz_decompress(packed + sizeof(length), length, buffer, cluster_size(fs)) != cluster_size(fs)) {
+            return false;
+        }
+    }
+    else {
+        for (int i = 0; i < CLUSTER_BLOCKS; i++) {
+            if (pointers[i]) {
+                if (!disk_read_kind(fs->disk, pointers[i], buffer + ((size_t)i << fs->blockShift), kind)) {
+                    return false;
+                }
+            }
+            else {
+                memset(buffer + ((size_t)i << fs->blockShift), 0, fs->blockSize);
+            }
+        }
+    }
+
+    memcpy(fs->cluster.Data, buffer, cluster_size(fs));
+    fs->cluster.Inumber = inumber + 1;
+    fs->cluster.Index = c;
+    return true;
+}
+
+// Store cluster c from buffer: compressed into as few blocks as it packs
+// to, raw if it does not save a block, or as a hole if it is all zeros.
+// The cluster's existing blocks are reused before new ones are allocated.
+static bool write_cluster(FileSystem *fs, Inode *inode, uint32_t c, char *buffer, Block *indirect, bool *haveIndirect, bool *indirectDirty) {
+    uint32_t old[CLUSTER_BLOCKS], blocks[CLUSTER_BLOCKS];
+    uint32_t nold = 0, nblocks = 0;
+    char *packed = fs->cluster.Packed;
+    char *source = buffer;
+    bool compressed = false;
+
+    for (int i = 0; i < CLUSTER_BLOCKS; i++) {
+        uint32_t pointer = block_pointer(fs, inode, c * CLUSTER_BLOCKS + i, indirect, haveIndirect);
+        if (pointer) {
+            old[nold++] = pointer & POINTER_MASK;
+        }
+    }
+
+    if (!is_zero(buffer, cluster_size(fs))) {
+        uint32_t length = lz_compress(buffer, cluster_size(fs), packed + sizeof(length),
+                                      ((CLUSTER_BLOCKS - 1) << fs->blockShift) - sizeof(length));
+        if (length) {
+            memcpy(packed, &length, sizeof(length));
+            nblocks = (length + sizeof(length) + fs->blockSize - 1) >> fs->blockShift;
+            source = packed;
+            compressed = true;
+        }
+        else {
+            nblocks = CLUSTER_BLOCKS;
+        }
+    }
+
+    // Make sure the indirect block exists before committing data blocks
+    uint32_t lastIndex = c * CLUSTER_BLOCKS + CLUSTER_BLOCKS - 1;
+    if (nblocks && lastIndex >= POINTERS_PER_INODE && !inode->Indirect &&
+        !allocate_indirect(fs, inode, indirect, haveIndirect, indirectDirty)) {
+        return false;
+    }
+
+    // Blocks a snapshot still shares are left to it and replaced. Every
+    // block is found before any is written, so a full disk leaves the old
+    // cluster whole in the blocks it reuses.
+    bool reused[CLUSTER_BLOCKS] = {false};
+    for (uint32_t i = 0; i < nblocks; i++) {
+        reused[i] = i < nold && fs->refcount[old[i]] == 1;
+        blocks[i] = reused[i] ? old[i] : fs_allocate_block(fs);
+        if (!blocks[i]) {
+            for (uint32_t j = 0; j < i; j++) {
+                if (!reused[j] && release_block(fs, blocks[j])) {
+                    disk_discard(fs->disk, blocks[j], 1);
+                }
+            }
+            return false;
+        }
+    }
+    for (uint32_t i = 0; i < nblocks; i++) {
+        disk_write_kind(fs->disk, blocks[i], source + ((size_t)i << fs->blockShift), BLOCK_DATA);
+    }
+
+    // Release blocks the cluster no longer uses
+    uint32_t freed[CLUSTER_BLOCKS];
+    uint32_t nfreed = 0;
+    for (uint32_t i = 0; i < nold; i++) {
+        if (!reused[i] && release_block(fs, old[i])) {
+            freed[nfreed++] = old[i];
+        }
+    }
+    discard_blocks(fs, freed, nfreed);
+
+    for (uint32_t i = 0; i < CLUSTER_BLOCKS; i++) {
+        uint32_t pointer = i < nblocks ? blocks[i] : 0;
+        if (i == 0 && compressed) {
+            pointer |= POINTER_COMPRESSED;
+        }
+        set_pointer(fs, inode, c * CLUSTER_BLOCKS + i, pointer, indirect, haveIndirect, indirectDirty);
+    }
+    return true;
+}
+
+static ssize_t read_compressed(FileSystem *fs, size_t inumber, Inode *inode, char *data, size_t length, size_t offset, BlockKind kind) {
+    Block indirect;
+    bool haveIndirect = false;
+    char *cluster = malloc(cluster_size(fs));
+    size_t done = 0;
+
+    read_ahead(fs, inumber, inode, offset >> fs->blockShift, (offset + length - 1) >> fs->blockShift, &indirect, &haveIndirect, kind);
+
+    while (done < length) {
+        uint32_t c = (offset + done) / cluster_size(fs);
+        uint32_t within = (offset + done) & (cluster_size(fs) - 1);
+        size_t chunk = min(cluster_size(fs) - within, length - done);
+
+        // A cluster that fails verification or will not unpack fails the read
+        if (!read_cluster(fs, inumber, inode, c, cluster, &indirect, &haveIndirect, kind)) {
+            free(cluster);
+            return -1;
+        }
+        memcpy(data + done, cluster + within, chunk);
+        done += chunk;
+    }
+
+    free(cluster);
+    return done;
+}
+
+static ssize_t write_compressed(FileSystem *fs, size_t inumber, Inode *inode, char *data, size_t length, size_t offset) {
+    Block indirect;
+    bool haveIndirect = false;
+    bool indirectDirty = false;
+    size_t done = 0;
+
+    // The last cluster must fit entirely in the block map
+    size_t clusters = (POINTERS_PER_INODE + fs->pointersPerBlock) / CLUSTER_BLOCKS;
+    if (length + offset > clusters * cluster_size(fs)) {
+        return -1;
+    }
+
+    inode->Valid |= INODE_COMPRESSED;
+
+    // A goal already set belongs to a run the caller reserved
+    bool reserved = fs->allocGoal != 0;
+
+    if (length + offset > ((size_t)POINTERS_PER_INODE << fs->blockShift) &&
+        !unshare_indirect(fs, inode, &indirect, &haveIndirect, &indirectDirty)) {
+        return -1;
+    }
+
+    char *cluster = malloc(cluster_size(fs));
+    while (done < length) {
+        uint32_t c = (offset + done) / cluster_size(fs);
+        uint32_t within = (offset + done) & (cluster_size(fs) - 1);
+        size_t chunk = min(cluster_size(fs) - within, length - done);
+
+        // Partial clusters are read, patched and repacked
+        if (chunk < cluster_size(fs) && !read_cluster(fs, inumber, inode, c, cluster, &indirect, &haveIndirect, BLOCK_DATA)) {
+            break;
+        }
+        memcpy(cluster + within, data + done, chunk);
+
+        if (!reserved) {
+            aim(fs, inumber, inode, c * CLUSTER_BLOCKS, &indirect, &haveIndirect);
+        }
+        if (!write_cluster(fs, inode, c, cluster, &indirect, &haveIndirect, &indirectDirty)) {
+            break;
+        }
+        if (fs->cluster.Inumber == inumber + 1 && fs->cluster.Index == c) {
+            memcpy(fs->cluster.Data, cluster, cluster_size(fs));
+        }
+        done += chunk;
+    }
+    free(cluster);
+    if (!reserved) {
+        fs->allocGoal = 0;
+    }
+
+    if (indirectDirty) {
+        disk_write(fs->disk, inode->Indirect, indirect.Data);
+    }
+
+    inode->Size = max(inode->Size, offset + done);
+    store_inode(fs, inumber, inode);
+    return done;
+}
+
+// Write to inode --------------------------------------------------------------
+static ssize_t write_blocks(FileSystem *fs, size_t inumber, char *data, size_t length, size_t offset);
+static ssize_t write_delayed(FileSystem *fs, size_t inumber, char *data, size_t length, size_t offset);
+
+// Move an inline file's bytes out of its record into a data block; record
+// was loaded into block. Returns false when the disk is full, with the
+// record as it was.
+static bool spill_inline(FileSystem *fs, size_t inumber, Inode *record, Block *block) {
+    SuperBlock *sb = &fs->metadata;
+    uint32_t table = table_block(fs, inode_block(sb, inumber));
+    char saved[MAX_BLOCK_SIZE];
+    uint32_t size = record->Size;
+    memcpy(saved, record, inode_size(sb));
+
+    // write_blocks takes the block path only once the record is emptied
+    memset(inline_data(record), 0, inline_capacity(sb));
+    record->Valid &= ~INODE_INLINE;
+    record->Size = 0;
+    disk_write(fs->disk, table, block->Data);
+
+    if (write_blocks(fs, inumber, inline_data((Inode *)saved), size, 0) == size) {
+        return true;
+    }
+
+    // Let go of whatever part was stored, direct blocks only since the
+    // bytes fit in one, then put the record back
+    Inode inode;
+    if (find_inode(fs, inumber, &inode)) {
+        uint32_t freed[POINTERS_PER_INODE + 1];
+        discard_blocks(fs, freed, release_inode(fs, &inode, 0, freed));
+    }
+    if (fs->cluster.Inumber == inumber + 1) {
+        fs->cluster.Inumber = 0;
+    }
+    disk_read(fs->disk, table, block->Data);
+    memcpy(record, saved, inode_size(sb));
+    disk_write(fs->disk, table, block->Data);
+    return false;
+}
+
+// Write into an inline inode. Returns -2 when the write must go to data
+// blocks instead; an inline file that outgrows its record is spilled first.
+static ssize_t write_inline(FileSystem *fs, size_t inumber, char *data, size_t length, size_t offset) {
+    Block block;
+    Inode *record = load_inode(fs, inumber, &block);
+    uint32_t capacity = inline_capacity(&fs->metadata);
+
+    if (!record) {
+        return -2;
+    }
+
+    bool isInline = record->Valid & INODE_INLINE;
+    if (!isInline && (record->Size || record->Indirect)) {
+        return -2;
+    }
+    for (int i = 0; !isInline && i < POINTERS_PER_INODE; i++) {
+        if (record->Direct[i]) {
+            return -2;
+        }
+    }
+
+    // Fits in the record: the bytes past Size are kept zeroed
+    if (offset + length <= capacity) {
+        memcpy(inline_data(record) + offset, data, length);
+        record->Size = max(record->Size, offset + length);
+        record->Valid |= INODE_INLINE;
+        disk_write(fs->disk, table_block(fs, inode_block(&fs->metadata, inumber)), block.Data);
+        return length;
+    }
+
+    if (!isInline) {
+        return -2;
+    }
+
+    // Spill the inline bytes to a data block, then take the block path
+    return spill_inline(fs, inumber, record, &block) ? -2 : -1;
+}
+
+ssize_t fs_write(FileSystem *fs, size_t inumber, char *data, size_t length, size_t offset) {
+
+    if (!disk_mounted(fs->disk) || fs->readonly) {
+        return -1;
+    }
+
+    // Buffered data goes to blocks on flush, so the file is past inlining
+    if ((fs->metadata.Features & FEATURE_INLINE) && !dirty_file(fs, inumber)) {
+        ssize_t written = write_inline(fs, inumber, data, length, offset);
+        if (written != -2) {
+            return written;
+        }
+    }
+
+    if (fs->dirty) {
+        return write_delayed(fs, inumber, data, length, offset);
+    }
+
+    return write_blocks(fs, inumber, data, length, offset);
+}
+
+// Store one block of file data at index, currently in blocknum (0 for a
+// hole). Identical blocks already on a deduplicating image are shared, and
+// a block with other owners is copied rather than changed in place.
+static bool store_block(FileSystem *fs, Inode *inode, uint32_t index, uint32_t blocknum, char *contents, Block *indirect, bool *haveIndirect, bool *indirectDirty) {
+    uint64_t fingerprint = 0;
+
+    if (fs->dedup) {
+        fingerprint = block_fingerprint(contents, fs->blockSize);
+        uint32_t match = dedup_find(fs->dedup, fs->disk, contents, fingerprint);
+        if (match && match == blocknum) {
+            return true;
+        }
+        if (match) {
+            if (!set_pointer(fs, inode, index, match, indirect, haveIndirect, indirectDirty)) {
+                return false;
+            }
+            fs->refcount[match]++;
+            if (blocknum && release_block(fs, blocknum)) {
+                disk_discard(fs->disk, blocknum, 1);
+            }
+            return true;
+        }
+    }
+
+    if (!blocknum) {
+        blocknum = allocate_pointer(fs, inode, index, indirect, haveIndirect, indirectDirty);
+        if (!blocknum) {
+            return false;
+        }
+    }
+    else if (fs->refcount[blocknum] > 1) {
+        uint32_t copy = fs_allocate_block(fs);
+        if (!copy) {
+            return false;
+        }
+        set_pointer(fs, inode, index, copy, indirect, haveIndirect, indirectDirty);
+        release_block(fs, blocknum);
+        blocknum = copy;
+    }
+
+    disk_write_kind(fs->disk, blocknum, contents, BLOCK_DATA);
+    if (fs->dedup) {
+        dedup_insert(fs->dedup, blocknum, fingerprint);
+    }
+    return true;
+}
+
+static ssize_t write_blocks(FileSystem *fs, size_t inumber, char *data, size_t length, size_t offset) {
+
+    Inode inode;
+    Block indirect;
+    bool haveIndirect = false;
+    bool indirectDirty = false;
+    size_t done = 0;
+
+    // Insufficient size
+    if(length + offset > ((size_t)(fs->pointersPerBlock + POINTERS_PER_INODE) << fs->blockShift)) {
+        return -1;
+    }
+
+    // Load and validate inode and allocate if doesn't exist
+    if(!find_inode(fs, inumber, &inode)) {
+        if (inumber >= fs->metadata.Inodes) {
+            return -1;
+        }
+        memset(&inode, 0, sizeof(Inode));
+        inode.Valid = INODE_VALID;
+        fs->inodeTracker[inode_block(&fs->metadata, inumber) - 1]++;
+    }
+
+    if (use_compression(fs, &inode)) {
+        return write_compressed(fs, inumber, &inode, data, length, offset);
+    }
+
+    if (length + offset > ((size_t)POINTERS_PER_INODE << fs->blockShift) &&
+        !unshare_indirect(fs, &inode, &indirect, &haveIndirect, &indirectDirty)) {
+        return -1;
+    }
+
+    // A goal already set belongs to a run the caller reserved
+    bool reserved = fs->allocGoal != 0;
+
+    while (done < length) {
+        uint32_t index = (offset + done) >> fs->blockShift;
+        uint32_t within = (offset + done) & (fs->blockSize - 1);
+        size_t chunk = min(fs->blockSize - within, length - done);
+        uint32_t blocknum = block_pointer(fs, &inode, index, &indirect, &haveIndirect);
+
+        // A whole block of zeros written over a hole stays a hole
+        if (!blocknum && chunk == fs->blockSize && is_zero(data + done, fs->blockSize)) {
+            done += chunk;
+            continue;
+        }
+
+        // Partial block: merge with existing contents, or zeros if new
+        Block block;
+        char *contents = data + done;
+        if (chunk < fs->blockSize) {
+            // Merging into a block that fails verification would give the
+            // bad bytes a good checksum, so the write stops there
+            if (blocknum && !disk_read_kind(fs->disk, blocknum, block.Data, BLOCK_DATA)) {
+                break;
+            }
+            if (!blocknum) {
+                memset(block.Data, 0, fs->blockSize);
+            }
+            memcpy(block.Data + within, data + done, chunk);
+            contents = block.Data;
+        }
+
+        if (!reserved && (!blocknum || fs->refcount[blocknum] > 1)) {
+            aim(fs, inumber, &inode, index, &indirect, &haveIndirect);
+        }
+        if (!store_block(fs, &inode, index, blocknum, contents, &indirect, &haveIndirect, &indirectDirty)) {
+            break;
+        }
+        done += chunk;
+    }
+    if (!reserved) {
+        fs->allocGoal = 0;
+    }
+
+    if (indirectDirty) {
+        disk_write(fs->disk, inode.Indirect, indirect.Data);
+    }
+
+    // Set node size
+    inode.Size = max(inode.Size, offset + done);
+    store_inode(fs, inumber, &inode);
+    return done;
+}
+
+// Delayed allocation ----------------------------------------------------------
+
+// With delayed allocation, fs_write only buffers data per inode. Blocks are
+// assigned when the file is flushed by fs_sync, by memory pressure or to
+// free its slot, so a whole file is allocated at once and data removed
+// before then never touches the allocator.
+
+#define FLUSH_RUN 64             // Buffered blocks handed to write_blocks at once
+
+// Blocks a flush of d may have to take, counting the blocks of a write of
+// length bytes at offset as buffered too: one per buffered block
+// over a hole or a block shared with a snapshot or through dedup, and the
+// indirect block if the file needs one of its own. A compressed cluster
+// may pack into more blocks than it had, so each one buffered counts whole.
+static uint32_t dirty_need(FileSystem *fs, DirtyFile *d, Inode *inode, size_t offset, size_t length) {
+    uint32_t first = offset >> fs->blockShift;
+    uint32_t last = length ? (offset + length - 1) >> fs->blockShift : 0;
+    bool compressed = use_compression(fs, inode);
+    Block indirect;
+    bool haveIndirect = false;
+    bool beyond = false;
+    uint32_t need = 0;
+    uint32_t cluster = UINT32_MAX;
+
+    for (uint32_t i = 0; i < POINTERS_PER_INODE + fs->pointersPerBlock; i++) {
+        if (!d->Blocks[i] && (!length || i < first || i > last)) {
+            continue;
+        }
+        beyond |= i >= POINTERS_PER_INODE;
+        if (compressed) {
+            if (i / CLUSTER_BLOCKS != cluster) {
+                cluster = i / CLUSTER_BLOCKS;
+                need += CLUSTER_BLOCKS;
+            }
+            continue;
+        }
+        uint32_t blocknum = pointer_block(inode, block_pointer(fs, inode, i, &indirect, &haveIndirect));
+        need += !blocknum || fs->refcount[blocknum] > 1;
+    }
+    return need + (beyond && (!inode->Indirect || fs->refcount[inode->Indirect] > 1));
+}
+
+// Hold back what d's buffers need now, in place of its earlier reservation
+static void reserve_dirty(FileSystem *fs, DirtyFile *d, Inode *inode) {
+    uint32_t need = dirty_need(fs, d, inode, 0, 0);
+    fs->reserved = fs->reserved - d->Reserved + need;
+    d->Reserved = need;
+}
+
+// Write a file's buffered blocks out and free its slot. New blocks come
+// from the first free run that holds them all, searched from where the
+// allocator would aim the first of them, so the file lands in one extent
+// near its other blocks when the disk has room for it. If a write fails
+// the buffers stay, to be flushed again once there is room.
+static bool flush_file(FileSystem *fs, DirtyFile *d) {
+    size_t inumber = d->Inumber - 1;
+    uint32_t nblocks = POINTERS_PER_INODE + fs->pointersPerBlock;
+    Inode inode;
+    Block indirect;
+    bool haveIndirect = false;
+    if (!find_inode(fs, inumber, &inode)) {
+        drop_dirty(fs, d);
         return false;
     }
+    bool ok = true;
+
+    // The blocks held back for this file are now its to take
+    fs->reserved -= d->Reserved;
+    d->Reserved = 0;
+
+    // Blocks to allocate: buffered holes, and the indirect block if missing
+    uint32_t need = 0;
+    bool indirectNeeded = false;
+    for (uint32_t i = 0; ok && i < nblocks; i++) {
+        if (d->Blocks[i] && !block_pointer(fs, &inode, i, &indirect, &haveIndirect)) {
+            indirectNeeded |= i >= POINTERS_PER_INODE && !inode.Indirect;
+            if (!need) {
+                aim(fs, inumber, &inode, i, &indirect, &haveIndirect);
+            }
+            need++;
+        }
+    }
+    need += indirectNeeded;
+    fs->allocGoal = need ? find_run(fs, need, fs->allocGoal) : 0;
 
-    inode.Valid = false;
-    inode.Size = 0;
+    char *run = malloc((size_t)FLUSH_RUN << fs->blockShift);
+    for (uint32_t i = 0; ok && i < nblocks; ) {
+        if (!d->Blocks[i]) {
+            i++;
+            continue;
+        }
+
+        uint32_t n = 0;
+        for (; n < FLUSH_RUN && i + n < nblocks && d->Blocks[i + n]; n++) {
+            memcpy(run + ((size_t)n << fs->blockShift), d->Blocks[i + n], fs->blockSize);
+        }
 
-    // Set the free blocks array appropriately
-    if (!(--fs->inodeTracker[inumber / INODES_PER_BLOCK])) {
-        fs->bitmap[inumber / INODES_PER_BLOCK + 1] = false;
+        // The last block only counts up to the file size
+        size_t start = (size_t)i << fs->blockShift;
+        size_t end = min((size_t)(i + n) << fs->blockShift, d->Size);
+        if (end > start) {
+            ok = write_blocks(fs, inumber, run, end - start, start) == end - start;
+        }
+        i += n;
     }
+    free(run);
 
-    // Free direct blocks
-    for (int i = 0; i < POINTERS_PER_INODE; i++) {
-        fs->bitmap[inode.Direct[i]] = false;
-        inode.Direct[i] = 0;
+    fs->allocGoal = 0;
+    if (!ok) {
+        find_inode(fs, inumber, &inode);
+        reserve_dirty(fs, d, &inode);
+        return false;
     }
+    drop_dirty(fs, d);
+    return true;
+}
 
-    // Free indirect blocks
-    if (inode.Indirect) {
-        fs->bitmap[inode.Indirect] = false;
-        Block inDirBlock;
-        disk_read(fs->disk, inode.Indirect, inDirBlock.Data);
-        inode.Indirect = 0;
+static ssize_t write_delayed(FileSystem *fs, size_t inumber, char *data, size_t length, size_t offset) {
+    if (length + offset > ((size_t)(fs->pointersPerBlock + POINTERS_PER_INODE) << fs->blockShift)) {
+        return -1;
+    }
+
+    // The inode exists from the first write on, as it would unbuffered
+    Inode inode;
+    if (!find_inode(fs, inumber, &inode)) {
+        if (inumber >= fs->metadata.Inodes) {
+            return -1;
+        }
+        memset(&inode, 0, sizeof(Inode));
+        inode.Valid = INODE_VALID;
+        fs->inodeTracker[inode_block(&fs->metadata, inumber) - 1]++;
+        store_inode(fs, inumber, &inode);
+    }
+
+    // A slot holding another file is flushed to make room
+    DirtyFile *d = &fs->dirty[inumber % DELALLOC_FILES];
+    if (d->Inumber && d->Inumber != inumber + 1 && !flush_file(fs, d)) {
+        return -1;
+    }
+    bool fresh = !d->Inumber;
+    if (fresh) {
+        d->Inumber = inumber + 1;
+        d->Size = inode.Size;
+        d->Blocks = calloc(POINTERS_PER_INODE + fs->pointersPerBlock, sizeof(char *));
+    }
 
-        for (int i = 0; i < POINTERS_PER_BLOCK; i++) {
-            uint32_t inDirBlockPtr = inDirBlock.Pointers[i];
-            if (inDirBlockPtr) {
-                fs->bitmap[inDirBlockPtr] = false;
+    // The write is refused now, while it can be, if its flush could find
+    // the disk full
+    uint32_t need = dirty_need(fs, d, &inode, offset, length);
+    if (need > d->Reserved && need - d->Reserved > available_blocks(fs)) {
+        if (fresh) {
+            drop_dirty(fs, d);
+        }
+        return -1;
+    }
+    fs->reserved = fs->reserved - d->Reserved + need;
+    d->Reserved = need;
+
+    for (size_t done = 0; done < length; ) {
+        uint32_t index = (offset + done) >> fs->blockShift;
+        uint32_t within = (offset + done) & (fs->blockSize - 1);
+        size_t chunk = min(fs->blockSize - within, length - done);
+
+        // A block only partly written starts from what the disk holds
+        if (!d->Blocks[index]) {
+            d->Blocks[index] = malloc(fs->blockSize);
+            ssize_t read = 0;
+            if (chunk < fs->blockSize) {
+                read = max(read_inode(fs, inumber, d->Blocks[index], fs->blockSize, (size_t)index << fs->blockShift, BLOCK_DATA), 0);
             }
+            memset(d->Blocks[index] + read, 0, fs->blockSize - read);
+            fs->dirtyBytes += fs->blockSize;
         }
+        memcpy(d->Blocks[index] + within, data + done, chunk);
+        done += chunk;
     }
+    d->Size = max(d->Size, offset + length);
 
-    Block block;
-    disk_read(fs->disk, inumber / INODES_PER_BLOCK + 1, block.Data);
-    block.Inodes[inumber % INODES_PER_BLOCK] = inode;
-    disk_write(fs->disk, inumber / INODES_PER_BLOCK + 1, block.Data);
+    // Memory pressure: past the limit everything buffered is written out
+    if (fs->dirtyBytes > fs->dirtyLimit && !fs_sync(fs)) {
+        return -1;
+    }
+    return length;
+}
 
-    return true;
+bool fs_sync(FileSystem *fs) {
+    if (!disk_mounted(fs->disk) || fs->readonly) {
+        return false;
+    }
+
+    bool ok = true;
+    for (int i = 0; fs->dirty && i < DELALLOC_FILES; i++) {
+        if (fs->dirty[i].Inumber && !flush_file(fs, &fs->dirty[i])) {
+            ok = false;
+        }
+    }
+    return ok;
 }
 
-// Inode stat ------------------------------------------------------------------
+// Buffer writes until fs_sync, or until limit bytes are buffered; a limit
+// of 0 flushes and goes back to allocating on every write
+bool fs_set_delalloc(FileSystem *fs, size_t limit) {
+    if (!disk_mounted(fs->disk) || fs->readonly) {
+        return false;
+    }
 
-ssize_t fs_stat(FileSystem *fs, size_t inumber) {
+    // Buffers that cannot be written yet keep allocation delayed
+    if (!limit) {
+        if (!fs_sync(fs)) {
+            return false;
+        }
+        free(fs->dirty);
+        fs->dirty = NULL;
+        return true;
+    }
 
-    if (!disk_mounted(fs->disk)) {
-        return -1;
+    if (fs->dirty == NULL) {
+        fs->dirty = calloc(DELALLOC_FILES, sizeof(DirtyFile));
     }
+    fs->dirtyLimit = limit;
+    return true;
+}
 
-    // Load inode information
-    Inode inode;
-    
-    if (find_inode(fs, inumber, &inode)) {
-        return inode.Size;
+// Truncate and preallocate ---------------------------------------------------
+
+// A free block can still hold what a deleted file left in it, on an image
+// written before freed blocks were discarded for one. Preallocation
+// discards every block it reserves, so they join the file unwritten and
+// read back as zeros, as a hole would.
+
+// Largest size a file may have; a compressed one holds whole clusters only
+static size_t max_file_size(FileSystem *fs, Inode *inode) {
+    size_t blocks = POINTERS_PER_INODE + fs->pointersPerBlock;
+    if (inode->Valid & INODE_COMPRESSED) {
+        blocks -= blocks % CLUSTER_BLOCKS;
     }
+    return blocks << fs->blockShift;
+}
 
-    return -1;
+// Whether file blocks index to index + count - 1 are all holes
+static bool is_hole(FileSystem *fs, Inode *inode, uint32_t index, uint32_t count, Block *indirect, bool *haveIndirect) {
+    for (uint32_t i = index; i < index + count; i++) {
+        if (block_pointer(fs, inode, i, indirect, haveIndirect)) {
+            return false;
+        }
+    }
+    return true;
 }
 
-// Read from inode -------------------------------------------------------------
+// Drop buffered blocks past size, and the bytes past it in the block it
+// ends in
+static void truncate_dirty(FileSystem *fs, DirtyFile *d, size_t size) {
+    uint32_t keep = (size + fs->blockSize - 1) >> fs->blockShift;
+    for (uint32_t i = keep; i < POINTERS_PER_INODE + fs->pointersPerBlock; i++) {
+        if (d->Blocks[i]) {
+            free(d->Blocks[i]);
+            d->Blocks[i] = NULL;
+            fs->dirtyBytes -= fs->blockSize;
+        }
+    }
 
-ssize_t fs_read(FileSystem *fs, size_t inumber, char *data, int length, size_t offset) {
+    uint32_t within = size & (fs->blockSize - 1);
+    if (within && d->Blocks[size >> fs->blockShift]) {
+        memset(d->Blocks[size >> fs->blockShift] + within, 0, fs->blockSize - within);
+    }
+    d->Size = size;
+}
 
-    if (!disk_mounted(fs->disk)) {
-        return -1;
+// Set a file's size. Shrinking frees every block past the new end at once;
+// growing leaves a hole. Blocks shared with a snapshot or through dedup
+// lose this file's reference only.
+bool fs_truncate(FileSystem *fs, size_t inumber, size_t size) {
+    Inode inode;
+
+    if (!disk_mounted(fs->disk) || fs->readonly || !find_inode(fs, inumber, &inode) || (inode.Valid & INODE_DIR)) {
+        return false;
     }
 
-    Inode inode;    
+    // Inline bytes past Size are kept zeroed
+    if (inode.Valid & INODE_INLINE) {
+        Block block;
+        Inode *record = load_inode(fs, inumber, &block);
+        if (size <= inline_capacity(&fs->metadata)) {
+            if (size < record->Size) {
+                memset(inline_data(record) + size, 0, record->Size - size);
+            }
+            record->Size = size;
+            disk_write(fs->disk, table_block(fs, inode_block(&fs->metadata, inumber)), block.Data);
+            return true;
+        }
+        if (!spill_inline(fs, inumber, record, &block)) {
+            return false;
+        }
+        find_inode(fs, inumber, &inode);
+    }
 
-    // Loads the inode
-    if(!find_inode(fs, inumber, &inode)) {
-        return -1;
+    if (size > max_file_size(fs, &inode)) {
+        return false;
     }
 
-    // Get size of inode
-    int inodeSize = fs_stat(fs, inumber);
-    
-    // No data can be read when offset too large
-    if((int)offset >= inodeSize) {
-        return 0;
+    DirtyFile *dirty = dirty_file(fs, inumber);
+    if (dirty) {
+        truncate_dirty(fs, dirty, size);
     }
-    // Adjust length accordingly when exceed inodeSize
-    else if(length + (int)offset > inodeSize) {
-        length = inodeSize - offset;
+    if (fs->cluster.Inumber == inumber + 1) {
+        fs->cluster.Inumber = 0;
     }
-    
-    // ptr used to traverse
-    char *ptr = data;     
-    int leftToRead = length;
-
-    // Offset is within direct pointers 
-    if(offset < POINTERS_PER_INODE * BLOCK_SIZE) {
-        // Calculate starting node for reading
-        uint32_t dirNode = offset / BLOCK_SIZE;
-        offset %= BLOCK_SIZE;
-
-        // Direct node is valid 
-        if(inode.Direct[dirNode]) { 
-            disk_read(fs->disk, inode.Direct[dirNode++], ptr);
-            data += offset;
-            ptr += BLOCK_SIZE;
-            length -= (BLOCK_SIZE - offset);
-
-            // Read block and copy to data
-            // Read the direct blocks 
-            while(length > 0 && dirNode < POINTERS_PER_INODE && inode.Direct[dirNode]) {
-                disk_read(fs->disk, inode.Direct[dirNode++], ptr);
-                ptr += BLOCK_SIZE;
-                length -= (BLOCK_SIZE - offset);
-            }
-
-            // No more room for data to be read 
-            if(length <= 0) {
-                return leftToRead;
+
+    // Blocks are freed a whole allocation unit at a time: one block, or one
+    // cluster of a compressed file
+    uint32_t unitBlocks = (inode.Valid & INODE_COMPRESSED) ? CLUSTER_BLOCKS : 1;
+    size_t unit = (size_t)unitBlocks << fs->blockShift;
+    uint32_t first = (size + unit - 1) / unit * unitBlocks;
+    Block indirect;
+    bool haveIndirect = false;
+    bool indirectDirty = false;
+
+    if (size < inode.Size) {
+        // The unit the new end falls in is kept, with the bytes past the
+        // end zeroed so they read as zeros if the file grows again
+        size_t within = size & (unit - 1);
+        if (within && !is_hole(fs, &inode, first - unitBlocks, unitBlocks, &indirect, &haveIndirect)) {
+            char *zeros = calloc(1, unit - within);
+            bool ok = write_blocks(fs, inumber, zeros, unit - within, size) == unit - within;
+            free(zeros);
+            if (!ok) {
+                return false;
             }
-            else {
-                // Read indirect nodes if dirNode has all been read
-                if(dirNode == POINTERS_PER_INODE && inode.Indirect) {
-                    Block indirect;
-                    disk_read(fs->disk, inode.Indirect, indirect.Data);
-
-                    // Read the indirect nodes 
-                    for(uint32_t i = 0; i < POINTERS_PER_BLOCK; i++) {
-                        if(indirect.Pointers[i] && length > 0) {
-                            disk_read(fs->disk, indirect.Pointers[i], ptr);
-                            ptr += BLOCK_SIZE;
-                            length -= (BLOCK_SIZE - offset);
-                        }
-                        else {
-                            break;
-                        }
-                    }
+            find_inode(fs, inumber, &inode);
+            haveIndirect = false;
+        }
 
-                    // No more room for data to be read 
-                    if(length <= 0) {
-                        return leftToRead;
-                    }
-                }
+        // Part of the indirect block stays, so it must be this file's own
+        if (first > POINTERS_PER_INODE) {
+            if (!unshare_indirect(fs, &inode, &indirect, &haveIndirect, &indirectDirty)) {
+                return false;
+            }
+            if (indirectDirty) {
+                disk_write(fs->disk, inode.Indirect, indirect.Data);
             }
         }
+
+        uint32_t *freed = malloc((POINTERS_PER_INODE + 1 + fs->pointersPerBlock) * sizeof(uint32_t));
+        discard_blocks(fs, freed, release_inode(fs, &inode, first, freed));
+        free(freed);
     }
-    // Indirect node is valid and offset starts in the indirect block
-    else if (inode.Indirect){
-        // Calculate starting node for reading
-        offset -= POINTERS_PER_INODE * BLOCK_SIZE;
-        uint32_t indirNode = offset / BLOCK_SIZE;
-        offset %= BLOCK_SIZE;
 
-        Block indirect;
-        disk_read(fs->disk, inode.Indirect, indirect.Data);
+    inode.Size = size;
+    store_inode(fs, inumber, &inode);
+    if (dirty) {
+        reserve_dirty(fs, dirty, &inode);
+    }
+    return true;
+}
+
+// Reserve blocks for every hole in offset to offset + length, as one run
+// where the disk has room, without writing them; the file grows to cover
+// the range. Fails without reserving anything if the disk lacks the space.
+bool fs_fallocate(FileSystem *fs, size_t inumber, size_t offset, size_t length) {
+    Inode inode;
+
+    if (!disk_mounted(fs->disk) || fs->readonly || !find_inode(fs, inumber, &inode) || (inode.Valid & INODE_DIR)) {
+        return false;
+    }
+    if (!length) {
+        return true;
+    }
+    size_t end = offset + length;
 
-        if(indirect.Pointers[indirNode] && length > 0) {
-            disk_read(fs->disk, indirect.Pointers[indirNode++], ptr);
-            data += offset;
-            ptr += BLOCK_SIZE;
-            length -= BLOCK_SIZE - offset;
+    // Buffered blocks get theirs first, so only real holes are left
+    DirtyFile *dirty = dirty_file(fs, inumber);
+    if (dirty && !flush_file(fs, dirty)) {
+        return false;
+    }
+    find_inode(fs, inumber, &inode);
+
+    if (inode.Valid & INODE_INLINE) {
+        Block block;
+        Inode *record = load_inode(fs, inumber, &block);
+        if (end <= inline_capacity(&fs->metadata)) {
+            record->Size = max(record->Size, end);
+            disk_write(fs->disk, table_block(fs, inode_block(&fs->metadata, inumber)), block.Data);
+            return true;
+        }
+        if (!spill_inline(fs, inumber, record, &block)) {
+            return false;
         }
+        find_inode(fs, inumber, &inode);
+    }
+
+    if (end > max_file_size(fs, &inode)) {
+        return false;
+    }
 
-        // Read the indirect nodes 
-        for(uint32_t i = indirNode; i < POINTERS_PER_BLOCK; i++) {
-            if(indirect.Pointers[i] && length > 0) {
-                disk_read(fs->disk, indirect.Pointers[indirNode++], ptr);
-                ptr += BLOCK_SIZE;
-                length -= BLOCK_SIZE - offset;
+    // A compressed file is given whole raw clusters, which it packs again
+    // as they are written
+    uint32_t unitBlocks = (inode.Valid & INODE_COMPRESSED) ? CLUSTER_BLOCKS : 1;
+    uint32_t first = (offset >> fs->blockShift) / unitBlocks * unitBlocks;
+    uint32_t last = ((end - 1) >> fs->blockShift) / unitBlocks * unitBlocks + unitBlocks;
+    Block indirect;
+    bool haveIndirect = false;
+    bool indirectDirty = false;
+
+    uint32_t need = 0;
+    bool indirectHoles = false;
+    for (uint32_t i = first; i < last; i += unitBlocks) {
+        if (is_hole(fs, &inode, i, unitBlocks, &indirect, &haveIndirect)) {
+            if (!need) {
+                aim(fs, inumber, &inode, i, &indirect, &haveIndirect);
             }
-            else break;
+            need += unitBlocks;
+            indirectHoles |= i + unitBlocks > POINTERS_PER_INODE;
+        }
+    }
+    need += indirectHoles && !inode.Indirect;
+    if (need + (indirectHoles && inode.Indirect && fs->refcount[inode.Indirect] > 1) > available_blocks(fs)) {
+        fs->allocGoal = 0;
+        return false;
+    }
+
+    if (indirectHoles && !unshare_indirect(fs, &inode, &indirect, &haveIndirect, &indirectDirty)) {
+        fs->allocGoal = 0;
+        return false;
+    }
+
+    // The allocator works through the run from its start
+    uint32_t run = need ? find_run(fs, need, fs->allocGoal) : 0;
+    if (run) {
+        fs->allocGoal = run;
+    }
+
+    bool ok = true;
+    uint32_t hadIndirect = inode.Indirect;
+    uint32_t *taken = malloc((need + 1) * sizeof(uint32_t));
+    uint32_t *at = malloc((need + 1) * sizeof(uint32_t));
+    size_t count = 0;
+    for (uint32_t i = first; ok && i < last; i += unitBlocks) {
+        if (!is_hole(fs, &inode, i, unitBlocks, &indirect, &haveIndirect)) {
+            continue;
         }
-        
-        // No more room for data to be read 
-        if(length <= 0) {
-            return leftToRead;
+        for (uint32_t j = i; ok && j < i + unitBlocks; j++) {
+            at[count] = j;
+            taken[count] = allocate_pointer(fs, &inode, j, &indirect, &haveIndirect, &indirectDirty);
+            ok = taken[count] != 0;
+            count += ok;
         }
     }
-    
-    // Inode has no stored data or indirect node is invalid
-    return 0;
+    fs->allocGoal = 0;
+
+    // A call that runs short keeps nothing: the holes are put back, and
+    // the indirect block goes too if it was made for them
+    if (!ok) {
+        for (size_t k = 0; k < count; k++) {
+            set_pointer(fs, &inode, at[k], 0, &indirect, &haveIndirect, &indirectDirty);
+            release_block(fs, taken[k]);
+        }
+        if (!hadIndirect && inode.Indirect) {
+            release_block(fs, inode.Indirect);
+            cover_metadata(fs, inode.Indirect, 1, false);
+            taken[count++] = inode.Indirect;
+            inode.Indirect = 0;
+            indirectDirty = false;
+        }
+    }
+    discard_blocks(fs, taken, count);
+    free(taken);
+    free(at);
+
+    if (indirectDirty) {
+        disk_write(fs->disk, inode.Indirect, indirect.Data);
+    }
+    if (ok) {
+        inode.Size = max(inode.Size, end);
+    }
+    store_inode(fs, inumber, &inode);
+    return ok;
 }
 
-ssize_t fs_allocate_block(FileSystem *fs) {
+// Copy file -------------------------------------------------------------------
 
-    // Iterate through the free bit map and allocate the first free block
-    for(int i = fs->metadata.InodeBlocks + 1; i < fs->metadata.Blocks; i++) {
-        if(fs->bitmap[i] == 0) {
-            fs->bitmap[i] = true;
-            return i;
+// Make dst a copy of src that shares its blocks. As with a snapshot's
+// table, each block src points at directly gains a reference, and so does
+// its indirect block, which keeps its pointers' references for both. A
+// later write to either file copies what it changes, so no data is read
+// or written here. dst is taken if free, and loses what it held if not.
+bool fs_copy(FileSystem *fs, size_t src, size_t dst) {
+    SuperBlock *sb = &fs->metadata;
+    Inode inode, old;
+
+    if (!disk_mounted(fs->disk) || fs->readonly || src == dst || dst >= sb->Inodes) {
+        return false;
+    }
+
+    // The copy takes what is on disk, so buffered writes go out first
+    DirtyFile *dirty = dirty_file(fs, src);
+    if (dirty && !flush_file(fs, dirty)) {
+        return false;
+    }
+    if (!find_inode(fs, src, &inode) || (inode.Valid & INODE_DIR)) {
+        return false;
+    }
+
+    if (find_inode(fs, dst, &old)) {
+        if ((old.Valid & INODE_DIR) || !fs_truncate(fs, dst, 0)) {
+            return false;
+        }
+        // Its buffered writes would otherwise land on the copy
+        if ((dirty = dirty_file(fs, dst))) {
+            drop_dirty(fs, dirty);
         }
     }
-    return 0;
+    else {
+        fs->inodeTracker[inode_block(sb, dst) - 1]++;
+    }
+    if (fs->cluster.Inumber == dst + 1) {
+        fs->cluster.Inumber = 0;
+    }
+
+    if (!(inode.Valid & INODE_INLINE)) {
+        for (int i = 0; i < POINTERS_PER_INODE; i++) {
+            uint32_t pointer = pointer_block(&inode, inode.Direct[i]);
+            if (pointer) {
+                fs->refcount[pointer]++;
+            }
+        }
+        if (inode.Indirect) {
+            fs->refcount[inode.Indirect]++;
+        }
+    }
+
+    // The whole record is copied, inline data included; the two may share
+    // a table block
+    Block block;
+    char record[MAX_BLOCK_SIZE];
+    disk_read(fs->disk, table_block(fs, inode_block(sb, src)), block.Data);
+    memcpy(record, inode_record(sb, &block, src % inodes_per_block(sb)), inode_size(sb));
+
+    disk_read(fs->disk, table_block(fs, inode_block(sb, dst)), block.Data);
+    memcpy(inode_record(sb, &block, dst % inodes_per_block(sb)), record, inode_size(sb));
+    disk_write(fs->disk, table_block(fs, inode_block(sb, dst)), block.Data);
+    return true;
 }
 
-// Write to inode --------------------------------------------------------------
-void read_buffer(FileSystem *fs, int offset, int *read, int length, char *data, uint32_t blocknum) {
-    
-    // Allocate memory that acts as buffer for reading from disk
-    char* ptr = (char *)calloc(BLOCK_SIZE, sizeof(char));
+// Defragmentation -------------------------------------------------------------
+
+// A file is moved into a free run, in the order a sequential read visits
+// its blocks, in pieces no larger than what is left of the budget. Blocks
+// shared with a snapshot or another file stay where they are, and so does
+// any file holding one.
 
-    // Read data into ptr
-    for(int i = offset; i < (int)BLOCK_SIZE && *read < length; i++) {
-        ptr[i] = data[*read];
-        *read = *read + 1;
+#define DEFRAG_CHUNK 64          // Blocks gathered into each write of the new run
+
+// A file's blocks in read order: direct blocks, the indirect block, then
+// the blocks it points at, leaving out holes. Returns how many were stored.
+static uint32_t file_blocks(FileSystem *fs, Inode *inode, Block *indirect, uint32_t *blocks) {
+    uint32_t n = 0;
+
+    if (inode->Valid & INODE_INLINE) {
+        return 0;
+    }
+    for (int i = 0; i < POINTERS_PER_INODE; i++) {
+        if (inode->Direct[i]) {
+            blocks[n++] = pointer_block(inode, inode->Direct[i]);
+        }
+    }
+    if (inode->Indirect) {
+        blocks[n++] = inode->Indirect;
+        disk_read(fs->disk, inode->Indirect, indirect->Data);
+        for (uint32_t i = 0; i < fs->pointersPerBlock; i++) {
+            if (indirect->Pointers[i]) {
+                blocks[n++] = pointer_block(inode, indirect->Pointers[i]);
+            }
+        }
     }
-    disk_write(fs->disk, blocknum, ptr);
+    return n;
+}
 
-    // Free memory 
-    free(ptr);
+// Contiguous runs among a file's blocks
+static uint32_t count_extents(const uint32_t *blocks, uint32_t n) {
+    uint32_t extents = n ? 1 : 0;
+    for (uint32_t i = 1; i < n; i++) {
+        if (blocks[i] != blocks[i-1] + 1) {
+            extents++;
+        }
+    }
+    return extents;
 }
 
-ssize_t fs_write(FileSystem *fs, size_t inumber, char *data, size_t length, size_t offset) {
+ssize_t fs_extents(FileSystem *fs, size_t inumber) {
+    Inode inode;
+    Block indirect;
+    uint32_t blocks[POINTERS_PER_INODE + 1 + MAX_POINTERS_PER_BLOCK];
 
-    if (!disk_mounted(fs->disk)) {
+    if (!disk_mounted(fs->disk) || !find_inode(fs, inumber, &inode)) {
         return -1;
     }
+    return count_extents(blocks, file_blocks(fs, &inode, &indirect, blocks));
+}
 
+// Move a fragmented file into one free run near its home group, at most
+// budget blocks at a time. The copy is written first and the inode last,
+// so the file is whole on disk at every step; the old blocks are released
+// once the inode points away. A file cut short by the budget keeps its
+// place in fs->defragBlock, and the next call carries on right after the
+// blocks already moved. Returns blocks moved, 0 if the file was left alone.
+static ssize_t relocate(FileSystem *fs, size_t inumber, size_t budget) {
     Inode inode;
     Block indirect;
-    int read = 0;
-    int ogOffset = offset;
+    uint32_t blocks[POINTERS_PER_INODE + 1 + MAX_POINTERS_PER_BLOCK];
+    uint32_t start = fs->defragBlock;
 
-    // Insufficient size
-    if(length + offset > (POINTERS_PER_BLOCK + POINTERS_PER_INODE) * BLOCK_SIZE) {
+    DirtyFile *dirty = dirty_file(fs, inumber);
+    if (dirty && !flush_file(fs, dirty)) {
         return -1;
     }
+    fs->defragBlock = 0;
+    if (!find_inode(fs, inumber, &inode)) {
+        return 0;
+    }
 
-    // Load and validate inode and allocate if doesn't exist
-    if(!find_inode(fs, inumber, &inode)) {
-        inode.Valid = true;
-        inode.Size = length + offset;
-        for(uint32_t ii = 0; ii < POINTERS_PER_INODE; ii++) {
-            inode.Direct[ii] = 0;
-        }
-        inode.Indirect = 0;
-        fs->inodeTracker[inumber / INODES_PER_BLOCK]++;
-        fs->bitmap[inumber / INODES_PER_BLOCK + 1] = true;
+    uint32_t n = file_blocks(fs, &inode, &indirect, blocks);
+    if (start >= n || count_extents(blocks, n) <= 1) {
+        return 0;
     }
-    // Set node size
-    else {
-        inode.Size = max((int)inode.Size, length + (int)offset);
+    for (uint32_t i = 0; i < n; i++) {
+        if (fs->refcount[blocks[i]] > 1) {
+            return 0;
+        }
     }
 
-    // Offset is within direct pointers 
-    if(offset < POINTERS_PER_INODE * BLOCK_SIZE) {
-        // Calculate starting node for writing 
-        int dirNode = offset / BLOCK_SIZE;
-        offset %= BLOCK_SIZE;
-
-        // Allocates a block if one doesn't exist
-        if (!inode.Direct[dirNode]) {
-           inode.Direct[dirNode] = fs_allocate_block(fs);
-           if (!inode.Direct[dirNode]) {
-                inode.Size = read + ogOffset;
-                store_inode(fs, inumber, &inode);
-                return read;
-           }
-        }    
-
-        // Read from data buffer      
-        read_buffer(fs, offset, &read, length, data, inode.Direct[dirNode++]);
+    uint32_t limit = n - start > budget ? start + budget : n;
+    uint32_t count = limit - start;
+    uint32_t goal = start ? blocks[start - 1] + 1 : home_block(fs, inumber);
+    uint32_t run = count <= available_blocks(fs) ? find_run(fs, count, goal) : 0;
+    if (!run) {
+        return 0;
+    }
+    for (uint32_t i = run; i < run + count; i++) {
+        set_used(fs, i, true);
+        fs->refcount[i] = 1;
+    }
 
-        // Done reading from data buffer
-        if(read == length) {
-            store_inode(fs, inumber, &inode);
-            return length;
+    // Point a copy of the inode, and the indirect block, at the new run
+    Inode moved = inode;
+    uint32_t k = 0, indirectAt = n;
+    bool pointersMoved = false;
+    for (int i = 0; i < POINTERS_PER_INODE; i++) {
+        if (moved.Direct[i]) {
+            if (k >= start && k < limit) {
+                moved.Direct[i] = (run + k - start) | (moved.Direct[i] & ~POINTER_MASK);
+            }
+            k++;
         }
-        else {
-            // Writing into direct pointers 
-            for(int i = dirNode; i < (int)POINTERS_PER_INODE; i++) {
-                // Allocates a block if one doesn't exist
-                if (!inode.Direct[dirNode]) {
-                    inode.Direct[dirNode] = fs_allocate_block(fs);
-                    if (!inode.Direct[dirNode]) {
-                            inode.Size = read + ogOffset;
-                            store_inode(fs, inumber, &inode);
-                            return read;
-                    }
-                }   
-                // Read from data buffer 
-                read_buffer(fs, 0, &read, length, data, inode.Direct[dirNode++]);
-
-                // Done reading from data buffer
-                if(read == length) {
-                    store_inode(fs, inumber, &inode);
-                    return length;
+    }
+    if (moved.Indirect) {
+        indirectAt = k;
+        if (k >= start && k < limit) {
+            moved.Indirect = run + k - start;
+            cover_metadata(fs, moved.Indirect, 1, true);
+        }
+        k++;
+        for (uint32_t i = 0; i < fs->pointersPerBlock; i++) {
+            if (indirect.Pointers[i]) {
+                if (k >= start && k < limit) {
+                    indirect.Pointers[i] = (run + k - start) | (indirect.Pointers[i] & ~POINTER_MASK);
+                    pointersMoved = true;
                 }
+                k++;
             }
-
-            // Indirect node is valid 
-            if(inode.Indirect) {
-                disk_read(fs->disk, inode.Indirect, indirect.Data);
-            }
-            else {
-                // Allocates a block if one doesn't exist
-                if (!inode.Indirect) {
-                    inode.Indirect = fs_allocate_block(fs);
-                    if (!inode.Indirect) {
-                            inode.Size = read + ogOffset;
-                            store_inode(fs, inumber, &inode);
-                            return read;
-                    }
-                }   
-                disk_read(fs->disk, inode.Indirect, indirect.Data);
-
-                // Initialize the indirect pointers 
-                for(int i = 0; i < (int)POINTERS_PER_BLOCK; i++) {
-                    indirect.Pointers[i] = 0;
-                }
+        }
+    }
+    bool indirectMoved = moved.Indirect != inode.Indirect;
+
+    // Gather each chunk of the new run with one read per old extent and
+    // write it with one transfer
+    char *buffer = malloc((size_t)DEFRAG_CHUNK << fs->blockShift);
+    bool ok = true;
+    for (uint32_t first = start; ok && first < limit; first += DEFRAG_CHUNK) {
+        uint32_t chunk = min(DEFRAG_CHUNK, limit - first);
+        for (uint32_t i = first, j; ok && i < first + chunk; i = j) {
+            char *data = buffer + ((size_t)(i - first) << fs->blockShift);
+            j = i + 1;
+            if (i == indirectAt) {
+                memcpy(data, indirect.Data, fs->blockSize);
+                continue;
             }
-            
-            // Write into indirect pointers 
-            for(int j = 0; j < (int)POINTERS_PER_BLOCK; j++) {
-               // Allocates a block if one doesn't exist
-                if (!indirect.Pointers[j]) {
-                    indirect.Pointers[j] = fs_allocate_block(fs);
-                    if (!indirect.Pointers[j]) {
-                            inode.Size = read + ogOffset;
-                            disk_write(fs->disk, inode.Indirect, indirect.Data);
-                            store_inode(fs, inumber, &inode);
-                            return read;
-                    }
-                }  
-                
-                // Read from data buffer 
-                read_buffer(fs, 0, &read, length, data, indirect.Pointers[j]);
-
-                // Done reading from data buffer
-                if(read == length) {
-                    disk_write(fs->disk, inode.Indirect, indirect.Data);
-                    store_inode(fs, inumber, &inode);
-                    return length;
-                }
+            while (j < first + chunk && j != indirectAt && blocks[j] == blocks[j-1] + 1) {
+                j++;
             }
+            ok = disk_read_run(fs->disk, blocks[i], j - i, data);
+        }
+        if (!ok) {
+            break;
+        }
+        disk_write_run(fs->disk, run + first - start, chunk, buffer);
 
-            // No more space 
-            disk_write(fs->disk, inode.Indirect, indirect.Data);
-            store_inode(fs, inumber, &inode);
-            return read;
+        // The index follows data blocks to where they now live
+        for (uint32_t i = first; fs->dedup && i < first + chunk; i++) {
+            if (dedup_contains(fs->dedup, blocks[i])) {
+                char *data = buffer + ((size_t)(i - first) << fs->blockShift);
+                dedup_insert(fs->dedup, run + i - start, block_fingerprint(data, fs->blockSize));
+            }
         }
     }
-    // Offset begins in indirect blocks 
-    else {
-        // Calculate starting node for writing 
-        offset -= BLOCK_SIZE * POINTERS_PER_INODE;
-        int indirNode = offset / BLOCK_SIZE;
-        offset %= BLOCK_SIZE;
+    free(buffer);
 
-        // Indirect node is valid 
-        if(inode.Indirect) {
-            disk_read(fs->disk, inode.Indirect, indirect.Data);
+    // A block that fails verification is not copied under a good
+    // checksum: the file stays where it was, and the run is let go
+    if (!ok) {
+        if (indirectMoved) {
+            cover_metadata(fs, moved.Indirect, 1, false);
         }
-        else {
-           // Allocates a block if one doesn't exist
-            if (!inode.Indirect) {
-                inode.Indirect = fs_allocate_block(fs);
-                if (!inode.Indirect) {
-                        inode.Size = read + ogOffset;
-                        store_inode(fs, inumber, &inode);
-                        return read;
-                }
-            }  
-            
-            disk_read(fs->disk, inode.Indirect, indirect.Data);
-
-            // Initialize the indirect pointers 
-            for(int i = 0; i < (int)POINTERS_PER_BLOCK; i++) {
-                indirect.Pointers[i] = 0;
-            }
+        for (uint32_t i = run; i < run + count; i++) {
+            release_block(fs, i);
         }
+        disk_discard(fs->disk, run, count);
+        return 0;
+    }
 
-        // Allocates a block if one doesn't exist
-        if (!indirect.Pointers[indirNode]) {
-            indirect.Pointers[indirNode] = fs_allocate_block(fs);
-            if (!indirect.Pointers[indirNode]) {
-                    inode.Size = read + ogOffset;
-                    disk_write(fs->disk, inode.Indirect, indirect.Data);
-                    store_inode(fs, inumber, &inode);
-                    return read;
-            }
-        }  
+    // An indirect block moved by an earlier call is updated where it is
+    if (pointersMoved && !indirectMoved) {
+        disk_write(fs->disk, moved.Indirect, indirect.Data);
+    }
+    store_inode(fs, inumber, &moved);
+
+    if (indirectMoved) {
+        cover_metadata(fs, inode.Indirect, 1, false);
+    }
+    for (uint32_t i = start; i < limit; i++) {
+        release_block(fs, blocks[i]);
+    }
+    discard_blocks(fs, blocks + start, count);
 
-        // Read from data buffer 
-        read_buffer(fs, offset, &read, length, data, indirect.Pointers[indirNode++]);
+    if (limit < n) {
+        fs->defragBlock = limit;
+    }
+    return count;
+}
 
-        // Done reading from data buffer
-        if(read == length) {
-            disk_write(fs->disk, inode.Indirect, indirect.Data);
-            store_inode(fs, inumber, &inode);
-            return length;
-        }
-        // Write into indirect nodes 
-        else {
-            for(int j = indirNode; j < (int)POINTERS_PER_BLOCK; j++) {
-                // Allocates a block if one doesn't exist
-                if (!indirect.Pointers[j]) {
-                    indirect.Pointers[j] = fs_allocate_block(fs);
-                    if (!indirect.Pointers[j]) {
-                        inode.Size = read + ogOffset;
-                        disk_write(fs->disk, inode.Indirect, indirect.Data);
-                        store_inode(fs, inumber, &inode);
-                        return read;
-                    }
-                }  
+// Relocate fragmented files from where the last call stopped, until
+// budget blocks have moved or the pass reaches the end of the inode table
+ssize_t fs_defrag(FileSystem *fs, size_t budget) {
+    SuperBlock *sb = &fs->metadata;
+    size_t moved = 0;
+
+    if (!disk_mounted(fs->disk) || fs->readonly) {
+        return -1;
+    }
 
-                // Read from data buffer 
-                read_buffer(fs, 0, &read, length, data, indirect.Pointers[j]);
+    while (fs->defragNext < sb->Inodes && moved < budget) {
+        // Table blocks with no inodes in use are passed over whole
+        if (!fs->inodeTracker[inode_block(sb, fs->defragNext) - 1]) {
+            fs->defragNext = (fs->defragNext / inodes_per_block(sb) + 1) * inodes_per_block(sb);
+            continue;
+        }
 
-                // Done reading from data buffer 
-                if(read == length) {
-                    disk_write(fs->disk, inode.Indirect, indirect.Data);
-                    store_inode(fs, inumber, &inode);
-                    return length;
-                }
-            }
+        ssize_t n = relocate(fs, fs->defragNext, budget - moved);
+        if (n < 0) {
+            return -1;
+        }
+        moved += n;
 
-            // No more space
-            disk_write(fs->disk, inode.Indirect, indirect.Data);
-            store_inode(fs, inumber, &inode);
-            return read;
+        // A file the budget cut short is picked up again next time
+        if (!fs->defragBlock) {
+            fs->defragNext++;
         }
     }
 
-    // returns an error
-    return -1;
+    if (fs->defragNext >= sb->Inodes) {
+        fs->defragNext = 0;
+    }
+    return moved;
 }
@@ -9,54 +9,178 @@
 #include <stdbool.h>
 
 #define MAGIC_NUMBER 0xf0f03410
-#define INODES_PER_BLOCK 128
 #define POINTERS_PER_INODE 5
-#define POINTERS_PER_BLOCK 1024
+#define MAX_POINTERS_PER_BLOCK (MAX_BLOCK_SIZE / sizeof(uint32_t))
+
+#define INODE_VALID  0x1        // Inode.Valid: inode is in use
+#define INODE_INLINE 0x2        // Inode.Valid: file data lives in the inode record
+#define INODE_DIR    0x4        // Inode.Valid: file holds directory buckets
+#define INODE_COMPRESSED 0x8    // Inode.Valid: data stored in compressed clusters
+
+#define FEATURE_INLINE 0x1      // SuperBlock.Features: inline small-file data
+#define FEATURE_COMPRESS 0x2    // SuperBlock.Features: compress new files
+#define FEATURE_DEDUP 0x4       // SuperBlock.Features: share identical data blocks
+#define FEATURE_CHECKSUM 0x8    // SuperBlock.Features: checksum inode and indirect blocks
+#define FEATURE_CHECKSUM_DATA 0x10  // SuperBlock.Features: checksum data blocks too
+
+#define CLUSTER_BLOCKS 4                            // File blocks per compressed cluster
+#define POINTER_COMPRESSED 0x80000000               // First slot of a packed cluster
+#define POINTER_MASK 0x7fffffff
+
+#define MAX_SNAPSHOTS 16        // Snapshot slots in the superblock
+#define MAX_EXTENTS 8           // Inode-table extents added by fs_resize
+#define GROUP_BLOCKS 4096       // Blocks per allocation group
+
+typedef struct
+{
+    uint32_t Table;       // First block of the frozen inode table, 0 if slot unused
+    uint32_t Root;        // Root directory (inumber + 1) when the snapshot was taken
+    uint32_t InodeBlocks; // Length of the frozen inode table
+} Snapshot;
+
+typedef struct
+{
+    uint32_t Start;       // First block of the extent
+    uint32_t Count;       // Blocks in the extent, 0 if slot unused
+} Extent;
 
 typedef struct
 {                         // Superblock structure
     uint32_t MagicNumber; // File system magic number
     uint32_t Blocks;      // Number of blocks in file system
-    uint32_t InodeBlocks; // Number of blocks reserved for inodes
+    uint32_t InodeBlocks; // Number of blocks reserved for inodes, all extents
     uint32_t Inodes;      // Number of inodes in file system
+    uint32_t InodeSize;   // Bytes per on-disk inode record (0: sizeof(Inode))
+    uint32_t Features;    // FEATURE_* flags selected at format time
+    uint32_t Root;        // Root directory inumber + 1, 0 until first mkdir
+    uint32_t Checksums;   // First block of the checksum table, 0 if none
+    Snapshot Snapshots[MAX_SNAPSHOTS];
+    Extent Extents[MAX_EXTENTS];    // Inode table past the blocks following block 0
+    uint32_t BlockSize;   // Bytes per block (0: BLOCK_SIZE)
+    uint32_t InodeRatio;  // Bytes of disk per inode (0: a tenth of the blocks hold inodes)
 } SuperBlock;
 
 typedef struct
 {
-    uint32_t Valid;                      // Whether or not inode is valid
+    uint32_t Valid;                      // INODE_* flags, zero if inode is free
     uint32_t Size;                       // Size of file
     uint32_t Direct[POINTERS_PER_INODE]; // Direct pointers
     uint32_t Indirect;                   // Indirect pointer
-} Inode;
+} Inode;                                 // Inline data overlays Direct onwards
 
 typedef union
-{
-    SuperBlock Super;                      // Superblock
-    Inode Inodes[INODES_PER_BLOCK];        // Inode block
-    uint32_t Pointers[POINTERS_PER_BLOCK]; // Pointer block
-    char Data[BLOCK_SIZE];                 // Data block
+{                                          // Sized for the largest block; I/O
+    SuperBlock Super;                      // only touches the first BlockSize bytes
+    Inode Inodes[MAX_BLOCK_SIZE / sizeof(Inode)];   // Inode block
+    uint32_t Pointers[MAX_POINTERS_PER_BLOCK];      // Pointer block
+    char Data[MAX_BLOCK_SIZE];             // Data block
 } Block;
 
+#define READAHEAD_STREAMS 64     // Sequential streams tracked at once
+#define READAHEAD_MIN 4          // Initial read-ahead window in blocks
+#define READAHEAD_MAX 64         // Largest read-ahead window in blocks
+
+typedef struct
+{
+    uint32_t Inumber;     // Inode being streamed, + 1 (0: slot unused)
+    uint32_t Next;        // File block a sequential read starts at
+    uint32_t Ahead;       // First file block not yet prefetched
+    uint32_t Window;      // Blocks to keep ahead, 0 after a random read
+} ReadAhead;
+
+#define DELALLOC_FILES 64        // Files that can hold buffered writes at once
+
+typedef struct
+{
+    uint32_t Inumber;     // Buffered inode, + 1 (0: slot unused)
+    uint32_t Size;        // File size counting the buffered writes
+    char **Blocks;        // Per file block: buffered contents, NULL if clean
+    uint32_t Reserved;    // Free blocks held back so the flush cannot run out
+} DirtyFile;
+
 typedef struct
 {
     Disk *disk;
     bool *bitmap;
+    uint32_t *refcount;     // Pointers to each block, rebuilt at mount
+    uint32_t *groupFree;    // Free blocks per allocation group, rebuilt at mount
+    uint32_t groups;        // Allocation groups, the last one may be short
     int  *inodeTracker;
     SuperBlock metadata;
+    uint32_t blockSize;     // Bytes per block, from the superblock
+    uint32_t blockShift;    // log2(blockSize)
+    uint32_t pointersPerBlock;
+    uint32_t inodeTable;    // First block of a mounted snapshot's table, 0 if live
+    bool readonly;          // Mounted from a snapshot
+    struct Dentry *dcache;  // Name lookup cache, see dir.h
+    struct DedupIndex *dedup;   // Fingerprint index, NULL unless FEATURE_DEDUP
+    ReadAhead readahead[READAHEAD_STREAMS];
+    DirtyFile *dirty;       // DELALLOC_FILES slots, NULL unless allocation is delayed
+    size_t dirtyBytes;      // Data buffered across all slots
+    size_t dirtyLimit;      // dirtyBytes that forces a sync
+    uint32_t reserved;      // Reserved blocks across all slots
+    uint32_t allocGoal;     // Next block to try first, 0 for the first group with room
+    uint32_t defragNext;    // Inode fs_defrag resumes at, 0 when a pass is complete
+    uint32_t defragBlock;   // Blocks of inode defragNext already moved, 0 between files
+    struct {
+        uint32_t Inumber;   // Inode of the cached cluster, + 1 (0: empty)
+        uint32_t Index;     // Cluster number within the file
+        char *Data;         // Decompressed cluster
+        char *Packed;       // Scratch for a cluster's packed blocks
+    } cluster;
 
 } FileSystem;
 
+typedef struct
+{
+    uint32_t InodeSize;   // Inode record size, 0 for classic 32-byte inodes
+    uint32_t Features;    // FEATURE_* flags
+    uint32_t BlockSize;   // Power of two from MIN_BLOCK_SIZE to MAX_BLOCK_SIZE, 0 for BLOCK_SIZE
+    uint32_t InodeRatio;  // Bytes of disk per inode, 0 for a tenth of the blocks
+} FormatOptions;
+
 void fs_debug(Disk *disk);
 bool fs_format(Disk *disk);
+bool fs_format_with(Disk *disk, const FormatOptions *opts);
 
 FileSystem *new_fs();
 void free_fs(FileSystem *fs);
 
 bool fs_mount(FileSystem *fs, Disk *disk);
+bool fs_mount_snapshot(FileSystem *fs, Disk *disk, size_t id);
+bool fs_resize(FileSystem *fs, size_t blocks);
+bool fs_set_delalloc(FileSystem *fs, size_t limit);
+bool fs_sync(FileSystem *fs);
+
+ssize_t fs_snapshot(FileSystem *fs);
+bool fs_snapshot_delete(FileSystem *fs, size_t id);
 
 ssize_t fs_create(FileSystem *fs);
+// Files only; names for the inode stay, so a named file goes with fs_unlink
 bool fs_remove(FileSystem *fs, size_t inumber);
 ssize_t fs_stat(FileSystem *fs, size_t inumber);
+ssize_t fs_blocks(FileSystem *fs, size_t inumber);
+ssize_t fs_extents(FileSystem *fs, size_t inumber);
+ssize_t fs_defrag(FileSystem *fs, size_t budget);
+
+// Batch variants of fs_create, fs_remove and fs_stat that read and write
+// each inode-table block once per batch. fs_create_many stores up to count
+// new inumbers; fs_stat_many sets each size, -1 for an inode not in use.
+// Each returns how many inodes it created, removed or found.
+ssize_t fs_create_many(FileSystem *fs, size_t *inumbers, size_t count);
+ssize_t fs_remove_many(FileSystem *fs, const size_t *inumbers, size_t count);
+ssize_t fs_stat_many(FileSystem *fs, const size_t *inumbers, size_t count, ssize_t *sizes);
 
 ssize_t fs_read(FileSystem *fs, size_t inumber, char *data, int length, size_t offset);
+// fs_read for bulk copies: blocks it reads are not kept in the block cache
+ssize_t fs_read_uncached(FileSystem *fs, size_t inumber, char *data, int length, size_t offset);
 ssize_t fs_write(FileSystem *fs, size_t inumber, char *data, size_t length, size_t offset);
+bool fs_truncate(FileSystem *fs, size_t inumber, size_t size);
+bool fs_fallocate(FileSystem *fs, size_t inumber, size_t offset, size_t length);
+bool fs_copy(FileSystem *fs, size_t src, size_t dst);
+
+// Helpers shared by the fs modules
+bool find_inode(FileSystem *fs, size_t inumber, Inode *inode);
+bool store_inode(FileSystem *fs, size_t inumber, Inode *inode);
+bool remove_inode(FileSystem *fs, size_t inumber);
+void store_super(FileSystem *fs);
@@ -0,0 +1,186 @@
+#include "lz.h"
+
+#include <stdint.h>
+#include <string.h>
+
+// Sequences are a token (literal length << 4 | match length - 4), the
+// literals, a little-endian 16-bit match offset and length extension bytes.
+// As in LZ4, the last 5 bytes are always literals and no match starts in
+// the last 12.
+
+#define HASH_BITS 12
+#define MIN_MATCH 4
+#define LAST_LITERALS 5
+#define MF_LIMIT 12
+#define MAX_OFFSET 65535
+
+static inline uint32_t read32(const uint8_t *p) {
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static inline uint32_t hash4(uint32_t v) {
+    return (v * 2654435761u) >> (32 - HASH_BITS);
+}
+
+// Append a length extension: runs of 255 then the remainder
+static inline uint8_t *put_length(uint8_t *op, int length) {
+    for (; length >= 255; length -= 255) {
+        *op++ = 255;
+    }
+    *op++ = length;
+    return op;
+}
+
+int lz_compress(const char *src, int srclen, char *dst, int dstcap) {
+    const uint8_t *base = (const uint8_t *)src;
+    const uint8_t *ip = base;
+    const uint8_t *anchor = base;
+    const uint8_t *end = base + srclen;
+    uint8_t *op = (uint8_t *)dst;
+    uint8_t *oend = op + dstcap;
+    int table[1 << HASH_BITS] = {0};
+
+    if (srclen > MF_LIMIT) {
+        const uint8_t *mflimit = end - MF_LIMIT;
+        const uint8_t *matchlimit = end - LAST_LITERALS;
+
+        ip++;
+        while (ip < mflimit) {
+            uint32_t h = hash4(read32(ip));
+            const uint8_t *ref = base + table[h];
+            table[h] = ip - base;
+
+            if (ref >= ip || ip - ref > MAX_OFFSET || read32(ref) != read32(ip)) {
+                // Step faster through data that keeps missing
+                ip += 1 + ((ip - anchor) >> 6);
+                continue;
+            }
+
+            const uint8_t *mp = ip + MIN_MATCH;
+            const uint8_t *rp = ref + MIN_MATCH;
+            while (mp < matchlimit && *mp == *rp) {
+                mp++;
+                rp++;
+            }
+
+            int litlen = ip - anchor;
+            int mlen = mp - ip - MIN_MATCH;
+            if (op + 1 + litlen + litlen / 255 + 1 + 2 + mlen / 255 + 1 > oend) {
+                return 0;
+            }
+
+            uint8_t *token = op++;
+            *token = (litlen >= 15 ? 15 : litlen) << 4 | (mlen >= 15 ? 15 : mlen);
+            if (litlen >= 15) {
+                op = put_length(op, litlen - 15);
+            }
+            memcpy(op, anchor, litlen);
+            op += litlen;
+
+            uint16_t offset = ip - ref;
+            *op++ = offset & 0xff;
+            *op++ = offset >> 8;
+            if (mlen >= 15) {
+                op = put_length(op, mlen - 15);
+            }
+
+            ip = anchor = mp;
+        }
+    }
+
+    // Final literal-only sequence
+    int litlen = end - anchor;
+    if (op + 1 + litlen + litlen / 255 + 1 > oend) {
+        return 0;
+    }
+    *op++ = (litlen >= 15 ? 15 : litlen) << 4;
+    if (litlen >= 15) {
+        op = put_length(op, litlen - 15);
+    }
+    memcpy(op, anchor, litlen);
+    op += litlen;
+
+    return op - (uint8_t *)dst;
+}
+
+// Read a length extension, -1 if it runs off the input
+static inline int get_length(const uint8_t **ip, const uint8_t *iend) {
+    int length = 0;
+    uint8_t b;
+    do {
+        if (*ip >= iend) {
+            return -1;
+        }
+        b = *(*ip)++;
+        length += b;
+    } while (b == 255);
+    return length;
+}
+
+int lz_decompress(const char *src, int srclen, char *dst, int dstcap) {
+    const uint8_t *ip = (const uint8_t *)src;
+    const uint8_t *iend = ip + srclen;
+    uint8_t *op = (uint8_t *)dst;
+    uint8_t *oend = op + dstcap;
+
+    while (ip < iend) {
+        uint8_t token = *ip++;
+
+        int litlen = token >> 4;
+        if (litlen == 15) {
+            int extra = get_length(&ip, iend);
+            if (extra < 0) {
+                return -1;
+            }
+            litlen += extra;
+        }
+        if (litlen > iend - ip || litlen > oend - op) {
+            return -1;
+        }
+        memcpy(op, ip, litlen);
+        op += litlen;
+        ip += litlen;
+
+        // The last sequence carries literals only
+        if (ip == iend) {
+            break;
+        }
+
+        if (iend - ip < 2) {
+            return -1;
+        }
+        int offset = ip[0] | ip[1] << 8;
+        ip += 2;
+        if (offset == 0 || offset > op - (uint8_t *)dst) {
+            return -1;
+        }
+
+        int mlen = token & 15;
+        if (mlen == 15) {
+            int extra = get_length(&ip, iend);
+            if (extra < 0) {
+                return -1;
+            }
+            mlen += extra;
+        }
+        mlen += MIN_MATCH;
+        if (mlen > oend - op) {
+            return -1;
+        }
+
+        // Copy 8 bytes at a time unless the match overlaps within a word
+        const uint8_t *ref = op - offset;
+        if (offset >= 8) {
+            for (; mlen >= 8; mlen -= 8, op += 8, ref += 8) {
+                memcpy(op, ref, 8);
+            }
+        }
+        while (mlen--) {
+            *op++ = *ref++;
+        }
+    }
+
+    return op - (uint8_t *)dst;
+}
@@ -0,0 +1,19 @@
+// lz.h: LZ4 block format codec
+
+#pragma once
+
+// Compress src into dst
+// @param	src	    Input buffer
+// @param	srclen	    Input length
+// @param	dst	    Output buffer
+// @param	dstcap	    Output capacity
+// @return	compressed length, 0 if it does not fit in dstcap
+int lz_compress(const char *src, int srclen, char *dst, int dstcap);
+
+// Decompress src into dst
+// @param	src	    Compressed buffer
+// @param	srclen	    Compressed length
+// @param	dst	    Output buffer
+// @param	dstcap	    Output capacity
+// @return	decompressed length, -1 if the input is malformed
+int lz_decompress(const char *src, int srclen, char *dst, int dstcap);
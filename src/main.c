@@ -9,92 +9,146 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <assert.h>
+#include <ctype.h>
 #include <unistd.h>
 #include <string.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <dirent.h>
+#include <errno.h>
+#include <limits.h>
+#include <pthread.h>
+#include <time.h>
 
 #include "fs.h"
+#include "dir.h"
 #include "disk.h"
+#include "array.h"
 
 #define W_BLK		0
 #define W_NONBLK	1
 
 #define DISK_BLK_SIZE	4096
+#define CACHE_BLOCKS	1024
+#define STRIPE_KB	64	/* default stripe unit of a disk array */
+#define DELALLOC_MB	16	/* buffered writes that force a sync */
+#define DEFRAG_SLICE	256	/* blocks moved per locked defrag step */
 
 #define ERR_EMPTY_CMD	-999
 
+#define min(a,b) (((a) < (b)) ? (a) : (b))
+#define max(a,b) (((a) > (b)) ? (a) : (b))
+
+#define MAX_ARGS	256
+#define CMD_HASH_SIZE	64
+#define MAX_WORKERS	8
+
 const char MSG_ERROR[30] = "An error has occurred\n";
-const int FUNC_COUNT = 12;
-const char * FUNC_MAP[] = {
-    "format",
-    "mount",
-    "debug",
-    "create",
-    "remove <inode>",
-    "cat <inode>",
-    "stat <inode>",
-    "copyin <file> <inode>",
-    "copyout <inode> <file>",
-    "help",
-    "quit",
-    "exit"
-};
 
 struct job {
 	int argc;
-	char *argv[256];
+	char *argv[MAX_ARGS];
 };
 
 struct fs {
 	Disk *disk;
 	FileSystem *fs;
+	int batch;		/* non-interactive: no prompt, buffered stdout */
+	char *iobuf;		/* copy buffer shared by consecutive copy cmds */
+	size_t iobuf_sz;
+	pthread_mutex_t lock;	/* serializes fs_* calls from pool workers */
 };
 
-int parse_line(char *line, int len, struct job *job);
+/* One host file <-> inode transfer handled by the worker pool */
+struct xfer {
+	char name[256];
+	ssize_t inode;
+	ssize_t bytes;
+	int failed;
+};
 
-int func_format(struct fs *f);
-int func_mount(struct fs *f);
+struct pool {
+	struct fs *f;
+	const char *dir;
+	struct xfer *xfers;
+	int nxfers;
+	int next;		/* next unclaimed xfer, advanced atomically */
+};
+
+/* Shell command table entry */
+struct command {
+	const char *name;
+	const char *usage;
+	int argc;		/* expected argc including the name, -1 = any */
+	int (*func)(struct fs *f, struct job *job);
+};
+
+int parse_line(char *line, int len, struct job *job);
+int open_disk(struct fs *f, char *spec, int nblocks);
+
+int parse_format_opts(struct job *job, FormatOptions *opts);
+int func_format(struct fs *f, struct job *job);
+int func_mount(struct fs *f, struct job *job);
+int func_snapshot(struct fs *f, struct job *job);
+int func_resize(struct fs *f, char *blocks);
+int func_sync(struct fs *f);
+int func_defrag(struct fs *f, struct job *job);
 int func_debug(struct fs *f);
-int func_create(struct fs *f);
-int func_remove(struct fs *f, ssize_t inode);
+int func_create(struct fs *f, struct job *job);
+int func_remove(struct fs *f, struct job *job);
 int func_cat(struct fs *f, ssize_t inode);
-int func_stat(struct fs *f, ssize_t inode);
+int func_stat(struct fs *f, struct job *job);
+int func_truncate(struct fs *f, ssize_t inode, char *size);
+int func_fallocate(struct fs *f, ssize_t inode, char *offset, char *length);
+int func_cp(struct fs *f, char *from, char *to);
 int func_copyin(struct fs *f, char * file, ssize_t inode);
 bool func_copyout(struct fs *f, ssize_t inode, char * file);
+int copyout_stream(struct fs *f, ssize_t inode, FILE *fp);
+int func_importdir(struct fs *f, char *dir);
+int func_exportall(struct fs *f, char *dir);
+int func_mkdir(struct fs *f, char *path);
+int func_unlink(struct fs *f, char *path);
+int func_ls(struct fs *f, char *path);
+ssize_t resolve_inode(struct fs *f, const char *arg, bool create);
 int func_exit(struct fs *f, struct job *job);
 int func_help();
 int clean_up(struct fs *f, struct job *job);
 int internal_func(struct fs *f, struct job *job);
+void cmd_table_init();
+const struct command *cmd_lookup(const char *name);
+
+extern const struct command COMMANDS[];
+
+/* Whether a buffer is all zero bytes */
+static inline bool
+is_zero(const char *data, size_t length)
+{
+	return (data[0] == 0 && memcmp(data, data + 1, length - 1) == 0);
+}
 
 int 
 parse_line(char *line, int len, struct job *job)
 {
-	int rt = 0, argc = 0;
-	int p_len;
-	char *arg;
+	int rt = 0;
+	char *arg = NULL;
 
-	p_len = 0;
-	arg = (char *)calloc(256, sizeof(char));
+	/* Split in place: arguments point into the line buffer */
 	for (int i=0;i<len;i++) {
-		if (line[i] == ' ' || line[i] == '\n' || i == len-1) {
-			if (p_len == 0) {
-				continue;
-			}
-		
-			// insert the curr arg to the proc arg list
-			arg[p_len] = '\0';
-			job->argv[job->argc++] = arg;
-
-			// reset curr arg
-			p_len = 0;
-			arg = (char *)calloc(256, sizeof(char));
-			argc++;
+		if (line[i] == ' ' || line[i] == '\t' || line[i] == '\n' ||
+		    line[i] == '\r') {
+			line[i] = '\0';
+			arg = NULL;
 			continue;
 		}
 
-		// append curr char to the end of curr arg
-		arg[p_len++] = line[i];
+		if (arg == NULL) {
+			if (job->argc >= MAX_ARGS - 1) {
+				rt = -1;
+				break;
+			}
+			arg = &line[i];
+			job->argv[job->argc++] = arg;
+		}
 	}
 
 	if (job->argc < 1) {
@@ -102,40 +156,218 @@ parse_line(char *line, int len, struct job *job)
 		goto done;
 	}
 
+done:
 	// set the last arg to NULL
 	job->argv[job->argc] = NULL;
-done:
-	free(line);
 	return (rt);
 }
 
+/*
+ * Parse "format" options: inline[=<inode size>] compress dedup checksum[=data]
+ * blocksize=<bytes> ratio=<bytes per inode>
+ */
+int
+parse_format_opts(struct job *job, FormatOptions *opts)
+{
+	opts->InodeSize = 0;
+	opts->Features = 0;
+	opts->BlockSize = 0;
+	opts->InodeRatio = 0;
+
+	for (int i=1;i<job->argc;i++) {
+		char *arg = job->argv[i];
+
+		if (strcmp(arg, "inline") == 0) {
+			opts->Features |= FEATURE_INLINE;
+			opts->InodeSize = 256;
+		} else if (strncmp(arg, "inline=", 7) == 0) {
+			opts->Features |= FEATURE_INLINE;
+			opts->InodeSize = atoi(arg + 7);
+		} else if (strcmp(arg, "compress") == 0) {
+			opts->Features |= FEATURE_COMPRESS;
+		} else if (strcmp(arg, "dedup") == 0) {
+			opts->Features |= FEATURE_DEDUP;
+		} else if (strcmp(arg, "checksum") == 0) {
+			opts->Features |= FEATURE_CHECKSUM;
+		} else if (strcmp(arg, "checksum=data") == 0) {
+			opts->Features |= FEATURE_CHECKSUM_DATA;
+		} else if (strncmp(arg, "blocksize=", 10) == 0) {
+			opts->BlockSize = atoi(arg + 10);
+		} else if (strncmp(arg, "ratio=", 6) == 0) {
+			opts->InodeRatio = atoi(arg + 6);
+		} else {
+			return (-1);
+		}
+	}
+	return (0);
+}
+
 int 
-func_format(struct fs *f)
+func_format(struct fs *f, struct job *job)
 {
 	int rt;
+	FormatOptions opts;
+
+	if (parse_format_opts(job, &opts))
+		return (-1);
 
-	rt = fs_format(f->disk);
+	rt = fs_format_with(f->disk, &opts);
 	if (!rt)
 		fprintf(stdout, "format failed!\n");
 	else
 		fprintf(stdout, "disk formatted.\n");
 	
-	fflush(stdout);
 	return (0);
 }
 
 int
-func_mount(struct fs *f)
+func_mount(struct fs *f, struct job *job)
 {
 	int rt;
 
-	rt = fs_mount(f->fs, f->disk);
+	int delalloc;
+
+	if (job->argc > 2) {
+		fprintf(stdout, "usage: mount [<snapshot>|delalloc]\n");
+		return (-1);
+	}
+
+	/* delalloc buffers writes until sync instead of mounting a snapshot */
+	delalloc = job->argc == 2 && strcmp(job->argv[1], "delalloc") == 0;
+
+	if (job->argc == 2 && !delalloc)
+		rt = fs_mount_snapshot(f->fs, f->disk, atoi(job->argv[1]));
+	else
+		rt = fs_mount(f->fs, f->disk);
+	if (rt && delalloc)
+		rt = fs_set_delalloc(f->fs, (size_t)DELALLOC_MB << 20);
 	if (!rt) 
 		fprintf(stdout, "mount failed!\n");
+	else if (delalloc)
+		fprintf(stdout, "disk mounted with delayed allocation.\n");
+	else if (job->argc == 2)
+		fprintf(stdout, "snapshot %s mounted read-only.\n", job->argv[1]);
 	else
 		fprintf(stdout, "disk mounted.\n");
 
-	fflush(stdout);
+	return (0);
+}
+
+int
+func_snapshot(struct fs *f, struct job *job)
+{
+	ssize_t id;
+
+	if (job->argc == 3 && strcmp(job->argv[1], "delete") == 0) {
+		if (fs_snapshot_delete(f->fs, atoi(job->argv[2])))
+			fprintf(stdout, "deleted snapshot %s.\n", job->argv[2]);
+		else
+			fprintf(stdout, "snapshot delete failed!\n");
+		return (0);
+	}
+
+	if (job->argc != 1) {
+		fprintf(stdout, "usage: snapshot [delete <snapshot>]\n");
+		return (-1);
+	}
+
+	id = fs_snapshot(f->fs);
+	if (id >= 0)
+		fprintf(stdout, "created snapshot %ld.\n", id);
+	else
+		fprintf(stdout, "snapshot failed!\n");
+
+	return (0);
+}
+
+int
+func_resize(struct fs *f, char *blocks)
+{
+	if (fs_resize(f->fs, strtoul(blocks, NULL, 10)))
+		fprintf(stdout, "disk resized to %s blocks.\n", blocks);
+	else
+		fprintf(stdout, "resize failed!\n");
+
+	return (0);
+}
+
+int
+func_sync(struct fs *f)
+{
+	if (fs_sync(f->fs))
+		fprintf(stdout, "disk synced.\n");
+	else
+		fprintf(stdout, "sync failed!\n");
+
+	return (0);
+}
+
+/* Extents summed over every file in use; the file count goes in files */
+static size_t
+total_extents(struct fs *f, size_t *files)
+{
+	size_t total = 0;
+
+	*files = 0;
+	for (size_t i=0;i<f->fs->metadata.Inodes;i++) {
+		ssize_t extents = fs_extents(f->fs, i);
+		if (extents < 0)
+			continue;
+		total += extents;
+		(*files)++;
+	}
+	return (total);
+}
+
+/*
+ * defrag [<blocks>] [<seconds>]
+ * Move fragmented files into contiguous runs, one slice at a time so pool
+ * workers get the lock in between. Stops at the end of a pass over the
+ * inode table, or once the block or time budget (0: none) is used up;
+ * the next defrag carries on from there.
+ */
+int
+func_defrag(struct fs *f, struct job *job)
+{
+	size_t budget = job->argc > 1 ? strtoul(job->argv[1], NULL, 10) : 0;
+	double seconds = job->argc > 2 ? strtod(job->argv[2], NULL) : 0;
+	size_t moved = 0, files, before, after;
+	struct timespec start, now;
+	double elapsed;
+
+	if (job->argc > 3) {
+		fprintf(stdout, "usage: defrag [<blocks>] [<seconds>]\n");
+		return (-1);
+	}
+
+	if (f->fs->disk == NULL || !disk_mounted(f->fs->disk)) {
+		fprintf(stdout, "defrag failed!\n");
+		return (0);
+	}
+
+	before = total_extents(f, &files);
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	do {
+		size_t slice = budget ? min(DEFRAG_SLICE, budget - moved) : DEFRAG_SLICE;
+
+		pthread_mutex_lock(&f->lock);
+		ssize_t n = fs_defrag(f->fs, slice);
+		pthread_mutex_unlock(&f->lock);
+		if (n < 0) {
+			fprintf(stdout, "defrag failed!\n");
+			return (0);
+		}
+		moved += n;
+
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		elapsed = (now.tv_sec - start.tv_sec) + (now.tv_nsec - start.tv_nsec) / 1e9;
+	} while ((f->fs->defragNext || f->fs->defragBlock) && (!budget || moved < budget) &&
+	    (!seconds || elapsed < seconds));
+	after = total_extents(f, &files);
+
+	fprintf(stdout, "%lu blocks moved, %lu files went from %lu to %lu extents%s.\n",
+	    moved, files, before, after, f->fs->defragNext || f->fs->defragBlock ?
+	    " (pass not finished)" : "");
 	return (0);
 }
 
@@ -146,31 +378,144 @@ func_debug(struct fs *f)
 	return (0);
 }
 
+/*
+ * Inodes named by <inode> and <first>-<last> arguments, and by paths when
+ * paths is set, in order; returns how many, in a malloc'd array, or -1
+ * (with nothing allocated) for an argument that is none of these. A range
+ * stops at the last inode.
+ */
+static ssize_t
+parse_inodes(struct fs *f, struct job *job, bool paths, size_t **inodes)
+{
+	size_t count = 0, cap = 16;
+	int i;
+
+	*inodes = malloc(cap * sizeof(size_t));
+	for (i=1;i<job->argc;i++) {
+		char *arg = job->argv[i], *end;
+		size_t first, last;
+
+		if (!isdigit((unsigned char)arg[0])) {
+			ssize_t inode = paths ? resolve_inode(f, arg, false) : -1;
+			if (inode < 0)
+				goto bad;
+			first = last = inode;
+		} else {
+			errno = 0;
+			first = last = strtoul(arg, &end, 10);
+			if (*end == '-' && isdigit((unsigned char)end[1])) {
+				last = strtoul(end + 1, &end, 10);
+				if (last >= f->fs->metadata.Inodes)
+					last = max(f->fs->metadata.Inodes, first + 1) - 1;
+			}
+			if (*end != '\0' || errno)
+				goto bad;
+		}
+		for (size_t inode = first; inode <= last && inode >= first; inode++) {
+			if (count == cap) {
+				cap *= 2;
+				*inodes = realloc(*inodes, cap * sizeof(size_t));
+			}
+			(*inodes)[count++] = inode;
+		}
+	}
+	return (count);
+
+bad:
+	fprintf(stdout, "%s: not an inode%s.\n", job->argv[i], paths ? " or path" : "");
+	free(*inodes);
+	*inodes = NULL;
+	return (-1);
+}
+
+/* Print inodes as runs: "3-7 9 12-13" */
+static void
+print_inodes(size_t *inodes, size_t count)
+{
+	for (size_t i=0;i<count;) {
+		size_t j = i;
+		while (j + 1 < count && inodes[j + 1] == inodes[j] + 1)
+			j++;
+		if (j > i)
+			fprintf(stdout, " %lu-%lu", inodes[i], inodes[j]);
+		else
+			fprintf(stdout, " %lu", inodes[i]);
+		i = j + 1;
+	}
+}
+
+/*
+ * create [<count>]
+ * More than one inode is created as a batch, one write per table block.
+ */
 int
-func_create(struct fs *f)
+func_create(struct fs *f, struct job *job)
 {
-	ssize_t inode = fs_create(f->fs);
-	if (inode >= 0)
-		fprintf(stdout, "created inode %ld.\n", inode);
-	else
+	size_t count = job->argc > 1 ? strtoul(job->argv[1], NULL, 10) : 1;
+	size_t *inodes;
+	ssize_t n;
+
+	if (job->argc > 2) {
+		fprintf(stdout, "usage: create [<count>]\n");
+		return (-1);
+	}
+
+	if (count == 1) {
+		ssize_t inode = fs_create(f->fs);
+		if (inode >= 0)
+			fprintf(stdout, "created inode %ld.\n", inode);
+		else
+			fprintf(stdout, "create failed!\n");
+		return (0);
+	}
+
+	inodes = malloc(count * sizeof(size_t) + 1);
+	n = fs_create_many(f->fs, inodes, count);
+	if (n > 0) {
+		fprintf(stdout, "created %ld inodes:", n);
+		print_inodes(inodes, n);
+		fprintf(stdout, ".\n");
+	}
+	if (n < (ssize_t)count)
 		fprintf(stdout, "create failed!\n");
-		
-	fflush(stdout);
+
+	free(inodes);
 	return (0);
 }
 
+/*
+ * remove <inode>[-<inode>]...
+ * Several inodes are removed as a batch, one write per table block. Only
+ * files go; directories, and names for the files, are left to rm.
+ */
 int
-func_remove(struct fs *f, ssize_t inode)
+func_remove(struct fs *f, struct job *job)
 {
-	int rt;
+	size_t *inodes;
+	ssize_t count, n;
 
-	rt = fs_remove(f->fs, inode);
-	if (!rt) 
-		fprintf(stdout, "remove failed!\n");
-	else
-		fprintf(stdout, "removed inode %ld.\n", inode);
+	/* Raw inumbers only: a named file goes with rm, which drops its entry */
+	if (job->argc < 2 || (count = parse_inodes(f, job, false, &inodes)) < 0) {
+		fprintf(stdout, "usage: remove <inode>[-<inode>]..., or rm <path>\n");
+		return (-1);
+	}
+
+	if (count == 1) {
+		if (fs_remove(f->fs, inodes[0]))
+			fprintf(stdout, "removed inode %lu.\n", inodes[0]);
+		else if (fs_is_dir(f->fs, inodes[0]))
+			fprintf(stdout, "inode %lu is a directory, use rm <path>.\n", inodes[0]);
+		else
+			fprintf(stdout, "remove failed!\n");
+	} else {
+		n = fs_remove_many(f->fs, inodes, count);
+		if (n >= 0)
+			fprintf(stdout, "removed %ld of %ld inodes.\n", n, count);
+		else
+			fprintf(stdout, "remove failed!\n");
+	}
 
-	fflush(stdout);
+	free(inodes);
 	return (0);
 }
 
@@ -179,24 +524,110 @@ func_cat(struct fs *f, ssize_t inode)
 {
 	int rt;
 
-	rt = func_copyout(f, inode, "/dev/stdout");
+	rt = copyout_stream(f, inode, stdout);
 	if (rt)
 		printf("cat failed!\n");
 
-	fflush(stdout);
 	return (0);
 }
 
+/*
+ * stat <inode|path>[-<inode>]...
+ * Several inodes are looked up as a batch, one read per table block, and
+ * only their sizes are shown.
+ */
 int
-func_stat(struct fs *f, ssize_t inode)
+func_stat(struct fs *f, struct job *job)
 {
-	ssize_t bytes = fs_stat(f->fs, inode);
-	if (bytes >= 0)
-		fprintf(stdout, "inode %ld has size %ld bytes.\n", inode, bytes);
+	size_t *inodes;
+	ssize_t *sizes, count, n;
+
+	if (job->argc < 2 || (count = parse_inodes(f, job, true, &inodes)) < 0) {
+		fprintf(stdout, "usage: stat <inode|path>[-<inode>]...\n");
+		return (-1);
+	}
+
+	if (count == 1) {
+		ssize_t bytes = fs_stat(f->fs, inodes[0]);
+		if (bytes >= 0) {
+			fprintf(stdout, "inode %lu has size %ld bytes.\n", inodes[0], bytes);
+			fprintf(stdout, "inode %lu has %ld allocated blocks.\n", inodes[0],
+			    fs_blocks(f->fs, inodes[0]));
+		} else
+			fprintf(stdout, "stat failed!\n");
+		free(inodes);
+		return (0);
+	}
+
+	sizes = malloc(count * sizeof(ssize_t) + 1);
+	n = fs_stat_many(f->fs, inodes, count, sizes);
+	for (ssize_t i=0;i<count;i++)
+		if (sizes[i] >= 0)
+			fprintf(stdout, "inode %lu has size %ld bytes.\n", inodes[i], sizes[i]);
+	if (n >= 0)
+		fprintf(stdout, "%ld of %ld inodes in use.\n", n, count);
 	else
 		fprintf(stdout, "stat failed!\n");
 
-	fflush(stdout);
+	free(sizes);
+	free(inodes);
+	return (0);
+}
+
+int
+func_truncate(struct fs *f, ssize_t inode, char *size)
+{
+	if (inode >= 0 && fs_truncate(f->fs, inode, strtoul(size, NULL, 10)))
+		fprintf(stdout, "inode %ld truncated to %s bytes.\n", inode, size);
+	else
+		fprintf(stdout, "truncate failed!\n");
+
+	return (0);
+}
+
+int
+func_fallocate(struct fs *f, ssize_t inode, char *offset, char *length)
+{
+	size_t before = inode >= 0 ? max(fs_blocks(f->fs, inode), 0) : 0;
+
+	if (inode >= 0 && fs_fallocate(f->fs, inode, strtoul(offset, NULL, 10),
+	    strtoul(length, NULL, 10)))
+		fprintf(stdout, "inode %ld: %ld blocks reserved.\n", inode,
+		    fs_blocks(f->fs, inode) - before);
+	else
+		fprintf(stdout, "fallocate failed!\n");
+
+	return (0);
+}
+
+/*
+ * Blocks are shared, not copied: the files part as either is written. The
+ * destination path is only created once the source is known to be a
+ * file, and goes again if the copy fails.
+ */
+int
+func_cp(struct fs *f, char *from, char *to)
+{
+	ssize_t src, dst;
+	bool created;
+
+	src = resolve_inode(f, from, false);
+	if (src < 0 || fs_stat(f->fs, src) < 0 || fs_is_dir(f->fs, src)) {
+		fprintf(stdout, "cp failed!\n");
+		return (0);
+	}
+
+	created = resolve_inode(f, to, false) < 0;
+	dst = resolve_inode(f, to, true);
+	if (dst >= 0 && fs_copy(f->fs, src, dst)) {
+		fprintf(stdout, "copied inode %ld to inode %ld, %ld blocks shared.\n",
+		    src, dst, fs_blocks(f->fs, dst));
+		return (0);
+	}
+
+	if (created && dst >= 0)
+		fs_unlink(f->fs, to);
+	fprintf(stdout, "cp failed!\n");
 	return (0);
 }
 
@@ -204,38 +635,123 @@ int
 func_copyin(struct fs *f, char * file, ssize_t inode)
 {
 	FILE *fp;
-	ssize_t sz = 0, wr = 0, total = 0;
-	char buf[BUFSIZ] = {0};
-	
+	ssize_t sz = 0, wr = 0, total = 0, eof, bs, bufsz;
+	bool skipped = false;
+	char *buf;
+
+	/* A path that could not be found or created resolves to -1; a
+	 * directory's buckets must not be overwritten with file data */
+	if (inode < 0 || !disk_mounted(f->disk) || fs_is_dir(f->fs, inode)) {
+		fprintf(stdout, "copyin failed!\n");
+		return (0);
+	}
+
 	fp = fopen(file, "r");
 	if (fp == NULL) {
 		fprintf(stderr, "Unable to open %s.\n", file);
 		return (1);
 	}
 
+	/* Holes are whole blocks of the mounted file system, so every read
+	 * but the last fills a whole number of them */
+	bs = f->fs->blockSize;
+	bufsz = max(BUFSIZ, bs);
+	buf = calloc(1, bufsz);
+
+	/* Past the current end of file every block is a hole already */
+	eof = max(fs_stat(f->fs, inode), 0);
+
 	while (true) {
-		memset(buf, 0, BUFSIZ);
-		sz = fread(buf, 1, sizeof(buf), fp);
+		sz = fread(buf, 1, bufsz, fp);
 		if (sz <= 0) {
 			break;
 		}
 		total += sz;
-		wr += fs_write(f->fs, inode, buf, sz, wr);
+
+		/* Skip all-zero blocks that would land in holes anyway and
+		 * write each run of other blocks with a single fs_write */
+		for (ssize_t off = 0, n; off < sz; off += n) {
+			n = 0;
+			while (off + n < sz) {
+				ssize_t blk = min(sz - off - n, bs);
+				skipped = wr + n >= eof && blk == bs &&
+				    is_zero(buf + off + n, blk);
+				if (skipped)
+					break;
+				n += blk;
+			}
+			if (n > 0) {
+				if (fs_write(f->fs, inode, buf + off, n, wr) != n) {
+					fprintf(stdout, "copyin failed after %ld bytes!\n", wr);
+					goto out;
+				}
+				wr += n;
+			}
+			if (skipped) {
+				wr += bs;
+				n += bs;
+			}
+		}
+	}
+
+	/* A trailing hole still has to extend the file size */
+	if (skipped) {
+		memset(buf, 0, bs);
+		if (fs_write(f->fs, inode, buf, bs, wr - bs) != bs) {
+			fprintf(stdout, "copyin failed after %ld bytes!\n", wr - bs);
+			goto out;
+		}
 	}
 
 	fprintf(stdout, "%ld bytes copied\n", total);
+out:
+	free(buf);
 	fclose(fp);
 
 	return (0);
 }
 
+/* Read a whole inode into the shared copy buffer, then emit it to fp */
+int
+copyout_stream(struct fs *f, ssize_t inode, FILE *fp)
+{
+	ssize_t sz = 0, total = 0;
+
+	while (true) {
+		if (f->iobuf_sz < (size_t)total + BUFSIZ) {
+			f->iobuf_sz = (f->iobuf_sz ? f->iobuf_sz : BUFSIZ) * 2;
+			while (f->iobuf_sz < (size_t)total + BUFSIZ)
+				f->iobuf_sz *= 2;
+			f->iobuf = (char *)realloc(f->iobuf, f->iobuf_sz);
+		}
+		sz = fs_read_uncached(f->fs, inode, f->iobuf + total, BUFSIZ, total);
+		if (sz < 0) {
+			/* Missing inode, or a block that failed verification */
+			fprintf(stdout, "copyout failed after %ld bytes!\n", total);
+			return (1);
+		}
+		if (sz == 0) {
+			break;
+		}
+		total += sz;
+		/* A short read means end of file; skip the extra inode lookup */
+		if (sz < BUFSIZ)
+			break;
+	}
+
+	fprintf(stdout, "%ld bytes copied\n", total);
+
+	if (total) {
+		fwrite(f->iobuf, 1, total, fp);
+	}
+
+	return (0);
+}
+
 bool
 func_copyout(struct fs *f, ssize_t inode, char * file)
 {
 	FILE *fp;
-	ssize_t sz = 0, total = 0;
-	char buf[BUFSIZ] = {0};
-	char *read_out = NULL;
 
 	fp = fopen(file, "w");
 	if (fp == NULL) {
@@ -243,30 +759,274 @@ func_copyout(struct fs *f, ssize_t inode, char * file)
 		return (1);
 	}
 
-	while (true) {
-		memset(buf, 0, BUFSIZ);
-		sz = fs_read(f->fs, inode, buf, sizeof(buf), total);
-		if (sz <= 0) {
-			break;
+	copyout_stream(f, inode, fp);
+
+	fclose(fp);
+	return (0);
+}
+
+/* An all-digit argument is an inumber, anything else a path */
+ssize_t
+resolve_inode(struct fs *f, const char *arg, bool create)
+{
+	ssize_t inode;
+
+	if (arg[0] && arg[strspn(arg, "0123456789")] == 0)
+		return (atoi(arg));
+
+	inode = fs_lookup(f->fs, arg);
+	if (inode < 0 && create)
+		inode = fs_create_path(f->fs, arg);
+	return (inode);
+}
+
+int
+func_mkdir(struct fs *f, char *path)
+{
+	ssize_t inode = fs_mkdir(f->fs, path);
+	if (inode >= 0)
+		fprintf(stdout, "created directory %s as inode %ld.\n", path, inode);
+	else
+		fprintf(stdout, "mkdir failed!\n");
+
+	return (0);
+}
+
+int
+func_unlink(struct fs *f, char *path)
+{
+	if (fs_unlink(f->fs, path))
+		fprintf(stdout, "removed %s.\n", path);
+	else
+		fprintf(stdout, "rm failed!\n");
+
+	return (0);
+}
+
+static void
+ls_entry(const char *name, uint32_t inumber, void *arg)
+{
+	struct fs *f = arg;
+
+	fprintf(stdout, "%8u %10ld %s%s\n", inumber, fs_stat(f->fs, inumber),
+	    name, fs_is_dir(f->fs, inumber) ? "/" : "");
+}
+
+int
+func_ls(struct fs *f, char *path)
+{
+	ssize_t inode = resolve_inode(f, path, false);
+
+	if (inode < 0 || !fs_readdir(f->fs, inode, ls_entry, f))
+		fprintf(stdout, "ls failed!\n");
+
+	return (0);
+}
+
+/* Run fn on up to MAX_WORKERS threads sharing the pool's xfer list */
+static void
+pool_run(struct pool *p, void *(*fn)(void *))
+{
+	pthread_t tids[MAX_WORKERS];
+	long n = sysconf(_SC_NPROCESSORS_ONLN);
+	int nworkers = (int)min(max(n, 1), MAX_WORKERS);
+
+	nworkers = min(nworkers, max(p->nxfers, 1));
+	for (int i=0;i<nworkers;i++)
+		pthread_create(&tids[i], NULL, fn, p);
+	for (int i=0;i<nworkers;i++)
+		pthread_join(tids[i], NULL);
+}
+
+static void *
+import_worker(void *arg)
+{
+	struct pool *p = arg;
+	struct fs *f = p->f;
+	char path[PATH_MAX];
+	char buf[BUFSIZ];
+	int i;
+
+	while ((i = __sync_fetch_and_add(&p->next, 1)) < p->nxfers) {
+		struct xfer *x = &p->xfers[i];
+		FILE *fp;
+		ssize_t sz, wr;
+
+		snprintf(path, sizeof(path), "%s/%s", p->dir, x->name);
+		fp = fopen(path, "r");
+		if (fp == NULL) {
+			x->failed = 1;
+			continue;
 		}
 
-		read_out = (char *)realloc(read_out, total + BUFSIZ + 1);
-		memset(read_out + total, 0, BUFSIZ + 1);
-		memcpy(read_out + total, buf, sz);
-		total += sz;
+		pthread_mutex_lock(&f->lock);
+		x->inode = fs_create(f->fs);
+		pthread_mutex_unlock(&f->lock);
+		if (x->inode < 0) {
+			x->failed = 1;
+			fclose(fp);
+			continue;
+		}
+
+		/* Host reads run in parallel; only the fs_write is serialized */
+		while ((sz = fread(buf, 1, sizeof(buf), fp)) > 0) {
+			pthread_mutex_lock(&f->lock);
+			wr = fs_write(f->fs, x->inode, buf, sz, x->bytes);
+			pthread_mutex_unlock(&f->lock);
+			if (wr <= 0) {
+				x->failed = 1;
+				break;
+			}
+			x->bytes += wr;
+		}
+		if (ferror(fp))
+			x->failed = 1;
+		fclose(fp);
+
+		/* Don't leave a half-copied, unnamed inode behind */
+		if (x->failed) {
+			pthread_mutex_lock(&f->lock);
+			fs_remove(f->fs, x->inode);
+			pthread_mutex_unlock(&f->lock);
+			x->inode = -1;
+		}
 	}
+	return (NULL);
+}
 
-	fprintf(stdout, "%ld bytes copied\n", total);
-	fflush(stdout);
-	
-	if (total) {
-		read_out[total] = '\0';
-		fprintf(fp, "%s", read_out);
-		fflush(fp);
-		free(read_out);
+static void *
+export_worker(void *arg)
+{
+	struct pool *p = arg;
+	struct fs *f = p->f;
+	char path[PATH_MAX];
+	char buf[BUFSIZ];
+	int i;
+
+	while ((i = __sync_fetch_and_add(&p->next, 1)) < p->nxfers) {
+		struct xfer *x = &p->xfers[i];
+		FILE *fp;
+		ssize_t sz;
+
+		snprintf(path, sizeof(path), "%s/%s", p->dir, x->name);
+		fp = fopen(path, "w");
+		if (fp == NULL) {
+			x->failed = 1;
+			continue;
+		}
+
+		/* fs_read is serialized; the host write overlaps other readers */
+		for (;;) {
+			pthread_mutex_lock(&f->lock);
+			sz = fs_read_uncached(f->fs, x->inode, buf, sizeof(buf), x->bytes);
+			pthread_mutex_unlock(&f->lock);
+			if (sz < 0)
+				x->failed = 1;
+			if (sz <= 0)
+				break;
+			fwrite(buf, 1, sz, fp);
+			x->bytes += sz;
+		}
+		fclose(fp);
 	}
+	return (NULL);
+}
 
-	fclose(fp);
+/* Print the inumber <-> name manifest and a summary line */
+static int
+pool_report(struct pool *p, const char *verb)
+{
+	ssize_t total = 0;
+	int done = 0;
+
+	for (int i=0;i<p->nxfers;i++) {
+		struct xfer *x = &p->xfers[i];
+		if (x->failed) {
+			fprintf(stdout, "%s failed for %s\n", verb, x->name);
+			continue;
+		}
+		fprintf(stdout, "%ld\t%s\n", x->inode, x->name);
+		total += x->bytes;
+		done++;
+	}
+	fprintf(stdout, "%d files, %ld bytes %s\n", done, total, verb);
+	return (0);
+}
+
+/* Grow the pool's xfer list by one zeroed entry */
+static struct xfer *
+pool_add(struct pool *p, int *cap)
+{
+	if (p->nxfers == *cap) {
+		*cap = *cap ? *cap * 2 : 64;
+		p->xfers = realloc(p->xfers, *cap * sizeof(struct xfer));
+	}
+	memset(&p->xfers[p->nxfers], 0, sizeof(struct xfer));
+	return (&p->xfers[p->nxfers++]);
+}
+
+int
+func_importdir(struct fs *f, char *dir)
+{
+	struct pool p = { f, dir, NULL, 0, 0 };
+	struct dirent *de;
+	struct stat st;
+	char path[PATH_MAX];
+	DIR *d;
+	int cap = 0;
+
+	d = opendir(dir);
+	if (d == NULL) {
+		fprintf(stderr, "Unable to open %s.\n", dir);
+		return (1);
+	}
+
+	while ((de = readdir(d)) != NULL) {
+		snprintf(path, sizeof(path), "%s/%s", dir, de->d_name);
+		if (stat(path, &st) != 0 || !S_ISREG(st.st_mode) ||
+		    strlen(de->d_name) >= sizeof(p.xfers->name))
+			continue;
+		struct xfer *x = pool_add(&p, &cap);
+		strcpy(x->name, de->d_name);
+		x->inode = -1;
+	}
+	closedir(d);
+
+	pool_run(&p, import_worker);
+	pool_report(&p, "imported");
+
+	free(p.xfers);
+	return (0);
+}
+
+int
+func_exportall(struct fs *f, char *dir)
+{
+	struct pool p = { f, dir, NULL, 0, 0 };
+	int cap = 0;
+
+	if (f->fs->disk == NULL || !disk_mounted(f->fs->disk)) {
+		fprintf(stdout, "exportall failed!\n");
+		return (0);
+	}
+
+	if (mkdir(dir, 0755) != 0 && errno != EEXIST) {
+		fprintf(stderr, "Unable to create %s.\n", dir);
+		return (1);
+	}
+
+	for (size_t i=0;i<f->fs->metadata.Inodes;i++) {
+		if (fs_stat(f->fs, i) < 0)
+			continue;
+		struct xfer *x = pool_add(&p, &cap);
+		snprintf(x->name, sizeof(x->name), "%lu", i);
+		x->inode = i;
+	}
+
+	pool_run(&p, export_worker);
+	pool_report(&p, "exported");
+
+	free(p.xfers);
 	return (0);
 }
 
@@ -281,9 +1041,8 @@ func_exit(struct fs *f, struct job *job)
 int 
 func_help()
 {
-	for (int i=0;i<FUNC_COUNT;i++) {
-		write(2, FUNC_MAP[i], strlen(FUNC_MAP[i]));
-		//if (i < FUNC_COUNT - 1)
+	for (int i=0;COMMANDS[i].name != NULL;i++) {
+		write(2, COMMANDS[i].usage, strlen(COMMANDS[i].usage));
 		write(2, "\n", 1);
 	} 
 	return (0);
@@ -292,8 +1051,6 @@ func_help()
 int 
 clean_up(struct fs *f, struct job *job)
 {
-	for (int i=0;i<job->argc;i++)
-		free(job->argv[i]);
 	job->argc = 0;
 
 	if (f) {
@@ -301,55 +1058,170 @@ clean_up(struct fs *f, struct job *job)
 			free_fs(f->fs);
 		if (f->disk)
 			free_disk(f->disk);
+		free(f->iobuf);
 	}
 	f->fs = NULL;
 	f->disk = NULL;
+	f->iobuf = NULL;
+	f->iobuf_sz = 0;
 
 	return (0);
 }
 
+/* Argument adapters for the command table */
+static int cmd_format(struct fs *f, struct job *job) { return func_format(f, job); }
+static int cmd_mount(struct fs *f, struct job *job) { return func_mount(f, job); }
+static int cmd_snapshot(struct fs *f, struct job *job) { return func_snapshot(f, job); }
+static int cmd_resize(struct fs *f, struct job *job) { return func_resize(f, job->argv[1]); }
+static int cmd_sync(struct fs *f, struct job *job) { return func_sync(f); }
+static int cmd_defrag(struct fs *f, struct job *job) { return func_defrag(f, job); }
+static int cmd_debug(struct fs *f, struct job *job) { return func_debug(f); }
+static int cmd_create(struct fs *f, struct job *job) { return func_create(f, job); }
+static int cmd_remove(struct fs *f, struct job *job) { return func_remove(f, job); }
+static int cmd_cat(struct fs *f, struct job *job) { return func_cat(f, resolve_inode(f, job->argv[1], false)); }
+static int cmd_stat(struct fs *f, struct job *job) { return func_stat(f, job); }
+static int cmd_truncate(struct fs *f, struct job *job) { return func_truncate(f, resolve_inode(f, job->argv[1], false), job->argv[2]); }
+static int cmd_fallocate(struct fs *f, struct job *job) { return func_fallocate(f, resolve_inode(f, job->argv[1], false), job->argv[2], job->argv[3]); }
+static int cmd_cp(struct fs *f, struct job *job) { return func_cp(f, job->argv[1], job->argv[2]); }
+static int cmd_copyin(struct fs *f, struct job *job) { return func_copyin(f, job->argv[1], resolve_inode(f, job->argv[2], true)); }
+static int cmd_copyout(struct fs *f, struct job *job) { return func_copyout(f, resolve_inode(f, job->argv[1], false), job->argv[2]); }
+static int cmd_mkdir(struct fs *f, struct job *job) { return func_mkdir(f, job->argv[1]); }
+static int cmd_unlink(struct fs *f, struct job *job) { return func_unlink(f, job->argv[1]); }
+static int cmd_ls(struct fs *f, struct job *job) { return func_ls(f, job->argc > 1 ? job->argv[1] : "/"); }
+static int cmd_importdir(struct fs *f, struct job *job) { return func_importdir(f, job->argv[1]); }
+static int cmd_exportall(struct fs *f, struct job *job) { return func_exportall(f, job->argv[1]); }
+static int cmd_help(struct fs *f, struct job *job) { return func_help(); }
+static int cmd_exit(struct fs *f, struct job *job) { return func_exit(f, job); }
+
+const struct command COMMANDS[] = {
+	{ "format",	"format [inline[=<inode size>]] [compress] [dedup] [checksum[=data]] [blocksize=<bytes>] [ratio=<bytes per inode>]",	-1, cmd_format },
+	{ "mount",	"mount [<snapshot>|delalloc]",	-1, cmd_mount },
+	{ "snapshot",	"snapshot [delete <snapshot>]",	-1, cmd_snapshot },
+	{ "resize",	"resize <blocks>",		2, cmd_resize },
+	{ "sync",	"sync",				1, cmd_sync },
+	{ "defrag",	"defrag [<blocks>] [<seconds>]",	-1, cmd_defrag },
+	{ "debug",	"debug",			1, cmd_debug },
+	{ "create",	"create [<count>]",		-1, cmd_create },
+	{ "remove",	"remove <inode>[-<inode>]...",	-1, cmd_remove },
+	{ "cat",	"cat <inode|path>",		2, cmd_cat },
+	{ "stat",	"stat <inode|path>[-<inode>]...",	-1, cmd_stat },
+	{ "truncate",	"truncate <inode|path> <size>",	3, cmd_truncate },
+	{ "fallocate",	"fallocate <inode|path> <offset> <length>",	4, cmd_fallocate },
+	{ "cp",		"cp <inode|path> <inode|path>",	3, cmd_cp },
+	{ "copyin",	"copyin <file> <inode|path>",	3, cmd_copyin },
+	{ "copyout",	"copyout <inode|path> <file>",	3, cmd_copyout },
+	{ "mkdir",	"mkdir <path>",			2, cmd_mkdir },
+	{ "rm",		"rm <path>",			2, cmd_unlink },
+	{ "ls",		"ls [path]",			-1, cmd_ls },
+	{ "importdir",	"importdir <hostdir>",		2, cmd_importdir },
+	{ "exportall",	"exportall <hostdir>",		2, cmd_exportall },
+	{ "help",	"help",				1, cmd_help },
+	{ "quit",	"quit",				1, cmd_exit },
+	{ "exit",	"exit",				1, cmd_exit },
+	{ NULL,		NULL,				0, NULL }
+};
+
+static const struct command *cmd_hash[CMD_HASH_SIZE];
+
+static unsigned int
+cmd_hash_name(const char *name)
+{
+	unsigned int h = 5381;
+
+	while (*name)
+		h = h * 33 + (unsigned char)*name++;
+	return (h & (CMD_HASH_SIZE - 1));
+}
+
+/* Build the open-addressed name -> command table */
+void
+cmd_table_init()
+{
+	for (int i=0;COMMANDS[i].name != NULL;i++) {
+		unsigned int h = cmd_hash_name(COMMANDS[i].name);
+		while (cmd_hash[h] != NULL)
+			h = (h + 1) & (CMD_HASH_SIZE - 1);
+		cmd_hash[h] = &COMMANDS[i];
+	}
+}
+
+const struct command *
+cmd_lookup(const char *name)
+{
+	unsigned int h = cmd_hash_name(name);
+
+	while (cmd_hash[h] != NULL) {
+		if (strcmp(cmd_hash[h]->name, name) == 0)
+			return (cmd_hash[h]);
+		h = (h + 1) & (CMD_HASH_SIZE - 1);
+	}
+	return (NULL);
+}
+
 int 
 internal_func(struct fs *f, struct job *job)
 {
-	int rt = -1;
-
-	if (strcmp(job->argv[0], "format") == 0) {
-		rt = func_format(f);
-	} else if (strcmp(job->argv[0], "mount") == 0) {
-		rt = func_mount(f);
-	} else if (strcmp(job->argv[0], "debug") == 0) {
-		rt = func_debug(f);
-	} else if (strcmp(job->argv[0], "create") == 0) {
-		rt = func_create(f);
-	} else if (strcmp(job->argv[0], "remove") == 0) {
-		if (job->argc == 2) {
-			rt = func_remove(f, atoi(job->argv[1]));
-		}
-	} else if (strcmp(job->argv[0], "cat") == 0) {
-		if (job->argc == 2) {
-			rt = func_cat(f, atoi(job->argv[1]));
-		}
-	} else if (strcmp(job->argv[0], "stat") == 0) {
-		if (job->argc == 2) {
-			rt = func_stat(f, atoi(job->argv[1]));
-		}
-	} else if (strcmp(job->argv[0], "copyin") == 0) {
-		if (job->argc == 3) {
-			rt = func_copyin(f, job->argv[1], atoi(job->argv[2]));
-		}
-	} else if (strcmp(job->argv[0], "copyout") == 0) {
-		if (job->argc == 3) {
-			rt = func_copyout(f, atoi(job->argv[1]), job->argv[2]);
+	const struct command *cmd;
+
+	if (job->argc < 1)
+		return (-1);
+
+	cmd = cmd_lookup(job->argv[0]);
+	if (cmd == NULL)
+		return (-1);
+	if (cmd->argc >= 0 && cmd->argc != job->argc)
+		return (-1);
+
+	return (cmd->func(f, job));
+}
+
+/*
+ * Open the disk named on the command line: one image, or a set of images
+ * "[mirror:|stripe=<KiB>:]<image>,<image>..." that is striped STRIPE_KB at
+ * a time unless mirrored
+ */
+int
+open_disk(struct fs *f, char *spec, int nblocks)
+{
+	const char *paths[ARRAY_MAX_MEMBERS];
+	struct stat f_stat;
+	size_t count = 0, stripe = STRIPE_KB * 1024;
+	bool mirror = false, array = false;
+	FILE *fp;
+
+	if (strncmp(spec, "mirror:", 7) == 0) {
+		mirror = array = true;
+		spec += 7;
+	} else if (strncmp(spec, "stripe=", 7) == 0) {
+		stripe = strtoul(spec + 7, &spec, 10) * 1024;
+		if (*spec++ != ':' || stripe == 0)
+			return (-1);
+		array = true;
+	}
+
+	if (!array && strchr(spec, ',') == NULL) {
+		/* Check existance, if not create a new one */
+		if (stat(spec, &f_stat) != 0) {
+			fp = fopen(spec, "w");
+			for (int i=0;i<DISK_BLK_SIZE*nblocks;i++) 
+				fprintf(fp, "%d", 0);
+			fclose(fp);
 		}
-	} else if (strcmp(job->argv[0], "help") == 0) {
-		rt = func_help();
-	} else if (strcmp(job->argv[0], "quit") == 0) {
-		rt = func_exit(f, job);
-	} else if (strcmp(job->argv[0], "exit") == 0) {
-		rt = func_exit(f, job);
+		disk_open(f->disk, spec, nblocks);
+		return (0);
 	}
 
-	return (rt);
+	/* Members are created empty; unwritten blocks read as zeros */
+	for (char *p = strtok(spec, ","); p != NULL; p = strtok(NULL, ",")) {
+		if (count == ARRAY_MAX_MEMBERS)
+			return (-1);
+		paths[count++] = p;
+	}
+	if (count == 0)
+		return (-1);
+
+	disk_open_array(f->disk, paths, count, nblocks, stripe, mirror);
+	return (0);
 }
 
 int 
@@ -357,80 +1229,100 @@ main(int argc, char ** argv)
 {
 	char *line = NULL;
 	size_t sz = 0;
-	struct stat f_stat;
 
 	char * disk_fn;
 	int disk_blk;
 	struct fs f;
-	FILE *fp;
+	FILE *in = stdin;
 	
 	int good_input, error, len;
 
 	struct job job;
 
-	setbuf(stdout, NULL);
-
 	f.fs = NULL;
 	f.disk = NULL;
+	f.batch = 0;
+	f.iobuf = NULL;
+	f.iobuf_sz = 0;
+	pthread_mutex_init(&f.lock, NULL);
+	job.argc = 0;
+
+	/* sfssh [-b [script]] <diskfile>[,<diskfile>...] <nblocks> */
+	if (argc >= 2 && strcmp(argv[1], "-b") == 0) {
+		f.batch = 1;
+		if (argc != 4 && argc != 5)
+			goto usage;
+		if (argc == 5) {
+			in = fopen(argv[2], "r");
+			if (in == NULL) {
+				fprintf(stderr, "Unable to open %s.\n", argv[2]);
+				goto error_exit;
+			}
+		}
+		argv += argc - 3;
+		argc = 3;
+	}
 
 	if (argc == 3) {
 		disk_fn = argv[1];
 		disk_blk = atoi(argv[2]);
 	} else {
-		goto error_exit;
+		goto usage;
 	}
 
+	if (f.batch)
+		setvbuf(stdout, NULL, _IOFBF, 1 << 16);
+	else
+		setbuf(stdout, NULL);
+
+	cmd_table_init();
+
 	f.disk = new_disk();
 
 	/* Load disk */
-	/* Check existance, if not create a new one */
-	if (stat(disk_fn, &f_stat) != 0) {
-		fp = fopen(disk_fn, "w");
-		for (int i=0;i<DISK_BLK_SIZE*disk_blk;i++) 
-			fprintf(fp, "%d", 0);
-		fclose(fp);
-	}
-	disk_open(f.disk, disk_fn, disk_blk);
+	if (open_disk(&f, disk_fn, disk_blk))
+		goto error_exit;
 	assert(f.disk != NULL);
+	disk_enable_cache(f.disk, CACHE_BLOCKS);
 
 	f.fs = new_fs();
 
-	/* Interactive cmds */
+	/* Interactive cmds, or a script when in batch mode */
 	for (;;) {
-		write(2, "sfs> ", 5);
+		if (!f.batch)
+			write(2, "sfs> ", 5);
 		good_input = 0;
 		job.argc = 0;
-		sz = 0;
-		line = NULL;
 
-		// read input
-		if ((len = getline(&line, &sz, stdin)) > 0)
+		// read input, reusing the line buffer
+		if ((len = getline(&line, &sz, in)) > 0)
 			good_input = 1;
-		else
-			free(line);
 
 		if (good_input) {
 			// parse input
 			error = parse_line(line, len, &job);
-			if (error && error != ERR_EMPTY_CMD)
+			if (error == ERR_EMPTY_CMD)
+				continue;
+			if (error)
 				write(STDERR_FILENO, MSG_ERROR, strlen(MSG_ERROR));
 
 			error = internal_func(&f, &job);
 			if (error)
 				write(STDERR_FILENO, MSG_ERROR, strlen(MSG_ERROR));
-
-			for (int i=0;i<job.argc;i++)
-				free(job.argv[i]);
-			job.argc = 0;
 		} else
 			break;
 	}
 
+	free(line);
+	if (in != stdin)
+		fclose(in);
 	clean_up(&f, &job);
 	return (0);
 
+usage:
+	fprintf(stderr, "usage: %s [-b [script]] <diskfile>[,<diskfile>...] <nblocks>\n", argv[0]);
 error_exit:
 	write(STDERR_FILENO, MSG_ERROR, strlen(MSG_ERROR));
 	clean_up(&f, &job);
 	return(0);
-}
\ No newline at end of file
+}
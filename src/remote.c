@@ -0,0 +1,420 @@
+#define _GNU_SOURCE
+#include "remote.h"
+#include "rpc.h"
+
+#include <errno.h>
+#include <poll.h>
+#include <string.h>
+#include <unistd.h>
+#include <limits.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+
+#define min(a,b) (((a) < (b)) ? (a) : (b))
+
+struct RemoteFS
+{
+    int FileDescriptor;
+    ShmRings *Rings;             // Shared-memory rings once attached, else NULL
+    char *Slots;                 // Data slots following the rings
+    int Submit;                  // eventfd written after posting requests
+    int Complete;                // eventfd the server writes after completing
+    uint32_t Free[SHM_SLOTS];    // Slots not in use
+    uint32_t FreeCount;
+};
+
+// Requests still to send: a header, and for a write its payload, per call
+typedef struct
+{
+    struct iovec *Vector;
+    size_t Count;                // iovecs left
+} Outgoing;
+
+// Response being received: its header first, then its payload
+typedef struct
+{
+    size_t Call;                 // Call the response belongs to
+    size_t Got;                  // Bytes of header and payload received
+    RpcResponse Header;
+} Incoming;
+
+// Batch I/O -------------------------------------------------------------------
+
+// Send as much as the socket takes without blocking; false on error
+static bool send_some(int fd, Outgoing *out) {
+    struct msghdr msg = {0};
+    msg.msg_iov = out->Vector;
+    msg.msg_iovlen = min(out->Count, IOV_MAX);
+
+    ssize_t n = sendmsg(fd, &msg, MSG_DONTWAIT | MSG_NOSIGNAL);
+    if (n < 0) {
+        return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR;
+    }
+
+    while (n > 0) {
+        if ((size_t)n >= out->Vector->iov_len) {
+            n -= out->Vector->iov_len;
+            out->Vector++;
+            out->Count--;
+        }
+        else {
+            out->Vector->iov_base = (char *)out->Vector->iov_base + n;
+            out->Vector->iov_len -= n;
+            n = 0;
+        }
+    }
+    return true;
+}
+
+// Take in whatever responses have arrived, reading each payload straight
+// into its call's buffer; false on error, hangup or a malformed response
+static bool receive_some(int fd, RemoteCall *calls, size_t count, Incoming *in) {
+    while (in->Call < count) {
+        RemoteCall *call = &calls[in->Call];
+        char *target;
+        size_t want;
+
+        if (in->Got < sizeof(RpcResponse)) {
+            target = (char *)&in->Header + in->Got;
+            want = sizeof(RpcResponse) - in->Got;
+        }
+        else {
+            size_t done = in->Got - sizeof(RpcResponse);
+            target = call->Data + done;
+            want = in->Header.Length - done;
+        }
+
+        if (want == 0) {
+            call->Result = in->Header.Result;
+            in->Call++;
+            in->Got = 0;
+            continue;
+        }
+
+        ssize_t n = recv(fd, target, want, MSG_DONTWAIT);
+        if (n == 0) {
+            return false;
+        }
+        if (n < 0) {
+            return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR;
+        }
+        in->Got += n;
+
+        // Only a read brings back data, and no more than was asked for
+        if (in->Got == sizeof(RpcResponse) &&
+            in->Header.Length > (call->Op == RPC_READ ? call->Length : 0)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// Shared-memory I/O -------------------------------------------------------------
+
+static char *slot_data(RemoteFS *remote, uint32_t slot) {
+    return remote->Slots + (size_t)slot * SHM_SLOT_SIZE;
+}
+
+// Block until the server has completed something; false if it has gone
+static bool wait_completion(RemoteFS *remote) {
+    struct pollfd pfd[2] = {
+        {remote->Complete, POLLIN, 0},
+        {remote->FileDescriptor, POLLIN, 0},    // Nothing arrives here but a hangup
+    };
+    while (poll(pfd, 2, -1) < 0) {
+        if (errno != EINTR) {
+            return false;
+        }
+    }
+    if (pfd[1].revents) {
+        return false;
+    }
+    uint64_t count;
+    return read(remote->Complete, &count, sizeof(count)) == sizeof(count) || errno == EAGAIN;
+}
+
+// Run calls through the rings, with as many in flight as there are free
+// slots. Writes are copied into a slot and reads out of one; with keep set,
+// a read's slot is kept and Data pointed at it instead.
+static bool shm_batch(RemoteFS *remote, RemoteCall *calls, size_t count, bool keep) {
+    ShmRings *rings = remote->Rings;
+    RemoteCall *owner[SHM_SLOTS] = {0};
+    size_t next = 0, pending = 0;
+
+    for (size_t i = 0; i < count; i++) {
+        if (calls[i].Length > SHM_SLOT_SIZE) {
+            return false;
+        }
+        calls[i].Result = -1;
+    }
+
+    while (next < count || pending) {
+        // Post what the free slots allow and ring the doorbell once
+        uint32_t tail = rings->Submit.Tail;
+        size_t posted = 0;
+        for (; next < count && remote->FreeCount; next++, posted++) {
+            RemoteCall *call = &calls[next];
+            uint32_t slot = remote->Free[--remote->FreeCount];
+            if (call->Op == RPC_WRITE) {
+                memcpy(slot_data(remote, slot), call->Data, call->Length);
+            }
+            rings->Submissions[tail++ % SHM_SLOTS] = (RpcRequest){call->Op, call->Inumber, call->Length, slot, call->Offset};
+            owner[slot] = call;
+        }
+        if (posted) {
+            __atomic_store_n(&rings->Submit.Tail, tail, __ATOMIC_RELEASE);
+            uint64_t one = 1;
+            if (write(remote->Submit, &one, sizeof(one)) < 0 && errno != EAGAIN) {
+                return false;
+            }
+            pending += posted;
+        }
+        if (pending == 0) {
+            return false;                // Every slot is held by shared reads
+        }
+
+        uint32_t head = rings->Complete.Head;
+        uint32_t end = __atomic_load_n(&rings->Complete.Tail, __ATOMIC_ACQUIRE);
+        if (head == end) {
+            if (!wait_completion(remote)) {
+                return false;
+            }
+            continue;
+        }
+
+        for (; head != end; head++) {
+            RpcResponse response = rings->Completions[head % SHM_SLOTS];
+            RemoteCall *call = response.Slot < SHM_SLOTS ? owner[response.Slot] : NULL;
+            if (call == NULL || response.Length > (call->Op == RPC_READ ? call->Length : 0)) {
+                return false;
+            }
+            owner[response.Slot] = NULL;
+            call->Result = response.Result;
+            pending--;
+
+            if (keep && call->Op == RPC_READ) {
+                call->Data = slot_data(remote, response.Slot);
+                continue;
+            }
+            memcpy(call->Data, slot_data(remote, response.Slot), response.Length);
+            remote->Free[remote->FreeCount++] = response.Slot;
+        }
+        __atomic_store_n(&rings->Complete.Head, head, __ATOMIC_RELEASE);
+    }
+    return true;
+}
+
+// Remote interface ------------------------------------------------------------
+
+RemoteFS *remote_connect(const char *path) {
+    struct sockaddr_un addr = {.sun_family = AF_UNIX};
+
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        errno = ENAMETOOLONG;
+        return NULL;
+    }
+    strcpy(addr.sun_path, path);
+
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        return NULL;
+    }
+    if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+        int error = errno;
+        close(fd);
+        errno = error;
+        return NULL;
+    }
+
+    RemoteFS *remote = calloc(1, sizeof(RemoteFS));
+    remote->FileDescriptor = fd;
+    return remote;
+}
+
+void remote_close(RemoteFS *remote) {
+    if (remote->Rings) {
+        munmap(remote->Rings, SHM_SIZE);
+        close(remote->Submit);
+        close(remote->Complete);
+    }
+    close(remote->FileDescriptor);
+    free(remote);
+}
+
+bool remote_attach(RemoteFS *remote) {
+    if (remote->Rings) {
+        return true;
+    }
+
+    RpcRequest request = {RPC_ATTACH, 0, 0, 0, 0};
+    if (send(remote->FileDescriptor, &request, sizeof(request), MSG_NOSIGNAL) != sizeof(request)) {
+        return false;
+    }
+
+    // The response carries the memfd and both eventfds
+    RpcResponse response;
+    int fds[3];
+    union {
+        struct cmsghdr Align;
+        char Buffer[CMSG_SPACE(sizeof(fds))];
+    } control;
+    struct iovec iov = {&response, sizeof(response)};
+    struct msghdr msg = {0};
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control.Buffer;
+    msg.msg_controllen = sizeof(control.Buffer);
+
+    ssize_t n = recvmsg(remote->FileDescriptor, &msg, MSG_WAITALL | MSG_CMSG_CLOEXEC);
+    struct cmsghdr *cmsg = n > 0 ? CMSG_FIRSTHDR(&msg) : NULL;
+    if (cmsg == NULL || cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS ||
+        cmsg->cmsg_len != CMSG_LEN(sizeof(fds))) {
+        return false;
+    }
+    memcpy(fds, CMSG_DATA(cmsg), sizeof(fds));
+
+    void *base = MAP_FAILED;
+    if (n == sizeof(response) && response.Result == 0) {
+        base = mmap(NULL, SHM_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, fds[0], 0);
+    }
+    close(fds[0]);
+    if (base == MAP_FAILED) {
+        close(fds[1]);
+        close(fds[2]);
+        return false;
+    }
+
+    remote->Rings = base;
+    remote->Slots = (char *)base + SHM_DATA_OFFSET;
+    remote->Submit = fds[1];
+    remote->Complete = fds[2];
+    for (uint32_t slot = 0; slot < SHM_SLOTS; slot++) {
+        remote->Free[slot] = slot;
+    }
+    remote->FreeCount = SHM_SLOTS;
+    return true;
+}
+
+bool remote_batch(RemoteFS *remote, RemoteCall *calls, size_t count) {
+    if (remote->Rings) {
+        return shm_batch(remote, calls, count, false);
+    }
+
+    RpcRequest *headers = malloc(count * sizeof(RpcRequest));
+    struct iovec *vector = malloc(2 * count * sizeof(struct iovec));
+    Outgoing out = {vector, 0};
+    Incoming in = {0};
+    bool ok = true;
+
+    for (size_t i = 0; i < count; i++) {
+        RemoteCall *call = &calls[i];
+        if (call->Length > RPC_MAX_LENGTH) {
+            ok = false;
+        }
+        headers[i] = (RpcRequest){call->Op, call->Inumber, call->Length, 0, call->Offset};
+        vector[out.Count++] = (struct iovec){&headers[i], sizeof(RpcRequest)};
+        if (call->Op == RPC_WRITE && call->Length) {
+            vector[out.Count++] = (struct iovec){call->Data, call->Length};
+        }
+        call->Result = -1;
+    }
+
+    // Responses are read while requests are still going out, so neither
+    // side stalls with a full socket buffer
+    while (ok && in.Call < count) {
+        struct pollfd pfd = {remote->FileDescriptor, POLLIN | (out.Count ? POLLOUT : 0), 0};
+        if (poll(&pfd, 1, -1) < 0) {
+            ok = errno == EINTR;
+            continue;
+        }
+        if (pfd.revents & POLLOUT) {
+            ok = send_some(remote->FileDescriptor, &out);
+        }
+        if (ok && (pfd.revents & (POLLIN | POLLHUP | POLLERR))) {
+            ok = receive_some(remote->FileDescriptor, calls, count, &in);
+        }
+    }
+
+    free(headers);
+    free(vector);
+    return ok;
+}
+
+static int64_t call_one(RemoteFS *remote, uint32_t op, size_t inumber) {
+    RemoteCall call = {op, inumber, NULL, 0, 0, -1};
+    return remote_batch(remote, &call, 1) ? call.Result : -1;
+}
+
+// Split a read or write into pieces the transport carries, sent as one
+// batch. Returns bytes transferred up to the first short piece.
+static ssize_t transfer(RemoteFS *remote, uint32_t op, size_t inumber, char *data, size_t length, size_t offset) {
+    size_t piece = remote->Rings ? SHM_SLOT_SIZE : RPC_MAX_LENGTH;
+    size_t count = length ? (length + piece - 1) / piece : 1;
+    RemoteCall *calls = calloc(count, sizeof(RemoteCall));
+
+    for (size_t i = 0; i < count; i++) {
+        size_t start = i * piece;
+        calls[i] = (RemoteCall){op, inumber, data + start, min(length - start, piece), offset + start, -1};
+    }
+
+    ssize_t done = -1;
+    if (remote_batch(remote, calls, count)) {
+        done = 0;
+        for (size_t i = 0; i < count; i++) {
+            if (calls[i].Result < 0) {
+                done = i ? done : -1;
+                break;
+            }
+            done += calls[i].Result;
+            if (calls[i].Result < calls[i].Length) {
+                break;
+            }
+        }
+    }
+
+    free(calls);
+    return done;
+}
+
+ssize_t remote_create(RemoteFS *remote) {
+    return call_one(remote, RPC_CREATE, 0);
+}
+
+bool remote_remove(RemoteFS *remote, size_t inumber) {
+    return call_one(remote, RPC_REMOVE, inumber) > 0;
+}
+
+ssize_t remote_stat(RemoteFS *remote, size_t inumber) {
+    return call_one(remote, RPC_STAT, inumber);
+}
+
+ssize_t remote_read(RemoteFS *remote, size_t inumber, char *data, int length, size_t offset) {
+    return transfer(remote, RPC_READ, inumber, data, length, offset);
+}
+
+ssize_t remote_write(RemoteFS *remote, size_t inumber, char *data, size_t length, size_t offset) {
+    return transfer(remote, RPC_WRITE, inumber, data, length, offset);
+}
+
+ssize_t remote_read_shared(RemoteFS *remote, size_t inumber, size_t length, size_t offset, const char **data) {
+    RemoteCall call = {RPC_READ, inumber, NULL, length, offset, -1};
+
+    *data = NULL;
+    if (remote->Rings == NULL || !shm_batch(remote, &call, 1, true)) {
+        return -1;
+    }
+    if (call.Result < 0) {
+        remote_release(remote, call.Data);
+        return call.Result;
+    }
+    *data = call.Data;
+    return call.Result;
+}
+
+void remote_release(RemoteFS *remote, const char *data) {
+    if (data) {
+        remote->Free[remote->FreeCount++] = (data - remote->Slots) / SHM_SLOT_SIZE;
+    }
+}
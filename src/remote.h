@@ -0,0 +1,65 @@
+// remote.h: Client library for a file system served by sfsd
+
+#pragma once
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <sys/types.h>
+
+typedef struct RemoteFS RemoteFS;
+
+typedef struct
+{
+    uint32_t Op;          // RPC_* operation, see rpc.h
+    uint32_t Inumber;     // Inode operated on
+    char *Data;           // Buffer read into or written from
+    uint32_t Length;      // Bytes to read or write, at most RPC_MAX_LENGTH
+                          // (SHM_SLOT_SIZE once attached)
+    uint64_t Offset;      // File offset of a read or write
+    int64_t Result;       // Set to the fs_* return value
+} RemoteCall;
+
+// Constructor: connect to a server
+// @param	path	    Path of the server's Unix domain socket
+// @return	connection, NULL if the server could not be reached
+RemoteFS *remote_connect(const char *path);
+
+// Destructor: close the connection
+// @param	remote pointer
+void remote_close(RemoteFS *remote);
+
+// Move later calls onto shared-memory rings, so data passes through
+// slots mapped by both sides instead of the socket
+// @param	remote pointer
+// @return	whether the server handed out rings
+bool remote_attach(RemoteFS *remote);
+
+// Send every call before waiting for any response, reading responses as
+// the server returns them
+// @param	remote pointer
+// @param	calls	    Calls to make, in order; Result is filled in
+// @param	count	    Number of calls
+// @return	whether every response arrived
+bool remote_batch(RemoteFS *remote, RemoteCall *calls, size_t count);
+
+// The fs.h calls, each a batch of one (reads and writes longer than
+// one call carries are split into a batch of pieces)
+ssize_t remote_create(RemoteFS *remote);
+bool remote_remove(RemoteFS *remote, size_t inumber);
+ssize_t remote_stat(RemoteFS *remote, size_t inumber);
+ssize_t remote_read(RemoteFS *remote, size_t inumber, char *data, int length, size_t offset);
+ssize_t remote_write(RemoteFS *remote, size_t inumber, char *data, size_t length, size_t offset);
+
+// Read into a shared slot and return the data in place, with no copy;
+// needs remote_attach
+// @param	remote pointer
+// @param	length	    Bytes to read, at most SHM_SLOT_SIZE
+// @param	data	    Set to the data, valid until remote_release
+// @return	bytes read, -1 on error (data is then NULL)
+ssize_t remote_read_shared(RemoteFS *remote, size_t inumber, size_t length, size_t offset, const char **data);
+
+// Hand a slot from remote_read_shared back for reuse
+// @param	remote pointer
+// @param	data	    Pointer remote_read_shared returned
+void remote_release(RemoteFS *remote, const char *data);
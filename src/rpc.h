@@ -0,0 +1,66 @@
+// rpc.h: Wire protocol between sfsd and the remote client library
+
+#pragma once
+
+#include <stdint.h>
+
+#define RPC_MAX_LENGTH (1 << 20)    // Largest read or write payload
+
+// Operations, one per fs.h call served
+#define RPC_CREATE 1
+#define RPC_REMOVE 2
+#define RPC_STAT   3
+#define RPC_READ   4
+#define RPC_WRITE  5
+#define RPC_ATTACH 6    // Move to shared-memory rings; the response carries their fds
+
+// A client may send any number of requests before reading a response.
+// Requests on one connection are served in order, so responses come back
+// in the order their requests were sent.
+
+typedef struct
+{
+    uint32_t Op;          // RPC_* operation
+    uint32_t Inumber;     // Inode operated on, unused by RPC_CREATE
+    uint32_t Length;      // Bytes to read, or bytes of payload following a write
+    uint32_t Slot;        // Shared-memory slot holding the data, 0 on the socket
+    uint64_t Offset;      // File offset of a read or write
+} RpcRequest;
+
+typedef struct
+{
+    int64_t Result;       // Return value of the fs_* call
+    uint32_t Length;      // Bytes of payload following a read
+    uint32_t Slot;        // Slot of the request answered, 0 on the socket
+} RpcResponse;
+
+// Shared-memory transport ------------------------------------------------------
+
+// After RPC_ATTACH the server passes a memfd holding the rings below and
+// SHM_SLOTS data slots, plus two eventfds: one the client writes after
+// submitting, one the server writes after completing. Each ring has one
+// producer and one consumer, so the indices need no lock: an entry is
+// written before the release store of Tail that publishes it. Reads land
+// in the request's slot and writes are taken from it, so data never
+// passes through the socket.
+
+#define SHM_SLOTS 64                    // Data slots, and entries per ring
+#define SHM_SLOT_SIZE (256 << 10)       // Largest read or write through a slot
+
+typedef struct
+{
+    uint32_t Head;        // Next entry to consume, advanced by the consumer
+    uint32_t Tail;        // Next entry to fill, advanced by the producer
+    char Pad[56];         // Keeps each ring's indices on their own cache line
+} RingIndex;
+
+typedef struct
+{
+    RingIndex Submit;                   // Client to server
+    RingIndex Complete;                 // Server to client
+    RpcRequest Submissions[SHM_SLOTS];
+    RpcResponse Completions[SHM_SLOTS];
+} ShmRings;
+
+#define SHM_DATA_OFFSET ((sizeof(ShmRings) + 4095) & ~(size_t)4095)
+#define SHM_SIZE (SHM_DATA_OFFSET + (size_t)SHM_SLOTS * SHM_SLOT_SIZE)
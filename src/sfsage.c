@@ -0,0 +1,479 @@
+/* sfsage.c
+ * ----------------------------------------------------------
+ *  Ages a file system image with a mix of creates, appends,
+ *  overwrites, removes and truncates, and benchmarks reads as
+ *  it goes: every round appends one CSV row of fragmentation
+ *  metrics and read performance, so rows from fresh and aged
+ *  images can be compared
+ *
+ *  sfsage [-F] [-d] [-r rounds] [-n ops] [-m mix] [-s KiB]
+ *         [-u percent] [-b reads] [-S seed] [-l label]
+ *         [-o csv] <diskfile> <nblocks>
+ * ----------------------------------------------------------
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <string.h>
+#include <fcntl.h>
+#include <math.h>
+#include <time.h>
+
+#include "fs.h"
+#include "dir.h"
+#include "disk.h"
+#include "cache.h"
+
+#define CACHE_BLOCKS	1024
+#define DELALLOC_MB	16
+#define CHUNK_MAX	(64 << 10)	/* largest single append or overwrite */
+#define SEQ_CHUNK	(1 << 20)	/* bytes per sequential read */
+#define RAND_SIZE	4096		/* bytes per random read */
+#define SIZE_SIGMA	1.0		/* spread of the log-normal file sizes */
+
+enum { OP_CREATE, OP_APPEND, OP_OVERWRITE, OP_REMOVE, OP_TRUNCATE, NOPS };
+
+struct file {
+	uint32_t inumber;
+	size_t size;
+	size_t target;		/* size appends grow the file to */
+};
+
+struct metrics {
+	size_t files, bytes;
+	size_t used, blocks;	/* blocks in use, and on the disk */
+	size_t extents;
+	size_t free_runs, largest_free;
+};
+
+struct bench {
+	double seq_mib_s;
+	size_t seq_reads;	/* disk block reads the sequential pass took */
+	double rand_iops;
+	double p50_us, p99_us;
+};
+
+static FileSystem *fs;
+static Disk *disk;
+static struct file *files;
+static size_t nfiles, files_cap;
+static size_t nkept;		/* files found on the image, only read */
+static size_t max_size;		/* largest size a file may reach */
+static char *pattern;		/* incompressible data the writes take */
+static uint64_t rng = 88172645463325252ULL;
+
+/* xorshift64*: fast, and the same sequence for the same seed */
+static uint64_t
+next_random(void)
+{
+	rng ^= rng >> 12;
+	rng ^= rng << 25;
+	rng ^= rng >> 27;
+	return (rng * 2685821657736338717ULL);
+}
+
+static double
+uniform(void)
+{
+	return ((next_random() >> 11) * 0x1.0p-53);
+}
+
+static size_t
+below(size_t n)
+{
+	return (n ? next_random() % n : 0);
+}
+
+/* File sizes are log-normal around the median, as on real volumes */
+static size_t
+sample_size(size_t median)
+{
+	double u1 = uniform(), u2 = uniform();
+	double z = sqrt(-2 * log(u1 + 1e-12)) * cos(2 * M_PI * u2);
+	size_t size = median * exp(SIZE_SIGMA * z);
+
+	return (size < 1 ? 1 : size > max_size ? max_size : size);
+}
+
+static size_t
+chunk(void)
+{
+	return (1 + below(CHUNK_MAX));
+}
+
+static double
+now(void)
+{
+	struct timespec t;
+
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return (t.tv_sec + t.tv_nsec / 1e9);
+}
+
+static double
+used_fraction(void)
+{
+	size_t free = 0;
+
+	for (uint32_t g = 0; g < fs->groups; g++)
+		free += fs->groupFree[g];
+	return (1 - (double)free / fs->metadata.Blocks);
+}
+
+static int
+parse_mix(const char *arg, int *mix)
+{
+	char *end;
+
+	for (int i = 0; i < NOPS; i++) {
+		mix[i] = strtol(arg, &end, 10);
+		if (end == arg || mix[i] < 0 || (i < NOPS - 1 && *end++ != ':'))
+			return (-1);
+		arg = end;
+	}
+	return (*arg ? -1 : 0);
+}
+
+static int
+pick_op(const int *mix)
+{
+	int total = 0, r;
+
+	for (int i = 0; i < NOPS; i++)
+		total += mix[i];
+	r = below(total);
+	for (int i = 0; i < NOPS; i++) {
+		if (r < mix[i])
+			return (i);
+		r -= mix[i];
+	}
+	return (OP_CREATE);
+}
+
+static void
+write_at(struct file *f, size_t length, size_t offset)
+{
+	ssize_t n = fs_write(fs, f->inumber, pattern + below(SEQ_CHUNK),
+	    length, offset);
+
+	if (n > 0 && offset + n > f->size)
+		f->size = offset + n;
+}
+
+/*
+ * One operation of the mix. Past the fill target, operations that would
+ * grow the image shrink it instead, so usage hovers around the target
+ * while the layout keeps churning.
+ */
+static void
+age_step(const int *mix, size_t median, double fill)
+{
+	struct file *f;
+	int op = nfiles > nkept ? pick_op(mix) : OP_CREATE;
+	ssize_t inumber;
+
+	if ((op == OP_CREATE || op == OP_APPEND) && used_fraction() > fill)
+		op = uniform() < 0.5 ? OP_REMOVE : OP_TRUNCATE;
+	if (op != OP_CREATE && nfiles == nkept)
+		return;
+
+	f = &files[nkept + below(nfiles - nkept)];
+	if (op == OP_APPEND && f->size >= f->target)
+		op = OP_OVERWRITE;
+	if (op == OP_OVERWRITE && f->size == 0)
+		op = OP_APPEND;
+
+	switch (op) {
+	case OP_CREATE:
+		if ((inumber = fs_create(fs)) < 0)
+			return;
+		if (nfiles == files_cap) {
+			files_cap = files_cap ? files_cap * 2 : 1024;
+			files = realloc(files, files_cap * sizeof(*files));
+		}
+		f = &files[nfiles++];
+		f->inumber = inumber;
+		f->size = 0;
+		f->target = sample_size(median);
+		write_at(f, f->target < CHUNK_MAX ? f->target : chunk(), 0);
+		break;
+	case OP_APPEND:
+		if (f->size < f->target) {
+			size_t n = chunk();
+			write_at(f, n < f->target - f->size ? n : f->target - f->size,
+			    f->size);
+		}
+		break;
+	case OP_OVERWRITE: {
+		size_t offset = below(f->size), n = chunk();
+		write_at(f, n < f->size - offset ? n : f->size - offset, offset);
+		break;
+	}
+	case OP_REMOVE:
+		fs_remove(fs, f->inumber);
+		*f = files[--nfiles];
+		break;
+	case OP_TRUNCATE: {
+		/* Half are log rotations: cut to nothing and grow again */
+		size_t size = uniform() < 0.5 ? 0 : below(f->size);
+		if (fs_truncate(fs, f->inumber, size))
+			f->size = size;
+		break;
+	}
+	}
+}
+
+static void
+measure(struct metrics *m)
+{
+	size_t run = 0;
+
+	memset(m, 0, sizeof(*m));
+	m->files = nfiles;
+	for (size_t i = 0; i < nfiles; i++) {
+		ssize_t extents = fs_extents(fs, files[i].inumber);
+		m->bytes += files[i].size;
+		m->extents += extents > 0 ? extents : 0;
+	}
+
+	/* Free space fragmentation: how many runs it is split into */
+	m->blocks = fs->metadata.Blocks;
+	for (size_t b = 0; b <= m->blocks; b++) {
+		if (b < m->blocks && !fs->bitmap[b]) {
+			run++;
+			continue;
+		}
+		if (run) {
+			m->free_runs++;
+			if (run > m->largest_free)
+				m->largest_free = run;
+		}
+		m->used += b < m->blocks;
+		run = 0;
+	}
+}
+
+/* Reads should reach the image, not a cache warmed by the aging */
+static void
+drop_caches(void)
+{
+	if (disk->Cache)
+		cache_drop(disk->Cache, 0, disk->Blocks);
+	if (!disk->Array)
+		posix_fadvise(disk->FileDescriptor, 0, 0, POSIX_FADV_DONTNEED);
+}
+
+static int
+compare_doubles(const void *a, const void *b)
+{
+	double x = *(const double *)a, y = *(const double *)b;
+
+	return ((x > y) - (x < y));
+}
+
+static void
+benchmark(struct bench *b, size_t nreads)
+{
+	char *buf = malloc(SEQ_CHUNK);
+	size_t *ends = malloc((nfiles + 1) * sizeof(size_t));
+	double *lat = malloc((nreads + 1) * sizeof(double));
+	size_t bytes = 0, reads;
+	double start;
+
+	memset(b, 0, sizeof(*b));
+
+	/* Sequential: every file front to back */
+	drop_caches();
+	reads = disk->Reads;
+	start = now();
+	for (size_t i = 0; i < nfiles; i++)
+		for (size_t off = 0; off < files[i].size; off += SEQ_CHUNK) {
+			ssize_t n = fs_read(fs, files[i].inumber, buf, SEQ_CHUNK, off);
+			if (n <= 0)
+				break;
+			bytes += n;
+		}
+	b->seq_mib_s = bytes / 1048576.0 / (now() - start + 1e-9);
+	b->seq_reads = disk->Reads - reads;
+
+	/* Random: offsets uniform over all file data, so big files get
+	 * their share */
+	for (size_t i = 0; i < nfiles; i++)
+		ends[i] = (i ? ends[i - 1] : 0) + files[i].size;
+	if (nfiles == 0 || ends[nfiles - 1] == 0 || nreads == 0)
+		goto out;
+
+	drop_caches();
+	start = now();
+	for (size_t r = 0; r < nreads; r++) {
+		size_t pos = below(ends[nfiles - 1]), lo = 0, hi = nfiles - 1;
+		while (lo < hi) {
+			size_t mid = (lo + hi) / 2;
+			if (ends[mid] > pos)
+				hi = mid;
+			else
+				lo = mid + 1;
+		}
+		size_t off = pos - (ends[lo] - files[lo].size);
+		double t = now();
+		fs_read(fs, files[lo].inumber, buf, RAND_SIZE, off & ~(size_t)(RAND_SIZE - 1));
+		lat[r] = (now() - t) * 1e6;
+	}
+	b->rand_iops = nreads / (now() - start + 1e-9);
+	qsort(lat, nreads, sizeof(double), compare_doubles);
+	b->p50_us = lat[nreads / 2];
+	b->p99_us = lat[nreads * 99 / 100];
+
+out:
+	free(lat);
+	free(ends);
+	free(buf);
+}
+
+static void
+usage(void)
+{
+	fprintf(stderr, "usage: sfsage [-F] [-d] [-r rounds] [-n ops] "
+	    "[-m create:append:overwrite:remove:truncate] [-s median KiB]\n"
+	    "              [-u fill percent] [-b random reads] [-S seed] "
+	    "[-l label] [-o csv] <diskfile> <nblocks>\n");
+	exit(1);
+}
+
+int
+main(int argc, char **argv)
+{
+	int mix[NOPS] = { 20, 40, 15, 15, 10 };
+	int format = 0, delalloc = 0, rounds = 10, c;
+	size_t ops = 10000, median = 64, nreads = 2000;
+	double fill = 0.7;
+	const char *label = NULL, *csv = NULL;
+	struct metrics m;
+	struct bench b;
+	FILE *out = stdout;
+
+	while ((c = getopt(argc, argv, "Fdr:n:m:s:u:b:S:l:o:")) != -1) {
+		switch (c) {
+		case 'F':
+			format = 1;
+			break;
+		case 'd':
+			delalloc = 1;
+			break;
+		case 'r':
+			rounds = atoi(optarg);
+			break;
+		case 'n':
+			ops = strtoul(optarg, NULL, 10);
+			break;
+		case 'm':
+			if (parse_mix(optarg, mix) < 0)
+				usage();
+			break;
+		case 's':
+			median = strtoul(optarg, NULL, 10);
+			break;
+		case 'u':
+			fill = atof(optarg) / 100;
+			break;
+		case 'b':
+			nreads = strtoul(optarg, NULL, 10);
+			break;
+		case 'S':
+			rng = strtoull(optarg, NULL, 10) * 2 + 1;
+			break;
+		case 'l':
+			label = optarg;
+			break;
+		case 'o':
+			csv = optarg;
+			break;
+		default:
+			usage();
+		}
+	}
+	argc -= optind;
+	argv += optind;
+	if (argc != 2)
+		usage();
+	median = (median ? median : 1) << 10;
+
+	disk = new_disk();
+	disk_open(disk, argv[0], atoi(argv[1]));
+	disk_enable_cache(disk, CACHE_BLOCKS);
+	if (format && !fs_format(disk)) {
+		fprintf(stderr, "Unable to format %s.\n", argv[0]);
+		return (1);
+	}
+
+	fs = new_fs();
+	if (!fs_mount(fs, disk)) {
+		fprintf(stderr, "Unable to mount %s.\n", argv[0]);
+		return (1);
+	}
+	if (delalloc)
+		fs_set_delalloc(fs, DELALLOC_MB << 20);
+	max_size = (size_t)(POINTERS_PER_INODE + fs->pointersPerBlock) << fs->blockShift;
+
+	/* Files already on the image are read by the benchmarks but left as
+	 * they are, since directories may name them */
+	for (size_t i = 0; i < fs->metadata.Inodes; i++) {
+		ssize_t size = fs_stat(fs, i);
+		if (size < 0 || fs_is_dir(fs, i))
+			continue;
+		if (nfiles == files_cap) {
+			files_cap = files_cap ? files_cap * 2 : 1024;
+			files = realloc(files, files_cap * sizeof(*files));
+		}
+		files[nfiles++] = (struct file){ i, size, size };
+	}
+	nkept = nfiles;
+
+	pattern = malloc(2 * SEQ_CHUNK);
+	for (size_t i = 0; i < 2 * SEQ_CHUNK; i++)
+		pattern[i] = next_random();
+
+	if (csv) {
+		if ((out = fopen(csv, "a")) == NULL) {
+			fprintf(stderr, "Unable to open %s.\n", csv);
+			return (1);
+		}
+	}
+	if (ftell(out) <= 0)
+		fprintf(out, "label,round,ops,files,mib,used_pct,extents,"
+		    "extents_per_file,free_runs,largest_free_run,seq_mib_s,"
+		    "seq_disk_reads,rand_iops,rand_p50_us,rand_p99_us\n");
+
+	/* Round 0 is the image as it came */
+	for (int round = 0; round <= rounds; round++) {
+		for (size_t i = 0; round && i < ops; i++)
+			age_step(mix, median, fill);
+		fs_sync(fs);
+
+		measure(&m);
+		benchmark(&b, nreads);
+		fprintf(out, "%s,%d,%zu,%zu,%.1f,%.1f,%zu,%.2f,%zu,%zu,%.1f,%zu,"
+		    "%.0f,%.1f,%.1f\n", label ? label : argv[0], round,
+		    round * ops, m.files, m.bytes / 1048576.0,
+		    100.0 * m.used / m.blocks, m.extents,
+		    m.files ? (double)m.extents / m.files : 0, m.free_runs,
+		    m.largest_free, b.seq_mib_s, b.seq_reads, b.rand_iops,
+		    b.p50_us, b.p99_us);
+		fflush(out);
+	}
+
+	/* free_disk reports disk statistics on stdout; keep that CSV only */
+	fflush(stdout);
+	if (out != stdout)
+		fclose(out);
+	else
+		dup2(STDERR_FILENO, STDOUT_FILENO);
+	free_fs(fs);
+	free_disk(disk);
+	free(pattern);
+	free(files);
+	return (0);
+}
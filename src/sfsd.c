@@ -0,0 +1,513 @@
+/* sfsd.c
+ * ----------------------------------------------------------
+ *  File system server: owns one image and serves fs_* calls to
+ *  local clients over a Unix domain socket, or over shared-memory
+ *  rings a client attaches to through it (rpc.h, remote.h)
+ *
+ *  sfsd [delalloc] <diskfile> <nblocks> <socket>
+ * ----------------------------------------------------------
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+
+#include "fs.h"
+#include "disk.h"
+#include "rpc.h"
+
+#define CACHE_BLOCKS	1024
+#define DELALLOC_MB	16	/* buffered writes that force a sync */
+#define MAX_EVENTS	64
+#define READ_CHUNK	(256 << 10)	/* bytes taken from a socket per recv */
+#define IN_LIMIT	(4 * RPC_MAX_LENGTH)	/* unserved input that pauses reading */
+#define OUT_LIMIT	(8 << 20)	/* unsent output that pauses serving */
+
+/*
+ * One event loop serves every client. Each wakeup reads all a client has
+ * sent, serves every complete request in it and sends the responses back
+ * with as few writes as the socket allows, so a client that pipelines
+ * many requests gets its responses in batches.
+ */
+/* Everything registered with epoll begins with what it is; the listener
+ * is registered as NULL */
+enum { CLIENT = 1, RING };
+
+/*
+ * Rings shared with an attached client. The client posts requests and
+ * writes the submit eventfd; the server runs them against the slots and
+ * writes the complete eventfd. The socket stays open so a client that
+ * exits is noticed and its rings torn down.
+ */
+struct ring {
+	int kind;		/* RING */
+	int submit, complete;	/* eventfds: work posted, work done */
+	ShmRings *rings;
+	char *slots;
+	struct conn *conn;
+};
+
+struct conn {
+	int kind;		/* CLIENT */
+	int fd;
+	int dead;		/* dropped this wakeup, freed after it */
+	uint32_t events;	/* epoll interest currently registered */
+	char *in;		/* received, not yet served */
+	size_t in_len, in_cap;
+	char *out;		/* responses not yet sent */
+	size_t out_off, out_len, out_cap;
+	struct ring *ring;	/* shared-memory rings, once attached */
+	struct conn *prev, *next;
+};
+
+static FileSystem *fs;
+static struct conn *conns;
+static struct conn *graveyard;	/* dropped, waiting to be freed */
+static volatile sig_atomic_t stopping;
+
+static void
+on_signal(int sig)
+{
+	stopping = 1;
+}
+
+static void
+reserve(char **buf, size_t *cap, size_t need)
+{
+	if (need <= *cap)
+		return;
+	while (*cap < need)
+		*cap = *cap ? *cap * 2 : READ_CHUNK;
+	*buf = realloc(*buf, *cap);
+}
+
+/* Run one fs_* call; data is where a read lands or a write comes from */
+static int64_t
+call(RpcRequest *req, char *data)
+{
+	switch (req->Op) {
+	case RPC_CREATE:
+		return (fs_create(fs));
+	case RPC_REMOVE:
+		return (fs_remove(fs, req->Inumber));
+	case RPC_STAT:
+		return (fs_stat(fs, req->Inumber));
+	case RPC_READ:
+		return (fs_read(fs, req->Inumber, data, req->Length, req->Offset));
+	case RPC_WRITE:
+		return (fs_write(fs, req->Inumber, data, req->Length, req->Offset));
+	}
+	return (-1);
+}
+
+/* Run one request and append its response, with any data read, to the
+ * output buffer */
+static void
+execute(struct conn *c, RpcRequest *req, char *payload)
+{
+	RpcResponse resp = { -1, 0, 0 };
+	char *data;
+
+	if (c->out_off) {
+		memmove(c->out, c->out + c->out_off, c->out_len - c->out_off);
+		c->out_len -= c->out_off;
+		c->out_off = 0;
+	}
+	reserve(&c->out, &c->out_cap, c->out_len + sizeof(resp) +
+	    (req->Op == RPC_READ ? req->Length : 0));
+	data = c->out + c->out_len + sizeof(resp);
+
+	resp.Result = call(req, req->Op == RPC_READ ? data : payload);
+	if (req->Op == RPC_READ && resp.Result > 0)
+		resp.Length = resp.Result;
+
+	memcpy(c->out + c->out_len, &resp, sizeof(resp));
+	c->out_len += sizeof(resp) + resp.Length;
+}
+
+/* Release what a ring holds; the struct itself is freed with its client */
+static void
+close_ring(int ep, struct ring *r)
+{
+	if (r->submit >= 0) {
+		/* The client holds the same eventfd, so closing ours would
+		 * leave it registered */
+		epoll_ctl(ep, EPOLL_CTL_DEL, r->submit, NULL);
+		close(r->submit);
+	}
+	if (r->complete >= 0)
+		close(r->complete);
+	if (r->rings)
+		munmap(r->rings, SHM_SIZE);
+}
+
+/* Set up shared-memory rings for a client and send the response to its
+ * RPC_ATTACH carrying their fds; -1 if the client cannot be told */
+static int
+attach(int ep, struct conn *c)
+{
+	RpcResponse resp = { -1, 0, 0 };
+	struct iovec iov = { &resp, sizeof(resp) };
+	struct msghdr msg = { .msg_iov = &iov, .msg_iovlen = 1 };
+	union {
+		struct cmsghdr align;
+		char buf[CMSG_SPACE(3 * sizeof(int))];
+	} control;
+	struct cmsghdr *cmsg;
+	struct epoll_event ev;
+	struct ring *r;
+	void *base;
+	int mfd, fds[3];
+	ssize_t n;
+
+	r = calloc(1, sizeof(*r));
+	r->kind = RING;
+	r->conn = c;
+	r->submit = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	r->complete = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	mfd = memfd_create("sfsd", MFD_CLOEXEC);
+	if (mfd >= 0 && ftruncate(mfd, SHM_SIZE) == 0 &&
+	    (base = mmap(NULL, SHM_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED,
+	    mfd, 0)) != MAP_FAILED) {
+		r->rings = base;
+		r->slots = (char *)base + SHM_DATA_OFFSET;
+	}
+
+	ev.events = EPOLLIN;
+	ev.data.ptr = r;
+	if (r->rings && r->submit >= 0 && r->complete >= 0 &&
+	    epoll_ctl(ep, EPOLL_CTL_ADD, r->submit, &ev) == 0) {
+		fds[0] = mfd;
+		fds[1] = r->submit;
+		fds[2] = r->complete;
+		msg.msg_control = control.buf;
+		msg.msg_controllen = sizeof(control.buf);
+		cmsg = CMSG_FIRSTHDR(&msg);
+		cmsg->cmsg_level = SOL_SOCKET;
+		cmsg->cmsg_type = SCM_RIGHTS;
+		cmsg->cmsg_len = CMSG_LEN(sizeof(fds));
+		memcpy(CMSG_DATA(cmsg), fds, sizeof(fds));
+		resp.Result = 0;
+		c->ring = r;
+	} else {
+		close_ring(ep, r);
+		free(r);
+	}
+
+	/* Nothing else is queued, so the response goes out whole */
+	n = sendmsg(c->fd, &msg, MSG_NOSIGNAL);
+	if (mfd >= 0)
+		close(mfd);
+	return (n == sizeof(resp) ? 0 : -1);
+}
+
+/* Run every request posted on a client's submission ring, post their
+ * completions and wake the client; -1 on a corrupt ring */
+static int
+run_ring(struct ring *r)
+{
+	ShmRings *rings = r->rings;
+	uint32_t head, tail, done;
+	uint64_t count;
+
+	if (read(r->submit, &count, sizeof(count)) < 0 && errno != EAGAIN)
+		return (-1);
+
+	head = rings->Submit.Head;
+	tail = __atomic_load_n(&rings->Submit.Tail, __ATOMIC_ACQUIRE);
+	done = rings->Complete.Tail;
+	if (tail - head > SHM_SLOTS)
+		return (-1);
+
+	/* A client keeps no more requests in flight than it has slots, so
+	 * there is room for every completion */
+	for (; head != tail; head++) {
+		RpcRequest req = rings->Submissions[head % SHM_SLOTS];
+		RpcResponse resp = { -1, 0, req.Slot };
+
+		if (done - __atomic_load_n(&rings->Complete.Head,
+		    __ATOMIC_ACQUIRE) >= SHM_SLOTS)
+			return (-1);
+		if (req.Slot < SHM_SLOTS && req.Length <= SHM_SLOT_SIZE) {
+			resp.Result = call(&req,
+			    r->slots + (size_t)req.Slot * SHM_SLOT_SIZE);
+			if (req.Op == RPC_READ && resp.Result > 0)
+				resp.Length = resp.Result;
+		}
+		rings->Completions[done++ % SHM_SLOTS] = resp;
+	}
+
+	__atomic_store_n(&rings->Submit.Head, head, __ATOMIC_RELEASE);
+	__atomic_store_n(&rings->Complete.Tail, done, __ATOMIC_RELEASE);
+	count = 1;
+	if (write(r->complete, &count, sizeof(count)) < 0 && errno != EAGAIN)
+		return (-1);
+	return (0);
+}
+
+/* Serve the complete requests at the front of the input buffer until
+ * too much output is queued; -1 on a malformed request */
+static int
+serve(int ep, struct conn *c)
+{
+	size_t pos = 0;
+
+	while (c->out_len - c->out_off < OUT_LIMIT &&
+	    c->in_len - pos >= sizeof(RpcRequest)) {
+		RpcRequest req;
+		size_t payload;
+
+		memcpy(&req, c->in + pos, sizeof(req));
+		if (req.Length > RPC_MAX_LENGTH)
+			return (-1);
+		payload = req.Op == RPC_WRITE ? req.Length : 0;
+		if (c->in_len - pos - sizeof(req) < payload)
+			break;
+
+		/* Rings are handed out only when no response is pending,
+		 * since their fds travel with the response */
+		if (req.Op == RPC_ATTACH && c->ring == NULL &&
+		    c->out_len == c->out_off) {
+			if (attach(ep, c) < 0)
+				return (-1);
+		} else
+			execute(c, &req, c->in + pos + sizeof(req));
+		pos += sizeof(req) + payload;
+	}
+
+	memmove(c->in, c->in + pos, c->in_len - pos);
+	c->in_len -= pos;
+	return (0);
+}
+
+/* Send queued responses until the socket is full; -1 on error */
+static int
+flush_out(struct conn *c)
+{
+	while (c->out_off < c->out_len) {
+		ssize_t n = send(c->fd, c->out + c->out_off,
+		    c->out_len - c->out_off, MSG_NOSIGNAL);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			if (errno == EAGAIN || errno == EWOULDBLOCK)
+				break;
+			return (-1);
+		}
+		c->out_off += n;
+	}
+	if (c->out_off == c->out_len)
+		c->out_off = c->out_len = 0;
+	return (0);
+}
+
+/* Take input, serve it and send responses; -1 when the client is gone */
+static int
+handle(int ep, struct conn *c, uint32_t events)
+{
+	struct epoll_event ev;
+	uint32_t want;
+
+	while ((events & EPOLLIN) && c->in_len < IN_LIMIT) {
+		reserve(&c->in, &c->in_cap, c->in_len + READ_CHUNK);
+		ssize_t n = recv(c->fd, c->in + c->in_len, READ_CHUNK, 0);
+		if (n == 0)
+			return (-1);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			if (errno == EAGAIN || errno == EWOULDBLOCK)
+				break;
+			return (-1);
+		}
+		c->in_len += n;
+	}
+
+	/* Keep serving while the responses drain as fast as they are made */
+	for (;;) {
+		size_t before = c->in_len;
+		if (serve(ep, c) < 0 || flush_out(c) < 0)
+			return (-1);
+		if (c->in_len == before || c->out_len)
+			break;
+	}
+
+	/* Stop reading a client that is not taking its responses */
+	want = c->out_len ? EPOLLOUT : 0;
+	if (c->in_len < IN_LIMIT && c->out_len < OUT_LIMIT)
+		want |= EPOLLIN;
+	if (want != c->events) {
+		ev.events = want;
+		ev.data.ptr = c;
+		if (epoll_ctl(ep, EPOLL_CTL_MOD, c->fd, &ev) < 0)
+			return (-1);
+		c->events = want;
+	}
+	return (0);
+}
+
+/* Disconnect a client; it is freed by reap, as later events of the same
+ * wakeup may still point at it */
+static void
+drop(int ep, struct conn *c)
+{
+	close(c->fd);
+	if (c->ring)
+		close_ring(ep, c->ring);
+	if (c->prev)
+		c->prev->next = c->next;
+	else
+		conns = c->next;
+	if (c->next)
+		c->next->prev = c->prev;
+	c->dead = 1;
+	c->next = graveyard;
+	graveyard = c;
+}
+
+static void
+reap(void)
+{
+	while (graveyard) {
+		struct conn *c = graveyard;
+		graveyard = c->next;
+		free(c->in);
+		free(c->out);
+		free(c->ring);
+		free(c);
+	}
+}
+
+static void
+accept_all(int ep, int lfd)
+{
+	struct epoll_event ev;
+	int fd;
+
+	while ((fd = accept4(lfd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC)) >= 0) {
+		struct conn *c = calloc(1, sizeof(*c));
+		c->kind = CLIENT;
+		c->fd = fd;
+		c->events = EPOLLIN;
+		ev.events = c->events;
+		ev.data.ptr = c;
+		if (epoll_ctl(ep, EPOLL_CTL_ADD, fd, &ev) < 0) {
+			close(fd);
+			free(c);
+			continue;
+		}
+		c->next = conns;
+		if (conns)
+			conns->prev = c;
+		conns = c;
+	}
+}
+
+static int
+listen_on(const char *path)
+{
+	struct sockaddr_un addr = { .sun_family = AF_UNIX };
+	int fd;
+
+	if (strlen(path) >= sizeof(addr.sun_path)) {
+		fprintf(stderr, "Socket path %s is too long.\n", path);
+		return (-1);
+	}
+	strcpy(addr.sun_path, path);
+
+	/* A socket left by an earlier server is replaced */
+	unlink(path);
+	fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (fd < 0 || bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+	    listen(fd, SOMAXCONN) < 0) {
+		fprintf(stderr, "Unable to listen on %s: %s\n", path, strerror(errno));
+		if (fd >= 0)
+			close(fd);
+		return (-1);
+	}
+	return (fd);
+}
+
+int
+main(int argc, char **argv)
+{
+	struct epoll_event events[MAX_EVENTS], ev;
+	struct sigaction sa;
+	Disk *disk;
+	int delalloc, lfd, ep;
+
+	/* sfsd [delalloc] <diskfile> <nblocks> <socket> */
+	delalloc = argc > 1 && strcmp(argv[1], "delalloc") == 0;
+	argv += delalloc;
+	argc -= delalloc;
+	if (argc != 4) {
+		fprintf(stderr, "usage: sfsd [delalloc] <diskfile> <nblocks> <socket>\n");
+		return (1);
+	}
+
+	disk = new_disk();
+	disk_open(disk, argv[1], atoi(argv[2]));
+	disk_enable_cache(disk, CACHE_BLOCKS);
+
+	fs = new_fs();
+	if (!fs_mount(fs, disk)) {
+		fprintf(stderr, "Unable to mount %s.\n", argv[1]);
+		return (1);
+	}
+	if (delalloc)
+		fs_set_delalloc(fs, DELALLOC_MB << 20);
+
+	if ((lfd = listen_on(argv[3])) < 0)
+		return (1);
+
+	/* A signal ends the loop; buffered writes are synced on the way out */
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = on_signal;
+	sigaction(SIGINT, &sa, NULL);
+	sigaction(SIGTERM, &sa, NULL);
+	signal(SIGPIPE, SIG_IGN);
+
+	ep = epoll_create1(EPOLL_CLOEXEC);
+	ev.events = EPOLLIN;
+	ev.data.ptr = NULL;
+	epoll_ctl(ep, EPOLL_CTL_ADD, lfd, &ev);
+
+	while (!stopping) {
+		int n = epoll_wait(ep, events, MAX_EVENTS, -1);
+		for (int i = 0; i < n; i++) {
+			int *kind = events[i].data.ptr;
+			struct ring *r = (struct ring *)kind;
+			struct conn *c = (struct conn *)kind;
+
+			if (kind == NULL)
+				accept_all(ep, lfd);
+			else if (*kind == RING) {
+				if (!r->conn->dead && run_ring(r) < 0)
+					drop(ep, r->conn);
+			} else if (!c->dead && handle(ep, c, events[i].events) < 0)
+				drop(ep, c);
+		}
+		reap();
+	}
+
+	while (conns)
+		drop(ep, conns);
+	reap();
+	close(ep);
+	close(lfd);
+	unlink(argv[3]);
+
+	free_fs(fs);
+	free_disk(disk);
+	return (0);
+}
@@ -0,0 +1,458 @@
+/* sfsfuse.c
+ * ----------------------------------------------------------
+ *  FUSE daemon: mounts a SimpleFS image on the host
+ *
+ *  sfsfuse [delalloc] <diskfile> <nblocks> <mountpoint> [FUSE options]
+ * ----------------------------------------------------------
+ */
+
+#define FUSE_USE_VERSION 31
+
+#include <fuse.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include "fs.h"
+#include "dir.h"
+#include "disk.h"
+
+#define CACHE_BLOCKS	1024
+#define DELALLOC_MB	16	/* buffered writes that force a sync */
+#define MAX_TRANSFER	(1 << 20)	/* max_read, max_write and readahead */
+
+/*
+ * FUSE runs a thread per outstanding request, but the file system keeps
+ * no locks of its own: every fs_* call is made under sfs.lock, as the
+ * shell's pool workers do.
+ */
+static struct {
+	char image[PATH_MAX];
+	int nblocks;
+	int delalloc;
+	Disk *disk;
+	FileSystem *fs;
+	pthread_mutex_t lock;
+} sfs = { .lock = PTHREAD_MUTEX_INITIALIZER };
+
+struct fill {
+	void *buf;
+	fuse_fill_dir_t filler;
+};
+
+/* Whether path names the root directory */
+static int
+is_root(const char *path)
+{
+	return (path[strspn(path, "/")] == 0);
+}
+
+static void
+fill_stat(size_t inumber, struct stat *st)
+{
+	int dir = fs_is_dir(sfs.fs, inumber);
+
+	st->st_ino = inumber + 1;
+	st->st_mode = dir ? S_IFDIR | 0755 : S_IFREG | 0644;
+	st->st_nlink = dir ? 2 : 1;
+	st->st_uid = getuid();
+	st->st_gid = getgid();
+	st->st_size = fs_stat(sfs.fs, inumber);
+	st->st_blksize = sfs.fs->blockSize;
+	st->st_blocks = fs_blocks(sfs.fs, inumber) * (sfs.fs->blockSize / 512);
+}
+
+/* Open the image once FUSE has daemonized, so the cache and array
+ * threads belong to the process that serves requests */
+static void *
+sfs_init(struct fuse_conn_info *conn, struct fuse_config *cfg)
+{
+	cfg->use_ino = 1;
+
+	conn->max_write = MAX_TRANSFER;
+	conn->max_readahead = MAX_TRANSFER;
+	if (conn->capable & FUSE_CAP_SPLICE_READ)
+		conn->want |= FUSE_CAP_SPLICE_READ;
+	if (conn->capable & FUSE_CAP_SPLICE_WRITE)
+		conn->want |= FUSE_CAP_SPLICE_WRITE;
+	if (conn->capable & FUSE_CAP_SPLICE_MOVE)
+		conn->want |= FUSE_CAP_SPLICE_MOVE;
+
+	sfs.disk = new_disk();
+	disk_open(sfs.disk, sfs.image, sfs.nblocks);
+	disk_enable_cache(sfs.disk, CACHE_BLOCKS);
+
+	sfs.fs = new_fs();
+	if (!fs_mount(sfs.fs, sfs.disk)) {
+		fprintf(stderr, "Unable to mount %s.\n", sfs.image);
+		fuse_exit(fuse_get_context()->fuse);
+		return (NULL);
+	}
+	if (sfs.delalloc)
+		fs_set_delalloc(sfs.fs, DELALLOC_MB << 20);
+
+	return (NULL);
+}
+
+/* Buffered writes reach the image before it is closed */
+static void
+sfs_destroy(void *private_data)
+{
+	pthread_mutex_lock(&sfs.lock);
+	free_fs(sfs.fs);
+	free_disk(sfs.disk);
+	sfs.fs = NULL;
+	sfs.disk = NULL;
+	pthread_mutex_unlock(&sfs.lock);
+}
+
+static int
+sfs_getattr(const char *path, struct stat *st, struct fuse_file_info *fi)
+{
+	ssize_t inumber;
+	int rt = 0;
+
+	memset(st, 0, sizeof(*st));
+
+	pthread_mutex_lock(&sfs.lock);
+	inumber = fs_lookup(sfs.fs, path);
+	if (inumber >= 0) {
+		fill_stat(inumber, st);
+	} else if (is_root(path)) {
+		/* The root is only created by the first entry made in it */
+		st->st_mode = S_IFDIR | 0755;
+		st->st_nlink = 2;
+		st->st_uid = getuid();
+		st->st_gid = getgid();
+	} else {
+		rt = -ENOENT;
+	}
+	pthread_mutex_unlock(&sfs.lock);
+
+	return (rt);
+}
+
+static void
+fill_entry(const char *name, uint32_t inumber, void *arg)
+{
+	struct fill *fill = arg;
+	struct stat st;
+
+	memset(&st, 0, sizeof(st));
+	st.st_ino = inumber + 1;
+	fill->filler(fill->buf, name, &st, 0, 0);
+}
+
+static int
+sfs_readdir(const char *path, void *buf, fuse_fill_dir_t filler, off_t offset,
+    struct fuse_file_info *fi, enum fuse_readdir_flags flags)
+{
+	struct fill fill = { buf, filler };
+	ssize_t inumber;
+	int rt = 0;
+
+	pthread_mutex_lock(&sfs.lock);
+	inumber = fs_lookup(sfs.fs, path);
+	if (inumber < 0 && !is_root(path)) {
+		rt = -ENOENT;
+	} else if (inumber >= 0 && !fs_is_dir(sfs.fs, inumber)) {
+		rt = -ENOTDIR;
+	} else {
+		filler(buf, ".", NULL, 0, 0);
+		filler(buf, "..", NULL, 0, 0);
+		if (inumber >= 0)
+			fs_readdir(sfs.fs, inumber, fill_entry, &fill);
+	}
+	pthread_mutex_unlock(&sfs.lock);
+
+	return (rt);
+}
+
+/* The kernel has checked the parent exists, so a failed create is out
+ * of inodes or space */
+static int
+sfs_mkdir(const char *path, mode_t mode)
+{
+	int rt = 0;
+
+	pthread_mutex_lock(&sfs.lock);
+	if (fs_lookup(sfs.fs, path) >= 0)
+		rt = -EEXIST;
+	else if (fs_mkdir(sfs.fs, path) < 0)
+		rt = -ENOSPC;
+	pthread_mutex_unlock(&sfs.lock);
+
+	return (rt);
+}
+
+static int
+sfs_create(const char *path, mode_t mode, struct fuse_file_info *fi)
+{
+	ssize_t inumber = -1;
+	int rt = 0;
+
+	pthread_mutex_lock(&sfs.lock);
+	if (fs_lookup(sfs.fs, path) >= 0)
+		rt = -EEXIST;
+	else if ((inumber = fs_create_path(sfs.fs, path)) < 0)
+		rt = -ENOSPC;
+	pthread_mutex_unlock(&sfs.lock);
+
+	fi->fh = inumber;
+	return (rt);
+}
+
+static int
+sfs_open(const char *path, struct fuse_file_info *fi)
+{
+	ssize_t inumber;
+	int dir;
+
+	pthread_mutex_lock(&sfs.lock);
+	inumber = fs_lookup(sfs.fs, path);
+	dir = inumber >= 0 && fs_is_dir(sfs.fs, inumber);
+	pthread_mutex_unlock(&sfs.lock);
+
+	if (inumber < 0)
+		return (-ENOENT);
+	if (dir)
+		return (-EISDIR);
+	fi->fh = inumber;
+	return (0);
+}
+
+/* Links are removed along with their inode: there are no hard links */
+static int
+remove_path(const char *path, int want_dir)
+{
+	ssize_t inumber;
+	int rt = 0;
+
+	pthread_mutex_lock(&sfs.lock);
+	inumber = fs_lookup(sfs.fs, path);
+	if (inumber < 0)
+		rt = -ENOENT;
+	else if (fs_is_dir(sfs.fs, inumber) != want_dir)
+		rt = want_dir ? -ENOTDIR : -EISDIR;
+	else if (!fs_unlink(sfs.fs, path))
+		rt = want_dir ? -ENOTEMPTY : -EIO;
+	pthread_mutex_unlock(&sfs.lock);
+
+	return (rt);
+}
+
+static int
+sfs_unlink(const char *path)
+{
+	return (remove_path(path, 0));
+}
+
+static int
+sfs_rmdir(const char *path)
+{
+	return (remove_path(path, 1));
+}
+
+static int
+sfs_truncate(const char *path, off_t size, struct fuse_file_info *fi)
+{
+	ssize_t inumber;
+	int rt = 0;
+
+	pthread_mutex_lock(&sfs.lock);
+	inumber = fs_lookup(sfs.fs, path);
+	if (inumber < 0)
+		rt = -ENOENT;
+	else if (fs_is_dir(sfs.fs, inumber))
+		rt = -EISDIR;
+	else if (!fs_truncate(sfs.fs, inumber, size))
+		rt = size > fs_stat(sfs.fs, inumber) ? -EFBIG : -ENOSPC;
+	pthread_mutex_unlock(&sfs.lock);
+
+	return (rt);
+}
+
+/* Only plain preallocation: the file grows to cover the range */
+static int
+sfs_fallocate(const char *path, int mode, off_t offset, off_t length,
+    struct fuse_file_info *fi)
+{
+	int ok;
+
+	if (mode != 0)
+		return (-EOPNOTSUPP);
+
+	pthread_mutex_lock(&sfs.lock);
+	ok = fs_fallocate(sfs.fs, fi->fh, offset, length);
+	pthread_mutex_unlock(&sfs.lock);
+
+	return (ok ? 0 : -ENOSPC);
+}
+
+static int
+sfs_read(const char *path, char *buf, size_t size, off_t offset,
+    struct fuse_file_info *fi)
+{
+	ssize_t n;
+
+	pthread_mutex_lock(&sfs.lock);
+	n = fs_read(sfs.fs, fi->fh, buf, size, offset);
+	pthread_mutex_unlock(&sfs.lock);
+
+	/* Reads past the end of file come back short */
+	return (n < 0 ? 0 : n);
+}
+
+static int
+write_at(size_t inumber, char *data, size_t size, off_t offset)
+{
+	ssize_t n;
+
+	pthread_mutex_lock(&sfs.lock);
+	n = fs_write(sfs.fs, inumber, data, size, offset);
+	pthread_mutex_unlock(&sfs.lock);
+
+	if (n < 0)
+		return (-EFBIG);
+	if (n == 0 && size > 0)
+		return (-ENOSPC);
+	return (n);
+}
+
+static int
+sfs_write(const char *path, const char *buf, size_t size, off_t offset,
+    struct fuse_file_info *fi)
+{
+	return (write_at(fi->fh, (char *)buf, size, offset));
+}
+
+/* With splicing the payload may still sit in a pipe; it is pulled into
+ * one buffer so fs_write can allocate the whole range at once */
+static int
+sfs_write_buf(const char *path, struct fuse_bufvec *src, off_t offset,
+    struct fuse_file_info *fi)
+{
+	size_t size = fuse_buf_size(src);
+	struct fuse_bufvec dst = FUSE_BUFVEC_INIT(size);
+	ssize_t copied;
+	int rt;
+
+	dst.buf[0].mem = malloc(size);
+	if (dst.buf[0].mem == NULL)
+		return (-ENOMEM);
+
+	copied = fuse_buf_copy(&dst, src, 0);
+	rt = copied < 0 ? copied : write_at(fi->fh, dst.buf[0].mem, copied, offset);
+
+	free(dst.buf[0].mem);
+	return (rt);
+}
+
+static int
+sfs_fsync(const char *path, int datasync, struct fuse_file_info *fi)
+{
+	int ok;
+
+	pthread_mutex_lock(&sfs.lock);
+	ok = fs_sync(sfs.fs);
+	pthread_mutex_unlock(&sfs.lock);
+
+	return (ok ? 0 : -EIO);
+}
+
+/* No timestamps are kept; accepting the call lets touch(1) work */
+static int
+sfs_utimens(const char *path, const struct timespec tv[2],
+    struct fuse_file_info *fi)
+{
+	return (0);
+}
+
+static int
+sfs_statfs(const char *path, struct statvfs *st)
+{
+	SuperBlock *sb;
+	size_t used = 0;
+
+	memset(st, 0, sizeof(*st));
+
+	pthread_mutex_lock(&sfs.lock);
+	sb = &sfs.fs->metadata;
+	st->f_bsize = st->f_frsize = sfs.fs->blockSize;
+	st->f_blocks = sb->Blocks;
+	for (uint32_t g = 0; g < sfs.fs->groups; g++)
+		st->f_bfree += sfs.fs->groupFree[g];
+	st->f_bavail = st->f_bfree;
+	for (uint32_t i = 0; i < sb->InodeBlocks; i++)
+		used += sfs.fs->inodeTracker[i];
+	st->f_files = sb->Inodes;
+	st->f_ffree = st->f_favail = sb->Inodes - used;
+	st->f_namemax = DIR_NAME_MAX;
+	pthread_mutex_unlock(&sfs.lock);
+
+	return (0);
+}
+
+static const struct fuse_operations sfs_ops = {
+	.init		= sfs_init,
+	.destroy	= sfs_destroy,
+	.getattr	= sfs_getattr,
+	.readdir	= sfs_readdir,
+	.mkdir		= sfs_mkdir,
+	.create		= sfs_create,
+	.open		= sfs_open,
+	.unlink		= sfs_unlink,
+	.rmdir		= sfs_rmdir,
+	.truncate	= sfs_truncate,
+	.fallocate	= sfs_fallocate,
+	.read		= sfs_read,
+	.write		= sfs_write,
+	.write_buf	= sfs_write_buf,
+	.fsync		= sfs_fsync,
+	.utimens	= sfs_utimens,
+	.statfs		= sfs_statfs,
+};
+
+int
+main(int argc, char **argv)
+{
+	struct fuse_args args = FUSE_ARGS_INIT(0, NULL);
+	char opt[PATH_MAX + 32];
+	int rt;
+
+	/* sfsfuse [delalloc] <diskfile> <nblocks> <mountpoint> [FUSE options] */
+	sfs.delalloc = argc > 1 && strcmp(argv[1], "delalloc") == 0;
+	argv += sfs.delalloc;
+	argc -= sfs.delalloc;
+	if (argc < 4) {
+		fprintf(stderr, "usage: sfsfuse [delalloc] <diskfile> <nblocks> <mountpoint> [FUSE options]\n");
+		return (1);
+	}
+
+	/* The daemon changes to / before it opens the image */
+	if (realpath(argv[1], sfs.image) == NULL) {
+		fprintf(stderr, "Unable to open %s.\n", argv[1]);
+		return (1);
+	}
+	sfs.nblocks = atoi(argv[2]);
+
+	/* FUSE's own loop is multi-threaded unless -s is given */
+	fuse_opt_add_arg(&args, argv[0]);
+	for (int i = 3; i < argc; i++)
+		fuse_opt_add_arg(&args, argv[i]);
+	snprintf(opt, sizeof(opt), "-ofsname=%s,subtype=sfs", sfs.image);
+	fuse_opt_add_arg(&args, opt);
+	snprintf(opt, sizeof(opt), "-omax_read=%d", MAX_TRANSFER);
+	fuse_opt_add_arg(&args, opt);
+
+	rt = fuse_main(args.argc, args.argv, &sfs_ops, NULL);
+	fuse_opt_free_args(&args);
+	return (rt);
+}